@@ -0,0 +1,286 @@
+/* allocCheck.cc
+ *
+ * SecureCollabNotes Allocation Harness
+ *
+ * This program proves that steady-state requests do not allocate. It
+ * links the server's real request handling (requestHandler.o and
+ * noteStore.o) without any sockets, replaces the global allocator with
+ * a counting one, warms the server state up, and then runs a fixed
+ * workload of each opcode. If the average number of allocations per
+ * request for any opcode exceeds its budget, the program exits with
+ * status 1, so `make alloccheck` fails.
+ *
+ * The C allocator (malloc, calloc, realloc) is counted through the
+ * linker's --wrap option; operator new and new[] are replaced below.
+ *
+ * Usage: allocCheck
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <new>
+
+#include "finalPacket.h"
+#include "diffieHellman.h"
+#include "xor.h"
+#include "noteStore.h"
+#include "requestHandler.h"
+#include "fanout.h"
+
+/* Number of simulated clients and rooms */
+const int ALLOC_CLIENTS = 16;
+const int ALLOC_ROOMS = 4;
+
+/* Requests run before any counting starts */
+const int WARMUP_POSTS = 4096;
+const int WARMUP_LISTS = 64;
+
+/* Allocation budget for one opcode's measured phase.
+ *
+ * arg is the request's room_id field (for a join, the number of notes to
+ * preload). budget is the highest acceptable average number of
+ * allocations per request. Creating rooms and posting notes must allocate
+ * once per block/chunk, so their budgets are small fractions rather than
+ * zero.
+ */
+struct AllocBudget {
+    const char *name;
+    int op;
+    int arg;
+    int requests;
+    double budget;
+};
+
+AllocBudget budgets[] = {
+    { "create",  OP_CREATE_ROOM, 0, 1024,  1.0 / 16 },
+    { "join",    OP_JOIN_ROOM,   0, 4096,  0 },
+    { "preload", OP_JOIN_ROOM,   4, 4096,  0 },
+    { "post",    OP_POST_NOTE,   0, 65536, 1.0 / 64 },
+    { "list",    OP_LIST_NOTES,  0, 64,    0 },
+};
+const int BUDGET_COUNT = sizeof(budgets) / sizeof(budgets[0]);
+
+/* Function prototypes for top-down design */
+void setupClients();
+void warmUp();
+bool runPhase(AllocBudget *b);
+
+/* Helper functions */
+void sendRequest(ClientContext *ctx, int op, int arg, int tag,
+                 const char *text);
+
+/* Global variables */
+ClientContext clients[ALLOC_CLIENTS];
+int inviteCodes[ALLOC_ROOMS];
+unsigned long long allocCount = 0;
+unsigned long long packetsSent = 0;
+Packet lastResponse;
+FILE *report;
+
+
+/* --- Counting allocator --- */
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocCount++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    allocCount++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    allocCount++;
+    return __real_realloc(p, size);
+}
+}
+
+void *operator new(size_t size)
+{
+    allocCount++;
+    void *p = __real_malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+
+int main(int argc, char *argv[])
+{
+    /* The handlers log every request; keep that off the report. Writing
+     * once before counting also makes stdio allocate its buffer now.
+     */
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+    printf("allocCheck warm-up\n");
+
+    setupClients();
+    warmUp();
+
+    fprintf(report, "%-8s %10s %12s %12s %8s\n", "op", "requests",
+            "allocs", "per request", "budget");
+
+    bool passed = true;
+    for (int i = 0; i < BUDGET_COUNT; i++) {
+        if (!runPhase(&budgets[i])) {
+            passed = false;
+        }
+    }
+
+    fprintf(report, "%s\n", passed ? "PASS" : "FAIL: allocation budget exceeded");
+    fclose(report);
+    return passed ? 0 : 1;
+}
+
+
+void setupClients()
+{
+    for (int i = 0; i < ALLOC_CLIENTS; i++) {
+        ClientContext *ctx = &clients[i];
+        initClientContext(ctx, NULL, i + 1);
+
+        /* Real handshake, so the shared key is set up by the server */
+        unsigned long long priv = dh_generate_private();
+        Packet p;
+        memset(&p, 0, sizeof(p));
+        p.op = OP_DH_PUB;
+        sprintf(p.message, "%llu", dh_compute_public(priv));
+        handleRequest(ctx, &p);
+
+        unsigned long long server_pub = strtoull(lastResponse.message, NULL, 10);
+        if (dh_compute_shared(server_pub, priv) != ctx->shared_key) {
+            fprintf(report, "FAIL: handshake keys differ\n");
+            exit(1);
+        }
+    }
+
+    /* The first few clients create the rooms; everyone else joins one */
+    for (int i = 0; i < ALLOC_ROOMS; i++) {
+        sendRequest(&clients[i], OP_CREATE_ROOM, 0, 0, NULL);
+        inviteCodes[i] = lastResponse.tag;
+    }
+    for (int i = ALLOC_ROOMS; i < ALLOC_CLIENTS; i++) {
+        sendRequest(&clients[i], OP_JOIN_ROOM, 0,
+                    inviteCodes[i % ALLOC_ROOMS], NULL);
+    }
+
+    /* Half the clients subscribe, so posts are pushed as well */
+    for (int i = 0; i < ALLOC_CLIENTS; i += 2) {
+        sendRequest(&clients[i], OP_SUBSCRIBE, 0, 1, NULL);
+    }
+}
+
+
+void warmUp()
+{
+    for (int i = 0; i < WARMUP_POSTS; i++) {
+        sendRequest(&clients[i % ALLOC_CLIENTS], OP_POST_NOTE, 0, 0,
+                    "warm-up note");
+    }
+    for (int i = 0; i < WARMUP_LISTS; i++) {
+        sendRequest(&clients[i % ALLOC_CLIENTS], OP_LIST_NOTES, 0, 0, NULL);
+    }
+}
+
+
+/* Run one opcode's workload and check it against its budget */
+bool runPhase(AllocBudget *b)
+{
+    unsigned long long before = allocCount;
+
+    for (int i = 0; i < b->requests; i++) {
+        ClientContext *ctx = &clients[i % ALLOC_CLIENTS];
+        int tag = 0;
+        if (b->op == OP_JOIN_ROOM) {
+            tag = inviteCodes[i % ALLOC_ROOMS];
+        }
+        sendRequest(ctx, b->op, b->arg, tag, "steady-state note text");
+    }
+
+    unsigned long long allocs = allocCount - before;
+    double perRequest = (double)allocs / b->requests;
+    bool ok = perRequest <= b->budget;
+
+    fprintf(report, "%-8s %10d %12llu %12.4f %8.4f %s\n", b->name, b->requests,
+            allocs, perRequest, b->budget, ok ? "ok" : "OVER BUDGET");
+    return ok;
+}
+
+
+/* --- Helper Functions --- */
+
+/* Encrypt a request the way finalClient does and hand it to the server */
+void sendRequest(ClientContext *ctx, int op, int arg, int tag,
+                 const char *text)
+{
+    Packet req;
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.room_id = arg;
+    req.tag = tag;
+    if (text != NULL) {
+        strncpy(req.message, text, MSG_SIZE - 1);
+    }
+    xor_buffer(req.message, MSG_SIZE, ctx->shared_key);
+    handleRequest(ctx, &req);
+
+    /* Each request is a turn of the event loop of its own */
+    fanout_flush(NULL);
+}
+
+
+/* Responses are decrypted into lastResponse instead of being sent */
+bool transmitPacket(ClientContext *ctx, Packet *p)
+{
+    memcpy(&lastResponse, p, sizeof(Packet));
+    if (ctx->dh_completed && p->op != OP_DH_PUB) {
+        xor_buffer(lastResponse.message, MSG_SIZE, ctx->shared_key);
+    }
+    packetsSent++;
+    return true;
+}
+
+
+/* No fan-out threads are started here, so nothing is pushed this way */
+int transmitBytes(ClientContext *ctx, const void *data, int len, bool wait)
+{
+    packetsSent += len / sizeof(Packet);
+    return len;
+}
@@ -0,0 +1,55 @@
+/* bufferPool.cc
+ *
+ * Shared I/O Buffer Pool - Implementation
+ */
+
+#include "bufferPool.h"
+
+#include <stdlib.h>
+
+static PoolBuffer *freeList = NULL;
+static int idleCount = 0;
+static int inUseCount = 0;
+
+
+PoolBuffer* pool_borrow()
+{
+    PoolBuffer *b = freeList;
+    if (b != NULL) {
+        freeList = b->next;
+        idleCount--;
+    } else {
+        b = new PoolBuffer;
+    }
+
+    b->len = 0;
+    b->next = NULL;
+    inUseCount++;
+    return b;
+}
+
+
+void pool_return(PoolBuffer *b)
+{
+    inUseCount--;
+
+    if (idleCount >= POOL_MAX_IDLE) {
+        delete b;
+        return;
+    }
+    b->next = freeList;
+    freeList = b;
+    idleCount++;
+}
+
+
+int pool_in_use()
+{
+    return inUseCount;
+}
+
+
+int pool_idle()
+{
+    return idleCount;
+}
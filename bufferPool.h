@@ -0,0 +1,43 @@
+/* bufferPool.h
+ *
+ * Shared I/O Buffer Pool - Header File
+ *
+ * Connections only need receive and send buffers while data is actually
+ * in flight. Rather than giving every connection its own buffers, the
+ * server borrows one from this pool when bytes arrive (or a reply is
+ * produced) and hands it back as soon as it has been drained. An idle
+ * connection therefore holds no buffer memory at all.
+ *
+ * Returned buffers are kept on a free list for reuse, up to
+ * POOL_MAX_IDLE of them; any beyond that are released so that a burst of
+ * activity does not pin memory forever.
+ */
+
+#ifndef _BUFFERPOOL_H
+#define _BUFFERPOOL_H
+
+#include <stddef.h>
+
+/* Bytes of data in each pooled buffer (room for 60 packets) */
+const int POOL_BUFFER_SIZE = 16384;
+
+/* Largest number of unused buffers kept for reuse */
+const int POOL_MAX_IDLE = 256;
+
+struct PoolBuffer {
+    int len;              /* bytes of valid data in data[] */
+    PoolBuffer *next;     /* free list link while in the pool */
+    char data[POOL_BUFFER_SIZE];
+};
+
+/* Take an empty buffer from the pool (allocating if none is free) */
+PoolBuffer* pool_borrow();
+
+/* Give a buffer back to the pool */
+void pool_return(PoolBuffer *b);
+
+/* Buffers currently lent out, and buffers waiting on the free list */
+int pool_in_use();
+int pool_idle();
+
+#endif
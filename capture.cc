@@ -0,0 +1,117 @@
+/* capture.cc
+ *
+ * Traffic Capture - Implementation
+ *
+ * See capture.h for the file format.
+ */
+
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Records are buffered by stdio in large chunks so that capturing does
+ * not add a write() per request to the server's hot path.
+ */
+const size_t CAPTURE_BUFFER_SIZE = 1 << 20;
+
+static FILE *captureFile = NULL;
+static struct timespec captureStart;
+
+
+static uint64_t elapsedMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - captureStart.tv_sec) * 1000000 +
+           (now.tv_nsec - captureStart.tv_nsec) / 1000;
+}
+
+
+bool capture_open(const char *path)
+{
+    captureFile = fopen(path, "wb");
+    if (captureFile == NULL) {
+        return false;
+    }
+    setvbuf(captureFile, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    CaptureHeader hdr;
+    memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CAPTURE_VERSION;
+    hdr.record_size = sizeof(CaptureRecord);
+    fwrite(&hdr, sizeof(hdr), 1, captureFile);
+
+    clock_gettime(CLOCK_MONOTONIC, &captureStart);
+    return true;
+}
+
+
+bool capture_enabled()
+{
+    return captureFile != NULL;
+}
+
+
+void capture_record(uint32_t conn_id, int op, int room_id, int tag,
+                    int arg, int payload_len)
+{
+    if (captureFile == NULL) {
+        return;
+    }
+
+    CaptureRecord rec;
+    rec.time_us = elapsedMicros();
+    rec.conn_id = conn_id;
+    rec.room_id = room_id;
+    rec.tag = tag;
+    rec.arg = arg;
+    rec.op = (uint16_t)op;
+    rec.payload_len = (uint16_t)payload_len;
+    rec.reserved = 0;
+    fwrite(&rec, sizeof(rec), 1, captureFile);
+}
+
+
+void capture_close()
+{
+    if (captureFile != NULL) {
+        fclose(captureFile);
+        captureFile = NULL;
+    }
+}
+
+
+bool capture_load(const char *path, CaptureRecord **records, size_t *count)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return false;
+    }
+
+    CaptureHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != CAPTURE_VERSION ||
+        hdr.record_size != sizeof(CaptureRecord)) {
+        fclose(f);
+        return false;
+    }
+
+    /* Size the array from the file length, then read it in one go */
+    fseek(f, 0, SEEK_END);
+    long bytes = ftell(f) - (long)sizeof(hdr);
+    fseek(f, sizeof(hdr), SEEK_SET);
+
+    size_t n = bytes > 0 ? bytes / sizeof(CaptureRecord) : 0;
+    CaptureRecord *recs = (CaptureRecord *)malloc((n > 0 ? n : 1) *
+                                                  sizeof(CaptureRecord));
+    n = fread(recs, sizeof(CaptureRecord), n, f);
+    fclose(f);
+
+    *records = recs;
+    *count = n;
+    return true;
+}
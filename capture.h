@@ -0,0 +1,82 @@
+/* capture.h
+ *
+ * Traffic Capture - Header File
+ *
+ * The server can record every request it handles to a compact binary
+ * file so that a real load pattern can later be re-driven against a new
+ * build with finalReplay.
+ *
+ * Only request metadata is recorded (time, connection, opcode, room,
+ * the request's tag and room_id fields and payload size). Note contents are never written to disk; the
+ * replay tool fills payloads with filler bytes of the recorded size.
+ *
+ * FILE LAYOUT:
+ * -----------
+ *   CaptureHeader                      (once)
+ *   CaptureRecord, CaptureRecord, ...  (one per event, in arrival order)
+ *
+ * Connection lifetimes are recorded too: a connection's first record is
+ * its OP_DH_PUB handshake and its last is OP_DISCONNECT.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+const char CAPTURE_MAGIC[8] = { 'S', 'N', 'C', 'A', 'P', 'T', 'R', '1' };
+const uint32_t CAPTURE_VERSION = 2;
+
+struct CaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   /* sizeof(CaptureRecord) when written */
+};
+
+/* One recorded event (32 bytes).
+ *
+ * time_us:     Microseconds since the capture was started
+ * conn_id:     Server-assigned connection number (never reused)
+ * room_id:     Room the request applied to, or -1 if none
+ * tag:         The request's tag field (e.g. the invite code for a join)
+ * arg:         The request's own room_id field (e.g. the preload count
+ *              of a join, or the first note id of OP_LIST_RANGE)
+ * op:          The request's operation code
+ * payload_len: Length of the decrypted message text
+ */
+struct CaptureRecord {
+    uint64_t time_us;
+    uint32_t conn_id;
+    int32_t room_id;
+    int32_t tag;
+    int32_t arg;
+    uint16_t op;
+    uint16_t payload_len;
+    uint32_t reserved;
+};
+
+/* Start recording to the given file (truncated if it exists).
+ * Returns false if the file could not be created.
+ */
+bool capture_open(const char *path);
+
+/* Returns true while a capture file is open */
+bool capture_enabled();
+
+/* Append one event to the capture file. Does nothing if capture is off. */
+void capture_record(uint32_t conn_id, int op, int room_id, int tag,
+                    int arg, int payload_len);
+
+/* Flush and close the capture file */
+void capture_close();
+
+/* Read a whole capture file into memory.
+ *
+ * On success *records points to a malloc'd array of *count records which
+ * the caller must free(). Returns false if the file is missing or is not
+ * a capture file.
+ */
+bool capture_load(const char *path, CaptureRecord **records, size_t *count);
+
+#endif
@@ -0,0 +1,708 @@
+/* checkpoint.cc
+ *
+ * Incremental Checkpoints - Implementation
+ *
+ * See checkpoint.h for the file layout and when merges happen.
+ */
+
+#include "checkpoint.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "finalPacket.h"
+#include "noteStore.h"
+#include "crc32c.h"
+#include "taskPool.h"
+
+/* stdio buffer used for reading and writing checkpoint files */
+const size_t CKPT_BUFFER_SIZE = 1 << 20;
+
+/* One input of a merge: a checkpoint file positioned at a room */
+struct CkptReader {
+    FILE *f;
+    char path[600];
+    uint32_t crc;           /* running CRC of the current room block */
+    uint64_t left;          /* rooms not yet read */
+    CkptRoom room;          /* current room, if valid */
+    bool valid;
+    bool ok;                /* false once the file turned out damaged */
+};
+
+/* Where a merge sends its output: the live store, or a new base file */
+typedef void (*RoomSink)(CkptRoom *room, void *arg);
+typedef void (*NoteSink)(const char *text, int len, void *arg);
+typedef void (*RoomEndSink)(void *arg);
+
+/* A background merge of deltas (base, upto] into a new base */
+struct MergeJob {
+    uint32_t base;
+    uint32_t upto;
+    bool done;
+    bool ok;
+};
+
+static char ckptDir[512];
+static uint32_t baseSequence = 0;    /* last delta folded into base.ckpt */
+static uint32_t lastSequence = 0;    /* last delta written */
+
+static MergeJob mergeJob;
+static bool merging = false;
+static int mergeClass = -1;
+
+/* Function prototypes for top-down design */
+static bool mergeFiles(uint32_t base, uint32_t upto, RoomSink roomSink,
+                       NoteSink noteSink, RoomEndSink endSink, void *arg,
+                       long *bytes);
+static bool openReader(CkptReader *r, const char *path, CkptHeader *hdr);
+static bool nextRoom(CkptReader *r);
+static bool readNote(CkptReader *r, char *text, int *len);
+static bool finishRoom(CkptReader *r);
+static void sealHeader(CkptHeader *hdr);
+static void mergeDeltas(void *arg);
+static void reapMerge();
+static void writeNotesAfter(FILE *f, NoteChunk *c, int after, uint32_t *crc);
+static void writeText(FILE *f, const char *text, int maxLen, uint32_t *crc);
+static bool commitFile(FILE *f, const char *tmp, const char *path);
+static bool setDir(const char *dir);
+static bool basePath(char *buf, size_t size);
+static bool deltaPath(char *buf, size_t size, uint32_t sequence);
+static int compareRoomIds(const void *a, const void *b);
+
+
+/* --- Loading --- */
+
+struct LoadState {
+    Room *room;
+    long rooms;
+    long notes;
+};
+
+
+static void loadRoom(CkptRoom *c, void *arg)
+{
+    LoadState *st = (LoadState *)arg;
+
+    Room *r = newRoom(c->id, c->invite_code, c->room_key);
+    reserveRoomIndex(roomCount() + 1);
+    indexRoomById(r);
+    linkRestoredRoom(r);
+    r->saved_notes = 0;
+
+    st->room = r;
+    st->rooms++;
+}
+
+
+static void loadNote(const char *text, int len, void *arg)
+{
+    LoadState *st = (LoadState *)arg;
+
+    char content[MSG_SIZE];
+    memset(content, 0, sizeof(content));
+    memcpy(content, text, len);
+    addNote(st->room, content);
+    st->room->saved_notes = st->room->note_count;
+    st->notes++;
+}
+
+
+bool ckpt_load(const char *dir, CkptStats *stats)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memset(stats, 0, sizeof(CkptStats));
+    if (!setDir(dir)) {
+        return false;
+    }
+
+    /* The base names the last delta it includes */
+    char path[600];
+    basePath(path, sizeof(path));
+    CkptReader base;
+    CkptHeader hdr;
+    if (!openReader(&base, path, &hdr)) {
+        printf("Error: %s is damaged\n", path);
+        return false;
+    }
+    baseSequence = base.f != NULL ? hdr.sequence : 0;
+    if (base.f != NULL) {
+        fclose(base.f);
+    }
+
+    /* Find the newest delta; remove leftovers from an interrupted merge
+     * or checkpoint
+     */
+    lastSequence = baseSequence;
+    DIR *d = opendir(dir);
+    if (d != NULL) {
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            unsigned seq;
+            char tail[16];
+            int len = strlen(e->d_name);
+            bool tmp = len > 4 && strcmp(e->d_name + len - 4, ".tmp") == 0;
+            bool ours = strncmp(e->d_name, "base.", 5) == 0 ||
+                        strncmp(e->d_name, "delta-", 6) == 0;
+
+            if (tmp && ours) {
+                snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+                unlink(path);
+            } else if (sscanf(e->d_name, "delta-%8u%15s", &seq, tail) == 2 &&
+                       strcmp(tail, ".ckpt") == 0) {
+                if (seq <= baseSequence) {
+                    deltaPath(path, sizeof(path), seq);
+                    unlink(path);
+                } else if (seq > lastSequence) {
+                    lastSequence = seq;
+                }
+            }
+        }
+        closedir(d);
+    }
+
+    LoadState st;
+    memset(&st, 0, sizeof(st));
+    if (!mergeFiles(baseSequence, lastSequence, loadRoom, loadNote, NULL, &st,
+                    &stats->bytes)) {
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->sequence = lastSequence;
+    stats->deltas = lastSequence - baseSequence;
+    stats->rooms = st.rooms;
+    stats->notes = st.notes;
+    stats->millis = (end.tv_sec - start.tv_sec) * 1e3 +
+                    (end.tv_nsec - start.tv_nsec) / 1e6;
+    return true;
+}
+
+
+/* --- Merging --- */
+
+/* Stream the base plus deltas (base, upto] into the sinks, one combined
+ * room at a time in id order. A room's notes are passed on oldest first:
+ * those in the base, then those in each delta in turn, each carrying on
+ * from the note ids before it. Only the base may be missing, and only
+ * while nothing has been merged into it (base 0); every delta after it
+ * must be there, or the notes it held would be lost and the ids of those
+ * after them would shift.
+ */
+static bool mergeFiles(uint32_t base, uint32_t upto, RoomSink roomSink,
+                       NoteSink noteSink, RoomEndSink endSink, void *arg,
+                       long *bytes)
+{
+    int count = 1 + (upto - base);
+    CkptReader *readers = new CkptReader[count];
+    char path[600];
+    bool ok = true;
+
+    for (int i = 0; i < count; i++) {
+        CkptHeader hdr;
+        if (i == 0) {
+            basePath(path, sizeof(path));
+        } else {
+            deltaPath(path, sizeof(path), base + i);
+        }
+        if (!openReader(&readers[i], path, &hdr)) {
+            printf("Error: %s is damaged\n", path);
+            ok = false;
+        } else if (readers[i].f == NULL && (i > 0 || base > 0)) {
+            printf("Error: %s is missing\n", path);
+            ok = false;
+        }
+        nextRoom(&readers[i]);
+    }
+
+    char text[MSG_SIZE];
+    while (ok) {
+        int first = -1;
+        for (int i = 0; i < count; i++) {
+            if (readers[i].valid &&
+                (first < 0 || readers[i].room.id < readers[first].room.id)) {
+                first = i;
+            }
+        }
+        if (first < 0) {
+            break;
+        }
+
+        /* The oldest file with this room has its identity; the note
+         * counts of every file holding it add up. Each file's notes must
+         * carry on where the earlier ones stopped, or a delta was lost or
+         * repeated and the notes would take the wrong ids.
+         */
+        CkptRoom combined = readers[first].room;
+        int broken = combined.first_note != 1 ? first : -1;
+        for (int i = first + 1; i < count; i++) {
+            if (readers[i].valid && readers[i].room.id == combined.id) {
+                if (readers[i].room.first_note != combined.note_count + 1 &&
+                    broken < 0) {
+                    broken = i;
+                }
+                combined.note_count += readers[i].room.note_count;
+            }
+        }
+        if (broken >= 0) {
+            printf("Error: the notes of room %d in %s do not follow on from "
+                   "the earlier checkpoints\n", combined.id,
+                   readers[broken].path);
+            ok = false;
+            break;
+        }
+        roomSink(&combined, arg);
+
+        for (int i = first; i < count; i++) {
+            CkptReader *r = &readers[i];
+            if (!r->valid || r->room.id != combined.id) {
+                continue;
+            }
+            for (int n = 0; n < r->room.note_count; n++) {
+                int len;
+                if (!readNote(r, text, &len)) {
+                    break;
+                }
+                noteSink(text, len, arg);
+            }
+            if (finishRoom(r)) {
+                nextRoom(r);
+            }
+        }
+        if (endSink != NULL) {
+            endSink(arg);
+        }
+        task_yield();
+
+        for (int i = 0; i < count; i++) {
+            ok = ok && readers[i].ok;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (readers[i].f != NULL) {
+            if (bytes != NULL) {
+                *bytes += ftell(readers[i].f);
+            }
+            fclose(readers[i].f);
+        }
+    }
+    delete[] readers;
+    return ok;
+}
+
+
+/* Open a checkpoint file. A missing file reads as empty; returns false
+ * only if the file exists but is not a checkpoint.
+ */
+static bool openReader(CkptReader *r, const char *path, CkptHeader *hdr)
+{
+    memset(r, 0, sizeof(CkptReader));
+    snprintf(r->path, sizeof(r->path), "%s", path);
+    r->ok = true;
+
+    r->f = fopen(path, "rb");
+    if (r->f == NULL) {
+        return true;
+    }
+    setvbuf(r->f, NULL, _IOFBF, CKPT_BUFFER_SIZE);
+
+    bool whole = fread(hdr, sizeof(CkptHeader), 1, r->f) == 1;
+    uint32_t crc = hdr->crc;
+    sealHeader(hdr);
+    if (!whole || memcmp(hdr->magic, CKPT_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != CKPT_VERSION || hdr->crc != crc) {
+        fclose(r->f);
+        r->f = NULL;
+        r->ok = false;
+        return false;
+    }
+    r->left = hdr->rooms;
+    return true;
+}
+
+
+static bool nextRoom(CkptReader *r)
+{
+    r->valid = false;
+    if (r->f == NULL || r->left == 0) {
+        return false;
+    }
+    if (fread(&r->room, sizeof(CkptRoom), 1, r->f) != 1 ||
+        r->room.note_count < 0) {
+        r->ok = false;
+        return false;
+    }
+    r->left--;
+    r->valid = true;
+    r->crc = crc32c(0, &r->room, sizeof(CkptRoom));
+    return true;
+}
+
+
+static bool readNote(CkptReader *r, char *text, int *len)
+{
+    uint16_t n;
+    if (fread(&n, sizeof(n), 1, r->f) != 1 || n > MSG_SIZE ||
+        fread(text, 1, n, r->f) != n) {
+        r->ok = false;
+        r->valid = false;
+        return false;
+    }
+    *len = n;
+    r->crc = crc32c(crc32c(r->crc, &n, sizeof(n)), text, n);
+    return true;
+}
+
+
+/* Check the CRC that closes the current room block */
+static bool finishRoom(CkptReader *r)
+{
+    uint32_t crc;
+    if (!r->ok || fread(&crc, sizeof(crc), 1, r->f) != 1 || crc != r->crc) {
+        printf("Error: checksum mismatch in %s (room %d)\n", r->path,
+               r->room.id);
+        r->ok = false;
+        r->valid = false;
+        return false;
+    }
+    return true;
+}
+
+
+/* Sinks for writing a merge to a new base file */
+struct FileSink {
+    FILE *f;
+    uint64_t rooms;
+    uint32_t crc;
+};
+
+
+static void fileRoom(CkptRoom *room, void *arg)
+{
+    FileSink *sink = (FileSink *)arg;
+    fwrite(room, sizeof(CkptRoom), 1, sink->f);
+    sink->crc = crc32c(0, room, sizeof(CkptRoom));
+    sink->rooms++;
+}
+
+
+static void fileNote(const char *text, int len, void *arg)
+{
+    FileSink *sink = (FileSink *)arg;
+    writeText(sink->f, text, len, &sink->crc);
+}
+
+
+static void fileRoomEnd(void *arg)
+{
+    FileSink *sink = (FileSink *)arg;
+    fwrite(&sink->crc, sizeof(sink->crc), 1, sink->f);
+}
+
+
+/* Background task: fold deltas (base, upto] into a new base.ckpt */
+static void mergeDeltas(void *arg)
+{
+    MergeJob *job = (MergeJob *)arg;
+    char path[600];
+    char tmp[sizeof(path) + 4];
+    basePath(path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FileSink sink;
+    sink.f = fopen(tmp, "wb");
+    sink.rooms = 0;
+    job->ok = sink.f != NULL;
+
+    if (job->ok) {
+        setvbuf(sink.f, NULL, _IOFBF, CKPT_BUFFER_SIZE);
+        CkptHeader hdr;
+        memcpy(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic));
+        hdr.version = CKPT_VERSION;
+        hdr.sequence = job->upto;
+        hdr.rooms = 0;
+        fwrite(&hdr, sizeof(hdr), 1, sink.f);
+
+        job->ok = mergeFiles(job->base, job->upto, fileRoom, fileNote,
+                             fileRoomEnd, &sink, NULL);
+
+        /* Fill in the room count now that it is known */
+        hdr.rooms = sink.rooms;
+        sealHeader(&hdr);
+        fseek(sink.f, 0, SEEK_SET);
+        fwrite(&hdr, sizeof(hdr), 1, sink.f);
+        job->ok = commitFile(sink.f, tmp, path) && job->ok;
+    }
+
+    /* Only once the new base is in place are the deltas it holds dropped */
+    if (job->ok) {
+        for (uint32_t seq = job->base + 1; seq <= job->upto; seq++) {
+            deltaPath(path, sizeof(path), seq);
+            unlink(path);
+        }
+    } else {
+        unlink(tmp);
+    }
+
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+}
+
+
+/* Collect a finished merge, if there is one */
+static void reapMerge()
+{
+    if (!merging || !__atomic_load_n(&mergeJob.done, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    merging = false;
+    if (mergeJob.ok) {
+        baseSequence = mergeJob.upto;
+        printf("Merged checkpoints up to %u into the base\n", mergeJob.upto);
+    } else {
+        printf("Error: merging checkpoints failed; will retry\n");
+    }
+}
+
+
+/* --- Writing --- */
+
+bool ckpt_open(const char *dir)
+{
+    return setDir(dir);
+}
+
+
+bool ckpt_pending()
+{
+    return anyDirtyRooms();
+}
+
+
+bool ckpt_write(CkptStats *stats)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(stats, 0, sizeof(CkptStats));
+    reapMerge();
+
+    /* Rooms go out in id order so that deltas can be merged */
+    Room *dirty = takeDirtyRooms();
+    long count = 0;
+    for (Room *r = dirty; r != NULL; r = r->next_dirty) {
+        count++;
+    }
+    Room **rooms = (Room **)malloc(count * sizeof(Room *));
+    long n = 0;
+    for (Room *r = dirty; r != NULL; r = r->next_dirty) {
+        rooms[n++] = r;
+    }
+    qsort(rooms, count, sizeof(Room *), compareRoomIds);
+
+    uint32_t sequence = lastSequence + 1;
+    char path[600];
+    char tmp[sizeof(path) + 4];
+    deltaPath(path, sizeof(path), sequence);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        for (long i = 0; i < count; i++) {
+            rooms[i]->dirty = false;
+            markRoomDirty(rooms[i]);
+        }
+        free(rooms);
+        return false;
+    }
+    setvbuf(f, NULL, _IOFBF, CKPT_BUFFER_SIZE);
+
+    CkptHeader hdr;
+    memcpy(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic));
+    hdr.version = CKPT_VERSION;
+    hdr.sequence = sequence;
+    hdr.rooms = count;
+    sealHeader(&hdr);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    for (long i = 0; i < count; i++) {
+        Room *r = rooms[i];
+        int saved = r->saved_notes > 0 ? r->saved_notes : 0;
+
+        CkptRoom entry;
+        entry.id = r->id;
+        entry.invite_code = r->invite_code;
+        entry.room_key = r->room_key;
+        entry.first_note = saved + 1;
+        entry.note_count = r->note_count - saved;
+        fwrite(&entry, sizeof(entry), 1, f);
+        uint32_t crc = crc32c(0, &entry, sizeof(entry));
+
+        /* Only the chunks holding new notes are visited */
+        writeNotesAfter(f, r->notes, saved, &crc);
+        fwrite(&crc, sizeof(crc), 1, f);
+        stats->notes += entry.note_count;
+    }
+    stats->bytes = ftell(f);
+
+    if (!commitFile(f, tmp, path)) {
+        /* Leave the rooms dirty so the next checkpoint tries again */
+        unlink(tmp);
+        for (long i = 0; i < count; i++) {
+            rooms[i]->dirty = false;
+            markRoomDirty(rooms[i]);
+        }
+        free(rooms);
+        return false;
+    }
+
+    for (long i = 0; i < count; i++) {
+        rooms[i]->saved_notes = rooms[i]->note_count;
+        rooms[i]->dirty = false;
+    }
+    free(rooms);
+    lastSequence = sequence;
+
+    if (!merging && mergeClass < 0) {
+        mergeClass = task_class("checkpoint merge");
+        if (mergeClass < 0) {
+            printf("Error: no task class left for checkpoint merges\n");
+        }
+    }
+    if (!merging && mergeClass >= 0 &&
+        lastSequence - baseSequence >= (uint32_t)CKPT_MERGE_DELTAS) {
+        mergeJob.base = baseSequence;
+        mergeJob.upto = lastSequence;
+        mergeJob.done = false;
+        mergeJob.ok = false;
+        task_submit(mergeClass, TASK_LOW, mergeDeltas, &mergeJob);
+        merging = true;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->sequence = sequence;
+    stats->rooms = count;
+    stats->millis = (end.tv_sec - start.tv_sec) * 1e3 +
+                    (end.tv_nsec - start.tv_nsec) / 1e6;
+    return true;
+}
+
+
+void ckpt_close()
+{
+    if (merging) {
+        while (!__atomic_load_n(&mergeJob.done, __ATOMIC_ACQUIRE)) {
+            tasks_wait();
+        }
+        merging = false;
+    }
+}
+
+
+/* --- Helper Functions --- */
+
+/* Write the notes with ids above 'after', oldest first. Chunks are linked
+ * newest first, so older chunks are written on the way back out.
+ */
+static void writeNotesAfter(FILE *f, NoteChunk *c, int after, uint32_t *crc)
+{
+    if (c == NULL || c->count == 0) {
+        return;
+    }
+    if (c->notes[0].id > after) {
+        writeNotesAfter(f, c->prev, after, crc);
+    }
+    for (int i = 0; i < c->count; i++) {
+        if (c->notes[i].id > after) {
+            writeText(f, c->notes[i].ciphertext, MSG_SIZE, crc);
+        }
+    }
+}
+
+
+/* Write text without its trailing zero bytes, adding it to *crc */
+static void writeText(FILE *f, const char *text, int maxLen, uint32_t *crc)
+{
+    uint16_t len = maxLen;
+    while (len > 0 && text[len - 1] == '\0') {
+        len--;
+    }
+    fwrite(&len, sizeof(len), 1, f);
+    fwrite(text, 1, len, f);
+    *crc = crc32c(crc32c(*crc, &len, sizeof(len)), text, len);
+}
+
+
+/* Set the header's crc to cover the rest of it */
+static void sealHeader(CkptHeader *hdr)
+{
+    hdr->crc = 0;
+    hdr->reserved = 0;
+    hdr->crc = crc32c(0, hdr, sizeof(CkptHeader));
+}
+
+
+/* Flush and sync a finished file, rename it into place and sync the
+ * directory so the rename itself survives a crash
+ */
+static bool commitFile(FILE *f, const char *tmp, const char *path)
+{
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        return false;
+    }
+
+    int dfd = open(ckptDir, O_RDONLY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    return true;
+}
+
+
+/* Take dir as the checkpoint directory, provided that the longest file
+ * name in it fits in the path buffers; a cut-off name could be another
+ * file's, or the temporary file's could be the real one's
+ */
+static bool setDir(const char *dir)
+{
+    char path[600];
+    if (snprintf(ckptDir, sizeof(ckptDir), "%s", dir) >= (int)sizeof(ckptDir) ||
+        !basePath(path, sizeof(path)) ||
+        !deltaPath(path, sizeof(path), UINT32_MAX)) {
+        printf("Error: the checkpoint directory name %s is too long\n", dir);
+        return false;
+    }
+    return true;
+}
+
+
+/* Returns false if the name did not fit in buf */
+static bool basePath(char *buf, size_t size)
+{
+    return snprintf(buf, size, "%s/base.ckpt", ckptDir) < (int)size;
+}
+
+
+static bool deltaPath(char *buf, size_t size, uint32_t sequence)
+{
+    return snprintf(buf, size, "%s/delta-%08u.ckpt", ckptDir,
+                    sequence) < (int)size;
+}
+
+
+static int compareRoomIds(const void *a, const void *b)
+{
+    int x = (*(Room **)a)->id;
+    int y = (*(Room **)b)->id;
+    return x < y ? -1 : x > y;
+}
@@ -0,0 +1,101 @@
+/* checkpoint.h
+ *
+ * Incremental Checkpoints - Header File
+ *
+ * Checkpoints let the write-ahead log be emptied. Rather than rewriting
+ * every room each time, a checkpoint is a delta holding only the rooms on
+ * the dirty list (see noteStore.h), and for each of those only the notes
+ * posted since the room was last checkpointed. Checkpoint I/O therefore
+ * follows the write rate, not the size of the store.
+ *
+ * Deltas pile up, so once CKPT_MERGE_DELTAS of them exist a background
+ * task (see taskPool.h) merges them with the base snapshot into a new
+ * base. The merge works from the files alone (never the live store), so
+ * the server keeps running and writing new deltas meanwhile.
+ *
+ * FILES (in the data directory):
+ * -----------------------------
+ *   base.ckpt            Everything up to and including delta <sequence>
+ *   delta-NNNNNNNN.ckpt  Changes since the previous delta
+ *
+ * Both kinds share one layout:
+ *
+ *   CkptHeader
+ *   CkptRoom, note_count notes of (uint16 length, text), uint32 crc
+ *   CkptRoom, ...
+ *
+ * Each room is one checksummed block: crc is the CRC32C of its CkptRoom
+ * and notes. Loading and merging verify every block and the header, and
+ * refuse a file that fails.
+ *
+ * Rooms appear in increasing id order, which is what lets the base and
+ * any number of deltas be merged in one streaming pass. New files are
+ * written under a temporary name, synced and then renamed into place.
+ */
+
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <stdint.h>
+
+const char CKPT_MAGIC[8] = { 'S', 'N', 'C', 'K', 'P', 'T', '0', '1' };
+const uint32_t CKPT_VERSION = 2;
+
+/* Merge into the base once this many deltas are waiting */
+const int CKPT_MERGE_DELTAS = 8;
+
+struct CkptHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sequence;      /* delta number (base: the last delta merged) */
+    uint64_t rooms;         /* CkptRoom records that follow */
+    uint32_t crc;           /* CRC32C of this header with crc set to 0 */
+    uint32_t reserved;
+};
+
+/* One room's entry. Its notes have ids first_note .. first_note +
+ * note_count - 1; a delta may hold a room with no new notes.
+ */
+struct CkptRoom {
+    int32_t id;
+    int32_t invite_code;
+    uint64_t room_key;
+    int32_t first_note;
+    int32_t note_count;
+};
+
+struct CkptStats {
+    uint32_t sequence;      /* delta written, or last delta loaded */
+    int deltas;             /* deltas loaded */
+    long rooms;
+    long notes;
+    long bytes;
+    double millis;
+};
+
+/* Load the base snapshot and every later delta from dir into the empty
+ * store, before wal_recover(). Missing files mean an empty store. Returns
+ * false if a file is damaged, or if dir's name is too long (see
+ * ckpt_open()).
+ */
+bool ckpt_load(const char *dir, CkptStats *stats);
+
+/* Start checkpointing into dir, after recovery. Returns false if dir's
+ * name is too long for its files' names to fit.
+ */
+bool ckpt_open(const char *dir);
+
+/* Returns true if any room has changed since the last checkpoint */
+bool ckpt_pending();
+
+/* Write a delta of every dirty room and clear the dirty list. The caller
+ * must make sure the log is durable first, and may empty it afterwards.
+ * Starts a background merge when enough deltas have built up. Returns
+ * false if the delta could not be written.
+ */
+bool ckpt_write(CkptStats *stats);
+
+/* Wait for any merge in progress */
+void ckpt_close();
+
+#endif
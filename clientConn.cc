@@ -0,0 +1,538 @@
+/* clientConn.cc
+ *
+ * Client Connection Helpers - Implementation
+ */
+
+#include "clientConn.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "diffieHellman.h"
+#include "xor.h"
+#include "roomDigest.h"
+
+/* Expect the server's public value first (see clientConn.h) */
+static bool serverFirst = false;
+
+/* The server's semi-static key, once one has been advertised. Guarded by
+ * earlyKeyLock, as conn_download_room() handshakes from several threads.
+ */
+static pthread_mutex_t earlyKeyLock = PTHREAD_MUTEX_INITIALIZER;
+static bool haveEarlyKey = false;
+static uint32_t earlyKeyId;
+static unsigned long long earlyKeyPub;
+
+/* A room being downloaded; nextFirst, received and failed are guarded by
+ * lock
+ */
+struct Download {
+    const char *server;
+    int port;
+    int invite;
+    int roomId;
+    int notes;
+    char (*texts)[MSG_SIZE];
+    pthread_mutex_t lock;
+    int nextFirst;
+    int received;
+    bool failed;
+};
+
+/* Function prototypes for top-down design */
+static bool connectSocket(ClientConn *c, const char *server, int port);
+static unsigned long long readServerPublic(Packet *resp);
+static bool joinRoom(ClientConn *c, int invite, int *room, int *notes);
+static void *downloadThread(void *arg);
+static void downloadRanges(Download *dl, ClientConn *c);
+
+
+void conn_set_server_first(bool on)
+{
+    serverFirst = on;
+}
+
+
+bool conn_open(ClientConn *c, const char *server, int port)
+{
+    if (!connectSocket(c, server, port)) {
+        return false;
+    }
+
+    /* Same handshake as finalClient */
+    unsigned long long priv = dh_generate_private();
+    unsigned long long pub = dh_compute_public(priv);
+
+    Packet p;
+    memset(&p, 0, sizeof(p));
+    p.op = OP_DH_PUB;
+    sprintf(p.message, "%llu", pub);
+
+    /* Server-first: hold our value back for the first request */
+    if (serverFirst) {
+        memcpy(&c->hello, &p, sizeof(Packet));
+        c->hello_pending = true;
+    } else {
+        c->sock->send(&p, sizeof(Packet));
+    }
+
+    Packet resp;
+    if (c->sock->recv(&resp, sizeof(Packet)) <= 0) {
+        conn_close(c);
+        return false;
+    }
+    c->key = dh_compute_shared(readServerPublic(&resp), priv);
+    return true;
+}
+
+
+bool conn_open_early(ClientConn *c, const char *server, int port,
+                     Packet *reqs, int count)
+{
+    /* Take a consistent copy of the key */
+    pthread_mutex_lock(&earlyKeyLock);
+    bool haveKey = haveEarlyKey;
+    uint32_t keyId = earlyKeyId;
+    unsigned long long keyPub = earlyKeyPub;
+    pthread_mutex_unlock(&earlyKeyLock);
+
+    if (!haveKey || count < 1 || count > EARLY_MAX_REQUESTS) {
+        if (!conn_open(c, server, port)) {
+            return false;
+        }
+        for (int i = 0; i < count; i++) {
+            conn_send(c, &reqs[i]);
+        }
+        return true;
+    }
+
+    if (!connectSocket(c, server, port)) {
+        return false;
+    }
+
+    /* Handshake and early requests leave in a single write */
+    unsigned long long priv = dh_generate_private();
+    unsigned long long earlyKey = dh_compute_shared(keyPub, priv);
+
+    Packet flight[1 + EARLY_MAX_REQUESTS];
+    memset(&flight[0], 0, sizeof(Packet));
+    flight[0].op = OP_DH_EARLY;
+    flight[0].room_id = count;
+    flight[0].tag = keyId;
+    sprintf(flight[0].message, "%llu", dh_compute_public(priv));
+    for (int i = 0; i < count; i++) {
+        memcpy(&flight[1 + i], &reqs[i], sizeof(Packet));
+        xor_buffer(flight[1 + i].message, MSG_SIZE, earlyKey);
+    }
+    int len = (1 + count) * sizeof(Packet);
+    if (c->sock->send(flight, len) != len) {
+        conn_close(c);
+        return false;
+    }
+
+    /* A server-first server may have sent OP_DH_PUB before our flight
+     * arrived; the answer to it is OP_DH_EARLY
+     */
+    Packet resp;
+    do {
+        if (c->sock->recv(&resp, sizeof(Packet)) <= 0) {
+            conn_close(c);
+            return false;
+        }
+    } while (resp.op == OP_DH_PUB);
+
+    if (resp.op != OP_DH_EARLY) {
+        conn_close(c);
+        return false;
+    }
+    int accepted = resp.tag;
+    c->key = dh_compute_shared(readServerPublic(&resp), priv);
+
+    /* Refused: send them again, now under the connection key */
+    if (accepted < count) {
+        for (int i = 0; i < count; i++) {
+            conn_send(c, &reqs[i]);
+        }
+    }
+    return true;
+}
+
+
+bool conn_has_early_key()
+{
+    pthread_mutex_lock(&earlyKeyLock);
+    bool haveKey = haveEarlyKey;
+    pthread_mutex_unlock(&earlyKeyLock);
+    return haveKey;
+}
+
+
+void conn_close(ClientConn *c)
+{
+    if (c->sock != NULL) {
+        c->sock->close();
+        delete c->sock;
+        c->sock = NULL;
+    }
+}
+
+
+bool conn_is_open(ClientConn *c)
+{
+    return c->sock != NULL;
+}
+
+
+bool conn_send(ClientConn *c, Packet *p)
+{
+    Packet tmp[2];
+    int count = 0;
+    if (c->hello_pending) {
+        memcpy(&tmp[count++], &c->hello, sizeof(Packet));
+        c->hello_pending = false;
+    }
+    memcpy(&tmp[count], p, sizeof(Packet));
+    xor_buffer(tmp[count].message, MSG_SIZE, c->key);
+    count++;
+    int len = count * sizeof(Packet);
+    return c->sock->send(tmp, len) == len;
+}
+
+
+bool conn_recv(ClientConn *c, Packet *p)
+{
+    int n = c->sock->recv(p, sizeof(Packet));
+    if (n <= 0) {
+        return false;
+    }
+    xor_buffer(p->message, MSG_SIZE, c->key);
+    return true;
+}
+
+
+bool conn_recv_reply(ClientConn *c, Packet *p)
+{
+    while (conn_recv(c, p)) {
+        if (p->op != OP_NOTE_PUSH && p->op != OP_NOTE_RESYNC) {
+            return true;
+        }
+        c->pushes++;
+    }
+    return false;
+}
+
+
+int conn_drain_pushes(ClientConn *c)
+{
+    struct pollfd pfd;
+    pfd.fd = c->sock->fd();
+    pfd.events = POLLIN;
+
+    Packet p;
+    int count = 0;
+    while (poll(&pfd, 1, 0) > 0) {
+        if (!conn_recv(c, &p)) {
+            return -1;
+        }
+        c->pushes++;
+        count++;
+    }
+    return count;
+}
+
+
+int conn_list_notes(ClientConn *c)
+{
+    Packet req;
+    memset(&req, 0, sizeof(req));
+    req.op = OP_LIST_NOTES;
+    if (!conn_send(c, &req)) {
+        return -1;
+    }
+    return conn_read_notes(c);
+}
+
+
+int conn_list_if_changed(ClientConn *c, int *version)
+{
+    Packet req;
+    memset(&req, 0, sizeof(req));
+    req.op = OP_LIST_IF_CHANGED;
+    req.tag = *version;
+    if (!conn_send(c, &req)) {
+        return -1;
+    }
+
+    Packet resp;
+    int notes = 0;
+    while (true) {
+        if (!conn_recv_reply(c, &resp)) {
+            return -1;
+        }
+        if (resp.op == OP_NOT_MODIFIED) {
+            return 0;
+        }
+        if (resp.tag == 0) {
+            *version = resp.room_id; /* End marker */
+            return notes;
+        }
+        notes++;
+    }
+}
+
+
+int conn_list_range(ClientConn *c, int first, int last)
+{
+    Packet req;
+    memset(&req, 0, sizeof(req));
+    req.op = OP_LIST_RANGE;
+    req.room_id = first;
+    req.tag = last;
+    if (!conn_send(c, &req)) {
+        return -1;
+    }
+    return conn_read_notes(c);
+}
+
+
+int conn_room_digest(ClientConn *c, int level, int first, uint64_t *out,
+                     int *notes, int *levels)
+{
+    Packet req, resp;
+    memset(&req, 0, sizeof(req));
+    req.op = OP_ROOM_DIGEST;
+    req.room_id = first;
+    req.tag = level;
+    if (!conn_send(c, &req) || !conn_recv_reply(c, &resp)) {
+        return -1;
+    }
+
+    *notes = resp.room_id;
+    *levels = resp.tag;
+    if (level < 0) {
+        level += resp.tag;
+    }
+    if (level < 0 || level >= resp.tag) {
+        return 0;
+    }
+    int n = digest_level_size(resp.room_id, level) - first;
+    if (n < 0) {
+        n = 0;
+    } else if (n > DIGEST_PER_PACKET) {
+        n = DIGEST_PER_PACKET;
+    }
+    memcpy(out, resp.message, n * sizeof(uint64_t));
+    return n;
+}
+
+
+int conn_download_room(const char *server, int port, int invite,
+                       int connections, char (**texts)[MSG_SIZE])
+{
+    /* The first connection finds out how many notes there are, then
+     * works alongside the others from the calling thread
+     */
+    ClientConn first;
+    Download dl;
+    if (!conn_open(&first, server, port)) {
+        return -1;
+    }
+    if (!joinRoom(&first, invite, &dl.roomId, &dl.notes)) {
+        conn_close(&first);
+        return -1;
+    }
+
+    dl.server = server;
+    dl.port = port;
+    dl.invite = invite;
+    dl.texts = new char[dl.notes > 0 ? dl.notes : 1][MSG_SIZE];
+    pthread_mutex_init(&dl.lock, NULL);
+    dl.nextFirst = 1;
+    dl.received = 0;
+    dl.failed = false;
+
+    /* No point in more connections than runs */
+    int runs = (dl.notes + DOWNLOAD_RANGE_NOTES - 1) / DOWNLOAD_RANGE_NOTES;
+    if (connections > runs) {
+        connections = runs;
+    }
+    pthread_t *threads = new pthread_t[connections > 1 ? connections : 1];
+    for (int i = 1; i < connections; i++) {
+        pthread_create(&threads[i], NULL, downloadThread, &dl);
+    }
+    downloadRanges(&dl, &first);
+    conn_close(&first);
+    for (int i = 1; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    delete [] threads;
+    pthread_mutex_destroy(&dl.lock);
+
+    if (dl.failed || dl.received != dl.notes) {
+        delete [] dl.texts;
+        return -1;
+    }
+    *texts = dl.texts;
+    return dl.notes;
+}
+
+
+int conn_read_notes(ClientConn *c)
+{
+    Packet resp;
+    int notes = 0;
+    while (true) {
+        if (!conn_recv_reply(c, &resp)) {
+            return -1;
+        }
+        if (resp.tag == 0) {
+            return notes; /* End marker */
+        }
+        notes++;
+    }
+}
+
+
+
+/* --- Helper Functions --- */
+
+static bool connectSocket(ClientConn *c, const char *server, int port)
+{
+    c->sock = new Socket();
+    c->key = 0;
+    c->hello_pending = false;
+    c->pushes = 0;
+    if (!c->sock->connect((char *)server, port)) {
+        conn_close(c);
+        return false;
+    }
+
+    /* Benchmarks send posts back to back; don't let Nagle hold a
+     * request behind the previous one's ACK
+     */
+    int one = 1;
+    setsockopt(c->sock->fd(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return true;
+}
+
+
+/* Returns the server's public value from a handshake reply, caching the
+ * semi-static key if the server advertised one
+ */
+static unsigned long long readServerPublic(Packet *resp)
+{
+    unsigned long long pub;
+    unsigned int keyId;
+    unsigned long long staticPub;
+
+    resp->message[MSG_SIZE - 1] = '\0';
+    int fields = sscanf(resp->message, "%llu %u %llu", &pub, &keyId,
+                        &staticPub);
+    if (fields == 3) {
+        pthread_mutex_lock(&earlyKeyLock);
+        haveEarlyKey = true;
+        earlyKeyId = keyId;
+        earlyKeyPub = staticPub;
+        pthread_mutex_unlock(&earlyKeyLock);
+    }
+    return fields >= 1 ? pub : 0;
+}
+
+
+/* Join a room, learning its id and note count. Returns false on failure. */
+static bool joinRoom(ClientConn *c, int invite, int *room, int *notes)
+{
+    Packet req, resp;
+    memset(&req, 0, sizeof(req));
+    req.op = OP_JOIN_ROOM;
+    req.tag = invite;
+    if (!conn_send(c, &req) || !conn_recv(c, &resp) ||
+        resp.op != OP_JOIN_ROOM_RESP) {
+        return false;
+    }
+    *room = resp.room_id;
+    *notes = resp.tag;
+    return true;
+}
+
+
+/* A download connection other than the first */
+static void *downloadThread(void *arg)
+{
+    Download *dl = (Download *)arg;
+    ClientConn c;
+    int room, notes;
+    if (!conn_open(&c, dl->server, dl->port)) {
+        pthread_mutex_lock(&dl->lock);
+        dl->failed = true;
+        pthread_mutex_unlock(&dl->lock);
+        return NULL;
+    }
+    /* Invite codes aren't unique, so a room made since the first join
+     * could answer this one instead
+     */
+    if (joinRoom(&c, dl->invite, &room, &notes) && room == dl->roomId) {
+        downloadRanges(dl, &c);
+    } else {
+        pthread_mutex_lock(&dl->lock);
+        dl->failed = true;
+        pthread_mutex_unlock(&dl->lock);
+    }
+    conn_close(&c);
+    return NULL;
+}
+
+
+/* Fetch runs of notes over c until none are left. Notes posted after
+ * the download started are ignored.
+ */
+static void downloadRanges(Download *dl, ClientConn *c)
+{
+    while (true) {
+        pthread_mutex_lock(&dl->lock);
+        int first = dl->nextFirst;
+        dl->nextFirst += DOWNLOAD_RANGE_NOTES;
+        bool stop = dl->failed;
+        pthread_mutex_unlock(&dl->lock);
+        if (stop || first > dl->notes) {
+            return;
+        }
+
+        int last = first + DOWNLOAD_RANGE_NOTES - 1;
+        if (last > dl->notes) {
+            last = dl->notes;
+        }
+
+        Packet req, resp;
+        memset(&req, 0, sizeof(req));
+        req.op = OP_LIST_RANGE;
+        req.room_id = first;
+        req.tag = last;
+        bool ok = conn_send(c, &req);
+        int received = 0;
+        while (ok) {
+            ok = conn_recv(c, &resp);
+            if (!ok || resp.tag == 0) {
+                break; /* End marker */
+            }
+            if (resp.op == OP_LIST_NOTES_RESP && resp.tag >= first &&
+                resp.tag <= last) {
+                memcpy(dl->texts[resp.tag - 1], resp.message, MSG_SIZE);
+                received++;
+            }
+        }
+
+        pthread_mutex_lock(&dl->lock);
+        dl->received += received;
+        if (!ok) {
+            dl->failed = true;
+        }
+        pthread_mutex_unlock(&dl->lock);
+    }
+}
@@ -0,0 +1,129 @@
+/* clientConn.h
+ *
+ * Client Connection Helpers - Header File
+ *
+ * A small wrapper used by the tools that drive a server programmatically
+ * (finalReplay, finalLoad): it connects, performs the same Diffie-Hellman
+ * handshake as finalClient, and sends/receives encrypted packets.
+ *
+ * With conn_set_server_first() the connection expects a server started
+ * with -f, which sends its public value first: conn_open() only waits
+ * for that, and the client's own public value is sent in the same write
+ * as the first request.
+ *
+ * Servers started with -z advertise a semi-static key for 0-RTT (see
+ * earlyKey.h). The last one seen is cached for the whole process, and
+ * conn_open_early() uses it to send the first requests without waiting
+ * for the handshake.
+ *
+ * conn_download_room() fetches a whole room over several connections at
+ * once. The room is cut into runs of DOWNLOAD_RANGE_NOTES note ids, and
+ * each connection, on a thread of its own, takes the next run nobody has
+ * asked for yet with OP_LIST_RANGE, decrypts it and writes every note
+ * into its slot (by id) of the result, so the notes come out in order
+ * without a separate merge.
+ */
+
+#ifndef _CLIENTCONN_H
+#define _CLIENTCONN_H
+
+#include "finalPacket.h"
+#include "socket.h"
+
+/* Note ids fetched with one OP_LIST_RANGE by conn_download_room() */
+const int DOWNLOAD_RANGE_NOTES = 4096;
+
+/* One encrypted connection to the server */
+struct ClientConn {
+    Socket *sock;
+    unsigned long long key;
+    bool hello_pending;     /* our OP_DH_PUB goes out with the next send */
+    Packet hello;
+    long pushes;            /* OP_NOTE_PUSH / OP_NOTE_RESYNC read past */
+};
+
+/* Use the server-first handshake for connections opened from now on */
+void conn_set_server_first(bool on);
+
+/* Connect and complete the handshake. Returns false if either fails;
+ * the connection is left closed in that case.
+ */
+bool conn_open(ClientConn *c, const char *server, int port);
+
+/* Connect and send up to EARLY_MAX_REQUESTS joins and posts. With a
+ * cached semi-static key they go out with the handshake as 0-RTT early
+ * data; otherwise, or if the server refuses them, they are sent as soon
+ * as the handshake is done. Either way their replies can then be read
+ * with conn_recv(). Returns false if the connection failed.
+ */
+bool conn_open_early(ClientConn *c, const char *server, int port,
+                     Packet *reqs, int count);
+
+/* Returns true if a semi-static key is cached */
+bool conn_has_early_key();
+
+/* Close the connection (safe to call on a closed connection) */
+void conn_close(ClientConn *c);
+
+/* Returns true while the connection is open */
+bool conn_is_open(ClientConn *c);
+
+/* Encrypt a copy of p and send it */
+bool conn_send(ClientConn *c, Packet *p);
+
+/* Receive one packet and decrypt it in place */
+bool conn_recv(ClientConn *c, Packet *p);
+
+/* Receive the next packet that is not a push, counting the pushes that
+ * come first in c->pushes. The functions below that read a reply all use
+ * it, so they also work on a subscribed connection.
+ */
+bool conn_recv_reply(ClientConn *c, Packet *p);
+
+/* Read, without waiting, the pushes already sent to a subscribed
+ * connection. Returns the number read, or -1 if the connection failed.
+ */
+int conn_drain_pushes(ClientConn *c);
+
+/* Send OP_LIST_NOTES and read the reply up to the end marker.
+ * Returns the number of notes received, or -1 if the connection failed.
+ */
+int conn_list_notes(ClientConn *c);
+
+/* Send OP_LIST_IF_CHANGED with the room version in *version (0 the first
+ * time) and read the reply. If the room changed, *version is updated.
+ * Returns the number of notes received (0 if not modified), or -1 if the
+ * connection failed.
+ */
+int conn_list_if_changed(ClientConn *c, int *version);
+
+/* Send OP_LIST_RANGE for note ids first to last and read the reply.
+ * Returns the number of notes received, or -1 if the connection failed.
+ */
+int conn_list_range(ClientConn *c, int first, int last);
+
+/* Fetch the digests of one level of the room's tree from node first on
+ * (level -1 is the root, see finalPacket.h). out must hold
+ * DIGEST_PER_PACKET digests; *notes and *levels receive the room's note
+ * count and tree height. Returns the number of digests received, or -1
+ * if the connection failed.
+ */
+int conn_room_digest(ClientConn *c, int level, int first, uint64_t *out,
+                     int *notes, int *levels);
+
+/* Download every note of the room with invite code 'invite' over
+ * 'connections' connections in parallel. On success *texts holds the
+ * notes in id order (note id i at index i - 1; free it with delete [])
+ * and the number of notes is returned. Returns -1 if a connection or the
+ * join failed.
+ */
+int conn_download_room(const char *server, int port, int invite,
+                       int connections, char (**texts)[MSG_SIZE]);
+
+/* Read OP_LIST_NOTES_RESP packets up to the end marker, e.g. the notes
+ * preloaded with a join. Returns the number of notes received, or -1 if
+ * the connection failed.
+ */
+int conn_read_notes(ClientConn *c);
+
+#endif
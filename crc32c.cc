@@ -0,0 +1,298 @@
+/* crc32c.cc
+ *
+ * CRC32C (Castagnoli) Checksums - Implementation
+ *
+ * The tables are built once before main() runs, so the functions can be
+ * called from any thread without further setup. The interleaved variant
+ * follows Mark Adler's public-domain crc32c.c.
+ */
+
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/* CRC32C polynomial, bit-reversed */
+const uint32_t CRC32C_POLY = 0x82f63b78;
+
+/* Stream lengths for crc32c_hw3: LONG streams for big blocks, then
+ * SHORT streams for what is left
+ */
+const size_t CRC_LONG = 8192;
+const size_t CRC_SHORT = 256;
+
+/* Slicing-by-8 tables */
+static uint32_t sliceTable[8][256];
+
+/* Operators that shift a CRC past CRC_LONG or CRC_SHORT zero bytes */
+static uint32_t longShift[4][256];
+static uint32_t shortShift[4][256];
+
+static bool hwAvailable = false;
+
+/* Function prototypes for top-down design */
+static bool buildTables();
+static void buildShift(uint32_t table[4][256], size_t len);
+
+static bool tablesBuilt = buildTables();
+
+
+/* --- Software --- */
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = (const unsigned char *)buf;
+    uint32_t c = ~crc;
+
+    while (len > 0 && ((uintptr_t)next & 7) != 0) {
+        c = sliceTable[0][(c ^ *next++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, next, sizeof(word));
+        word ^= c;
+        c = sliceTable[7][word & 0xff] ^
+            sliceTable[6][(word >> 8) & 0xff] ^
+            sliceTable[5][(word >> 16) & 0xff] ^
+            sliceTable[4][(word >> 24) & 0xff] ^
+            sliceTable[3][(word >> 32) & 0xff] ^
+            sliceTable[2][(word >> 40) & 0xff] ^
+            sliceTable[1][(word >> 48) & 0xff] ^
+            sliceTable[0][word >> 56];
+        next += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        c = sliceTable[0][(c ^ *next++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+    return ~c;
+}
+
+
+/* --- Hardware --- */
+
+#if defined(__x86_64__)
+
+static inline uint32_t shift(uint32_t table[4][256], uint32_t crc)
+{
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+           table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+
+__attribute__((target("sse4.2")))
+static uint64_t hwBytes(uint64_t c, const unsigned char *next, size_t len)
+{
+    while (len >= 8) {
+        c = _mm_crc32_u64(c, *(const uint64_t *)next);
+        next += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = _mm_crc32_u8(c, *next++);
+        len--;
+    }
+    return c;
+}
+
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+    if (!hwAvailable) {
+        return crc32c_sw(crc, buf, len);
+    }
+
+    const unsigned char *next = (const unsigned char *)buf;
+    uint64_t c = ~crc;
+
+    while (len > 0 && ((uintptr_t)next & 7) != 0) {
+        c = _mm_crc32_u8(c, *next++);
+        len--;
+    }
+    return ~(uint32_t)hwBytes(c, next, len);
+}
+
+
+/* Run three streams of 'stride' bytes side by side, then fold the second
+ * and third CRCs into the first by shifting it past their length
+ */
+__attribute__((target("sse4.2")))
+static const unsigned char *hwInterleave(uint64_t *c, const unsigned char *next,
+                                         size_t *len, size_t stride,
+                                         uint32_t table[4][256])
+{
+    while (*len >= 3 * stride) {
+        uint64_t c0 = *c;
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        const unsigned char *end = next + stride;
+        do {
+            c0 = _mm_crc32_u64(c0, *(const uint64_t *)next);
+            c1 = _mm_crc32_u64(c1, *(const uint64_t *)(next + stride));
+            c2 = _mm_crc32_u64(c2, *(const uint64_t *)(next + 2 * stride));
+            next += 8;
+        } while (next < end);
+
+        c0 = shift(table, (uint32_t)c0) ^ c1;
+        c0 = shift(table, (uint32_t)c0) ^ c2;
+        *c = c0;
+        next += 2 * stride;
+        *len -= 3 * stride;
+    }
+    return next;
+}
+
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw3(uint32_t crc, const void *buf, size_t len)
+{
+    if (!hwAvailable) {
+        return crc32c_sw(crc, buf, len);
+    }
+
+    const unsigned char *next = (const unsigned char *)buf;
+    uint64_t c = ~crc;
+
+    while (len > 0 && ((uintptr_t)next & 7) != 0) {
+        c = _mm_crc32_u8(c, *next++);
+        len--;
+    }
+
+    next = hwInterleave(&c, next, &len, CRC_LONG, longShift);
+    next = hwInterleave(&c, next, &len, CRC_SHORT, shortShift);
+    return ~(uint32_t)hwBytes(c, next, len);
+}
+
+#else
+
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_sw(crc, buf, len);
+}
+
+
+uint32_t crc32c_hw3(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_sw(crc, buf, len);
+}
+
+#endif
+
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    if (hwAvailable) {
+        /* Below three short streams interleaving only adds overhead */
+        return len >= 3 * CRC_SHORT ? crc32c_hw3(crc, buf, len)
+                                    : crc32c_hw(crc, buf, len);
+    }
+    return crc32c_sw(crc, buf, len);
+}
+
+
+bool crc32c_hw_available()
+{
+    return hwAvailable;
+}
+
+
+/* --- Table Construction --- */
+
+static bool buildTables()
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        sliceTable[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = sliceTable[0][n];
+        for (int k = 1; k < 8; k++) {
+            c = sliceTable[0][c & 0xff] ^ (c >> 8);
+            sliceTable[k][n] = c;
+        }
+    }
+
+    buildShift(longShift, CRC_LONG);
+    buildShift(shortShift, CRC_SHORT);
+
+#if defined(__x86_64__)
+    hwAvailable = __builtin_cpu_supports("sse4.2");
+#endif
+    return true;
+}
+
+
+/* Multiply a 32x32 GF(2) matrix by a vector */
+static uint32_t matrixTimes(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    while (vec != 0) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+
+static void matrixSquare(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++) {
+        square[n] = matrixTimes(mat, mat[n]);
+    }
+}
+
+
+/* Build the operator that feeds len zero bytes (a power of two) through
+ * a CRC, as four byte-indexed tables
+ */
+static void buildShift(uint32_t table[4][256], size_t len)
+{
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    /* Operator for one zero bit */
+    odd[0] = CRC32C_POLY;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    matrixSquare(even, odd);    /* two zero bits */
+    matrixSquare(odd, even);    /* four zero bits */
+
+    /* Square up to len bytes; the first square gives one byte */
+    uint32_t *op = even;
+    do {
+        matrixSquare(even, odd);
+        op = even;
+        len >>= 1;
+        if (len == 0) {
+            break;
+        }
+        matrixSquare(odd, even);
+        op = odd;
+        len >>= 1;
+    } while (len != 0);
+
+    for (uint32_t n = 0; n < 256; n++) {
+        table[0][n] = matrixTimes(op, n);
+        table[1][n] = matrixTimes(op, n << 8);
+        table[2][n] = matrixTimes(op, n << 16);
+        table[3][n] = matrixTimes(op, n << 24);
+    }
+}
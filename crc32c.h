@@ -0,0 +1,43 @@
+/* crc32c.h
+ *
+ * CRC32C (Castagnoli) Checksums - Header File
+ *
+ * Every record the server persists (write-ahead log records and
+ * checkpoint room blocks) carries a CRC32C so that damage is caught on
+ * recovery and load. The checksum sits on the write path, so it must be
+ * cheap:
+ *
+ *   crc32c_sw    Portable slicing-by-8: eight table lookups per 8 bytes
+ *   crc32c_hw    The SSE4.2 crc32 instruction, one 8-byte word at a time
+ *   crc32c_hw3   crc32 over three interleaved streams, which hides the
+ *                instruction's 3-cycle latency on large blocks; the three
+ *                partial CRCs are joined with precomputed shift tables
+ *
+ * crc32c() uses the hardware when the CPU has it (the interleaved form
+ * for blocks of 768 bytes or more) and slicing-by-8 otherwise. crcBench
+ * (make bench) measures all three.
+ *
+ * All functions continue from a previous result: pass 0 to start, or the
+ * CRC of the bytes so far to extend it.
+ */
+
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* CRC32C of buf, continuing from crc */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* The individual implementations, for benchmarking. The hardware ones
+ * fall back to crc32c_sw where SSE4.2 is unavailable.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_hw3(uint32_t crc, const void *buf, size_t len);
+
+/* Returns true if the CPU has the SSE4.2 crc32 instruction */
+bool crc32c_hw_available();
+
+#endif
@@ -0,0 +1,139 @@
+/* earlyKey.cc
+ *
+ * Semi-Static Server Key for 0-RTT Requests - Implementation
+ *
+ * Two keys are live at a time: the current one, handed to clients, and
+ * the previous one, still accepted from clients that cached it shortly
+ * before a rotation.
+ */
+
+#include "earlyKey.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "diffieHellman.h"
+
+/* One semi-static key and the client values already used with it */
+struct EarlyKey {
+    uint32_t id;
+    unsigned long long priv;
+    unsigned long long pub;
+    unsigned long long *seen;   /* open addressing; 0 marks a free slot */
+    int used;
+};
+
+static EarlyKey keys[2];        /* keys[0] current, keys[1] previous */
+static int rotateSeconds = 0;
+static time_t lastRotation;
+
+/* Function prototypes for top-down design */
+static void rotate();
+static void newKey(EarlyKey *k, uint32_t id);
+static bool remember(EarlyKey *k, unsigned long long client_pub);
+
+
+void early_init(int seconds)
+{
+    rotateSeconds = seconds > 0 ? seconds : 1;
+    for (int i = 0; i < 2; i++) {
+        keys[i].seen = new unsigned long long[EARLY_REPLAY_SLOTS];
+    }
+
+    /* Random ids, so ids cached from an earlier run are not recognised */
+    newKey(&keys[1], (uint32_t)rand());
+    newKey(&keys[0], keys[1].id + 1);
+    lastRotation = time(NULL);
+}
+
+
+bool early_enabled()
+{
+    return rotateSeconds > 0;
+}
+
+
+void early_current(uint32_t *key_id, unsigned long long *pub)
+{
+    rotate();
+    *key_id = keys[0].id;
+    *pub = keys[0].pub;
+}
+
+
+bool early_accept(uint32_t key_id, unsigned long long client_pub,
+                  unsigned long long *key)
+{
+    if (!early_enabled()) {
+        return false;
+    }
+    rotate();
+
+    for (int i = 0; i < 2; i++) {
+        if (keys[i].id == key_id) {
+            if (client_pub == 0 || !remember(&keys[i], client_pub)) {
+                return false;
+            }
+            *key = dh_compute_shared(client_pub, keys[i].priv);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* --- Helper Functions --- */
+
+/* Retire the previous key and start a new current one, once per period.
+ * After a long idle spell both are replaced.
+ */
+static void rotate()
+{
+    time_t now = time(NULL);
+    while (now - lastRotation >= rotateSeconds) {
+        EarlyKey retired = keys[1];
+        keys[1] = keys[0];
+        keys[0] = retired;
+        newKey(&keys[0], keys[1].id + 1);
+        lastRotation += rotateSeconds;
+        if (now - lastRotation >= 2 * rotateSeconds) {
+            lastRotation = now - 2 * rotateSeconds;
+        }
+    }
+}
+
+
+static void newKey(EarlyKey *k, uint32_t id)
+{
+    k->id = id;
+    k->priv = dh_generate_private();
+    k->pub = dh_compute_public(k->priv);
+    memset(k->seen, 0, EARLY_REPLAY_SLOTS * sizeof(unsigned long long));
+    k->used = 0;
+}
+
+
+/* Record client_pub as used with k. Returns false if it already was, or
+ * if the record is too full to tell.
+ */
+static bool remember(EarlyKey *k, unsigned long long client_pub)
+{
+    if (k->used >= EARLY_REPLAY_SLOTS / 4 * 3) {
+        return false;
+    }
+
+    unsigned slot = (unsigned)(client_pub * 0x9e3779b97f4a7c15ULL >> 40);
+    while (true) {
+        slot &= EARLY_REPLAY_SLOTS - 1;
+        if (k->seen[slot] == client_pub) {
+            return false;
+        }
+        if (k->seen[slot] == 0) {
+            k->seen[slot] = client_pub;
+            k->used++;
+            return true;
+        }
+        slot++;
+    }
+}
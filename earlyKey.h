@@ -0,0 +1,52 @@
+/* earlyKey.h
+ *
+ * Semi-Static Server Key for 0-RTT Requests - Header File
+ *
+ * A returning client should not have to wait a round trip for the
+ * Diffie-Hellman exchange before its first request. The server therefore
+ * keeps a semi-static key pair, rotated every few minutes, and advertises
+ * its public value (with a key id) in every OP_DH_PUB it sends. A client
+ * that has cached it can open a connection with OP_DH_EARLY: its fresh
+ * public value followed, in the same flight, by a few requests encrypted
+ * under the key it shares with the semi-static value (see finalPacket.h).
+ * The rest of the connection uses the usual per-connection key.
+ *
+ * REPLAY PROTECTION:
+ * -----------------
+ * Early requests can be captured and sent again, which must not post the
+ * same note twice. The server records every client public value accepted
+ * under each semi-static key and refuses early data that repeats one; a
+ * key is retired after two rotation periods, and its record with it, so
+ * the record only has to cover that window. A full record, an unknown or
+ * retired key id, or a restarted server (new keys) all make the server
+ * refuse the early requests. Refusal is never an error: the client just
+ * sends them again under the connection key.
+ */
+
+#ifndef _EARLYKEY_H
+#define _EARLYKEY_H
+
+#include <stdint.h>
+
+/* Client public values remembered per semi-static key (a power of two);
+ * early data is refused once a key's record is three quarters full
+ */
+const int EARLY_REPLAY_SLOTS = 1 << 16;
+
+/* Enable 0-RTT with a new semi-static key every 'seconds' seconds */
+void early_init(int seconds);
+
+/* Returns true once early_init() has been called */
+bool early_enabled();
+
+/* The semi-static key clients should use now, rotating it first if due */
+void early_current(uint32_t *key_id, unsigned long long *pub);
+
+/* Derive the key for early requests from a client that used key key_id
+ * and sent client_pub. Returns false (refusing the early requests) if the
+ * key is unknown or retired, or client_pub was already used with it.
+ */
+bool early_accept(uint32_t key_id, unsigned long long client_pub,
+                  unsigned long long *key);
+
+#endif
@@ -0,0 +1,1049 @@
+/* fanout.cc
+ *
+ * Room Subscriptions and Push Fan-Out - Implementation
+ *
+ * See fanout.h for how pushes are batched per event-loop turn, how
+ * large rooms are handed to the worker threads, and how those rooms are
+ * spread among the threads, and for the send queues of slow clients.
+ */
+
+#include "fanout.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "walLog.h"
+#include "numaPlace.h"
+#include "xor.h"
+
+struct PushBatch;
+
+/* Where an offloaded room's pushes are sent from. inflight and done_gen
+ * are guarded by queueLock; the rest belongs to the event loop.
+ */
+struct RoomFanout {
+    Room *room;
+    int owner;              /* its worker, or the first of its range */
+    int width;              /* workers it is split among */
+    bool pinned;            /* those workers serve no other room */
+    int gen;                /* placement generation, one per move */
+    int done_gen;           /* every slice up to this generation is sent */
+    int inflight[2];        /* unsent slices, by generation parity */
+    long load;              /* packets queued since the last rebalancing */
+    long rate;              /* load over the last period */
+    RoomFanout *next;
+};
+
+/* The subscribers of one batch that one worker serves */
+struct PushSlice {
+    PushBatch *batch;
+    int count;
+    ClientContext **targets;    /* NULL once released before dispatch */
+    int *after;                 /* each target's push_after */
+    PushSlice *next;            /* worker queue */
+};
+
+/* One turn's new notes for an offloaded room, copied once and shared by
+ * every slice
+ */
+struct PushBatch {
+    RoomFanout *fanout;
+    int gen;                    /* placement the slices were cut for */
+    int room_id;
+    int first;                  /* id of the note before text[0] */
+    int count;
+    char (*text)[MSG_SIZE];
+    uint64_t seq;               /* log sequence the notes need */
+    int slices_left;
+    PushSlice **slices;         /* one per worker, NULL if none */
+    PushBatch *next;            /* waiting for the log */
+};
+
+/* A fan-out thread and the slices queued for it */
+struct PushWorker {
+    pthread_t thread;
+    pthread_cond_t ready;
+    PushSlice *head;
+    PushSlice *tail;
+    int node;
+    Packet *frame;              /* allocated on the worker's node */
+};
+
+/* Packets a connection's send queue holds */
+const int QUEUE_PACKETS = FANOUT_QUEUE_BYTES / sizeof(Packet);
+
+/* What a connection's socket has not taken yet, guarded by its send_lock.
+ * backlogged and next are guarded by backlogLock.
+ */
+struct SendQueue {
+    ClientContext *ctx;
+    Packet *packets;
+    int count;
+    int sent;                   /* bytes of packets[0] already written */
+    int replies;                /* packets that are not to be dropped */
+    int markers;                /* OP_NOTE_RESYNC not yet written */
+    int resync_room;            /* room of the newest of them */
+    bool backlogged;
+    SendQueue *next;            /* backlog */
+};
+
+/* Rooms posted to since the last fanout_flush() */
+static Room *touchedHead = NULL;
+
+/* Batches waiting for the log, oldest first (event loop only) */
+static PushBatch *pendingHead = NULL;
+static PushBatch *pendingTail = NULL;
+
+static PushWorker *workers = NULL;
+static int workerCount = 0;
+static int *sliceSizes = NULL;
+
+/* Placement state, event loop only */
+static RoomFanout *offloadedRooms = NULL;
+static int offloadedCount = 0;
+static long *workerLoad = NULL;     /* rate of the rooms each one owns */
+static int *workerRooms = NULL;
+static bool *dedicated = NULL;      /* part of a pinned room's range */
+static RoomFanout *pinnedRoom = NULL;
+static struct timespec lastRebalance;
+
+/* Guards the worker queues; idle is signalled as slices finish */
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+
+/* Send queues that are not empty, and the thread that retries them */
+static pthread_mutex_t backlogLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backlogReady = PTHREAD_COND_INITIALIZER;
+static SendQueue *backlogHead = NULL;
+static bool drainerStarted = false;
+
+static long notesPushed = 0;
+static long framesPushed = 0;
+static long framesOffloaded = 0;
+static long roomMoves = 0;
+static long roomPins = 0;
+static long localBytes = 0;
+static long remoteBytes = 0;
+static long pushesDropped = 0;
+static long resyncsSent = 0;
+
+/* Function prototypes for top-down design */
+static bool pushNote(Note *n, void *arg);
+static void queueBatch(Room *r);
+static void placeRoom(Room *r);
+static int leastLoaded();
+static bool moveRoom(RoomFanout *rf, int owner, int width);
+static void rebalance();
+static void evenOut();
+static bool copyNote(Note *n, void *arg);
+static void *pushWorker(void *arg);
+static void pushSlice(PushWorker *w, PushSlice *slice);
+static void finishSlice(PushSlice *slice);
+static void waitForWorkers(ClientContext *ctx);
+static bool deliverLocked(ClientContext *ctx, Packet *p, int count);
+static bool makeRoom(SendQueue *q);
+static bool drainQueue(SendQueue *q, bool wait);
+static void addToBacklog(SendQueue *q);
+static void *drainQueues(void *arg);
+static void freeQueue(ClientContext *ctx);
+
+
+void fanout_init(int count)
+{
+    if (count < 1) {
+        return;
+    }
+
+    workerCount = count;
+    workers = new PushWorker[count];
+    sliceSizes = new int[count];
+    workerLoad = new long[count];
+    workerRooms = new int[count];
+    dedicated = new bool[count];
+    clock_gettime(CLOCK_MONOTONIC, &lastRebalance);
+    for (int w = 0; w < count; w++) {
+        workerLoad[w] = 0;
+        workerRooms[w] = 0;
+        dedicated[w] = false;
+        pthread_cond_init(&workers[w].ready, NULL);
+        workers[w].head = NULL;
+        workers[w].tail = NULL;
+        workers[w].node = w * place_nodes() / count;
+        pthread_create(&workers[w].thread, NULL, pushWorker, &workers[w]);
+    }
+}
+
+
+void fanout_subscribe(ClientContext *ctx, Room *r)
+{
+    fanout_unsubscribe(ctx);
+
+    ctx->subscribed = r;
+    ctx->push_after = r->note_count;
+    pthread_mutex_lock(&ctx->send_lock);
+    ctx->push_room = r->id;
+    pthread_mutex_unlock(&ctx->send_lock);
+    ctx->prev_subscriber = NULL;
+    ctx->next_subscriber = r->subscribers;
+    if (r->subscribers != NULL) {
+        r->subscribers->prev_subscriber = ctx;
+    }
+    r->subscribers = ctx;
+    r->subscriber_count++;
+}
+
+
+void fanout_unsubscribe(ClientContext *ctx)
+{
+    Room *r = ctx->subscribed;
+    if (r == NULL) {
+        return;
+    }
+
+    if (ctx->prev_subscriber != NULL) {
+        ctx->prev_subscriber->next_subscriber = ctx->next_subscriber;
+    } else {
+        r->subscribers = ctx->next_subscriber;
+    }
+    if (ctx->next_subscriber != NULL) {
+        ctx->next_subscriber->prev_subscriber = ctx->prev_subscriber;
+    }
+    r->subscriber_count--;
+    ctx->subscribed = NULL;
+    pthread_mutex_lock(&ctx->send_lock);
+    ctx->push_room = 0;
+    pthread_mutex_unlock(&ctx->send_lock);
+    ctx->prev_subscriber = NULL;
+    ctx->next_subscriber = NULL;
+}
+
+
+void fanout_release(ClientContext *ctx)
+{
+    waitForWorkers(ctx);
+    freeQueue(ctx);
+}
+
+
+void fanout_note_added(Room *r)
+{
+    if (r->subscribers != NULL && !r->touched) {
+        r->touched = true;
+        r->next_touched = touchedHead;
+        touchedHead = r;
+    }
+}
+
+
+void fanout_flush(PushVisitor pushed)
+{
+    ClientContext *pushedHead = NULL;
+
+    Room *r = touchedHead;
+    touchedHead = NULL;
+    while (r != NULL) {
+        Room *next = r->next_touched;
+        r->touched = false;
+        r->next_touched = NULL;
+
+        if (workerCount > 0 && r->fanout == NULL &&
+            r->subscriber_count >= FANOUT_OFFLOAD_MEMBERS) {
+            placeRoom(r);
+        }
+        if (r->fanout != NULL) {
+            queueBatch(r);
+            r = next;
+            continue;
+        }
+
+        /* Every new note for this subscriber, queued back to back */
+        for (ClientContext *s = r->subscribers; s != NULL;
+             s = s->next_subscriber) {
+            if (s->push_after >= r->note_count) {
+                continue;
+            }
+            forEachNoteAfter(r, s->push_after, pushNote, s);
+            s->push_after = r->note_count;
+            __atomic_add_fetch(&framesPushed, 1, __ATOMIC_RELAXED);
+
+            if (!s->pushed) {
+                s->pushed = true;
+                s->next_pushed = pushedHead;
+                pushedHead = s;
+            }
+        }
+        r = next;
+    }
+
+    /* Only now may a failed send disconnect someone */
+    while (pushedHead != NULL) {
+        ClientContext *s = pushedHead;
+        pushedHead = s->next_pushed;
+        s->pushed = false;
+        s->next_pushed = NULL;
+        if (pushed != NULL) {
+            pushed(s);
+        }
+    }
+}
+
+
+void fanout_dispatch()
+{
+    uint64_t durable = wal_durable();
+
+    while (pendingHead != NULL && pendingHead->seq <= durable) {
+        PushBatch *b = pendingHead;
+        pendingHead = b->next;
+        if (pendingHead == NULL) {
+            pendingTail = NULL;
+        }
+
+        pthread_mutex_lock(&queueLock);
+        for (int w = 0; w < workerCount; w++) {
+            PushSlice *slice = b->slices[w];
+            if (slice == NULL) {
+                continue;
+            }
+            if (workers[w].tail != NULL) {
+                workers[w].tail->next = slice;
+            } else {
+                workers[w].head = slice;
+            }
+            workers[w].tail = slice;
+            pthread_cond_signal(&workers[w].ready);
+        }
+        pthread_mutex_unlock(&queueLock);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - lastRebalance.tv_sec) * 1000 +
+                   (now.tv_nsec - lastRebalance.tv_nsec) / 1000000;
+    if (workerCount > 1 && elapsed >= FANOUT_REBALANCE_MS) {
+        lastRebalance = now;
+        rebalance();
+    }
+}
+
+
+bool fanout_deliver(ClientContext *ctx, Packet *p, int count)
+{
+    pthread_mutex_lock(&ctx->send_lock);
+    bool sent = deliverLocked(ctx, p, count);
+    SendQueue *q = ctx->send_queue;
+    bool waiting = q != NULL && q->count > 0;
+    pthread_mutex_unlock(&ctx->send_lock);
+
+    if (waiting) {
+        addToBacklog(q);
+    }
+    return sent;
+}
+
+
+void fanout_drain()
+{
+    pthread_mutex_lock(&backlogLock);
+    SendQueue **link = &backlogHead;
+    while (*link != NULL) {
+        SendQueue *q = *link;
+
+        /* A failed connection is left to the event loop to close */
+        pthread_mutex_lock(&q->ctx->send_lock);
+        drainQueue(q, false);
+        bool empty = q->count == 0;
+        pthread_mutex_unlock(&q->ctx->send_lock);
+
+        if (empty) {
+            *link = q->next;
+            q->backlogged = false;
+            q->next = NULL;
+        } else {
+            link = &q->next;
+        }
+    }
+    pthread_mutex_unlock(&backlogLock);
+}
+
+
+void fanout_stats(FanoutStats *stats)
+{
+    stats->notes = __atomic_load_n(&notesPushed, __ATOMIC_RELAXED);
+    stats->frames = __atomic_load_n(&framesPushed, __ATOMIC_RELAXED);
+    stats->offloaded = __atomic_load_n(&framesOffloaded, __ATOMIC_RELAXED);
+    stats->moves = roomMoves;
+    stats->pins = roomPins;
+    stats->local_bytes = __atomic_load_n(&localBytes, __ATOMIC_RELAXED);
+    stats->remote_bytes = __atomic_load_n(&remoteBytes, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&pushesDropped, __ATOMIC_RELAXED);
+    stats->resyncs = __atomic_load_n(&resyncsSent, __ATOMIC_RELAXED);
+}
+
+
+/* --- Helper Functions --- */
+
+static bool pushNote(Note *n, void *arg)
+{
+    ClientContext *ctx = (ClientContext *)arg;
+
+    Packet p;
+    memset(&p, 0, sizeof(p));
+    p.op = OP_NOTE_PUSH;
+    p.room_id = ctx->subscribed->id;
+    p.tag = n->id;
+    memcpy(p.message, n->ciphertext, MSG_SIZE);
+    __atomic_add_fetch(&notesPushed, 1, __ATOMIC_RELAXED);
+    return sendPacketEncrypted(ctx, &p);
+}
+
+
+/* Copy r's new notes into a batch and cut it into a slice for each of
+ * the room's workers; the batch waits for the log before
+ * fanout_dispatch() hands it over
+ */
+static void queueBatch(Room *r)
+{
+    RoomFanout *rf = r->fanout;
+    int first = r->note_count;
+    memset(sliceSizes, 0, workerCount * sizeof(int));
+    for (ClientContext *s = r->subscribers; s != NULL;
+         s = s->next_subscriber) {
+        if (s->push_after < r->note_count) {
+            if (s->push_after < first) {
+                first = s->push_after;
+            }
+            sliceSizes[rf->owner + s->conn_id % rf->width]++;
+        }
+    }
+    if (first == r->note_count) {
+        return;
+    }
+
+    PushBatch *b = new PushBatch;
+    b->fanout = rf;
+    b->gen = rf->gen;
+    b->room_id = r->id;
+    b->first = first;
+    b->count = r->note_count - first;
+    b->text = new char[b->count][MSG_SIZE];
+    b->seq = wal_sequence();
+    b->slices_left = 0;
+    b->slices = new PushSlice*[workerCount];
+    b->next = NULL;
+    forEachNoteAfter(r, first, copyNote, b);
+
+    for (int w = 0; w < workerCount; w++) {
+        b->slices[w] = NULL;
+        if (sliceSizes[w] == 0) {
+            continue;
+        }
+        PushSlice *slice = new PushSlice;
+        slice->batch = b;
+        slice->count = 0;
+        slice->targets = new ClientContext*[sliceSizes[w]];
+        slice->after = new int[sliceSizes[w]];
+        slice->next = NULL;
+        b->slices[w] = slice;
+        b->slices_left++;
+    }
+
+    for (ClientContext *s = r->subscribers; s != NULL;
+         s = s->next_subscriber) {
+        if (s->push_after >= r->note_count) {
+            continue;
+        }
+        PushSlice *slice = b->slices[rf->owner + s->conn_id % rf->width];
+        slice->targets[slice->count] = s;
+        slice->after[slice->count] = s->push_after;
+        slice->count++;
+        rf->load += r->note_count - s->push_after;
+        s->push_after = r->note_count;
+        __atomic_add_fetch(&s->pushes_pending, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&queueLock);
+    rf->inflight[b->gen & 1] += b->slices_left;
+    pthread_mutex_unlock(&queueLock);
+
+    if (pendingTail != NULL) {
+        pendingTail->next = b;
+    } else {
+        pendingHead = b;
+    }
+    pendingTail = b;
+}
+
+
+static bool copyNote(Note *n, void *arg)
+{
+    PushBatch *b = (PushBatch *)arg;
+    memcpy(b->text[n->id - 1 - b->first], n->ciphertext, MSG_SIZE);
+    return true;
+}
+
+
+/* Worker thread: push each queued slice, in order, once the room's
+ * previous placement has sent everything it was given
+ */
+static void *pushWorker(void *arg)
+{
+    PushWorker *w = (PushWorker *)arg;
+
+    place_run_on_node(w->node);
+    place_prefer_memory(w->node);
+    w->frame = new Packet[POOL_BUFFER_SIZE / sizeof(Packet)];
+
+    while (true) {
+        pthread_mutex_lock(&queueLock);
+        while (w->head == NULL) {
+            pthread_cond_wait(&w->ready, &queueLock);
+        }
+        PushSlice *slice = w->head;
+        w->head = slice->next;
+        if (w->head == NULL) {
+            w->tail = NULL;
+        }
+
+        PushBatch *b = slice->batch;
+        while (b->fanout->done_gen < b->gen - 1) {
+            pthread_cond_wait(&idle, &queueLock);
+        }
+        pthread_mutex_unlock(&queueLock);
+
+        pushSlice(w, slice);
+        finishSlice(slice);
+    }
+    return NULL;
+}
+
+
+/* Encrypt the batch for each target and send it as one frame. A failed
+ * send is left to the event loop, which will see the connection close.
+ */
+static void pushSlice(PushWorker *w, PushSlice *slice)
+{
+    PushBatch *b = slice->batch;
+    const int perSend = POOL_BUFFER_SIZE / sizeof(Packet);
+    long *reads = w->node == place_home() ? &localBytes : &remoteBytes;
+
+    for (int i = 0; i < slice->count; i++) {
+        ClientContext *ctx = slice->targets[i];
+        if (ctx == NULL) {
+            continue;
+        }
+
+        int used = 0;
+        for (int k = slice->after[i] - b->first; k < b->count; k++) {
+            Packet *p = &w->frame[used++];
+            memset(p, 0, sizeof(Packet));
+            p->op = OP_NOTE_PUSH;
+            p->room_id = b->room_id;
+            p->tag = b->first + k + 1;
+            memcpy(p->message, b->text[k], MSG_SIZE);
+            xor_buffer(p->message, MSG_SIZE, ctx->shared_key);
+
+            if (used == perSend || k == b->count - 1) {
+                fanout_deliver(ctx, w->frame, used);
+                used = 0;
+            }
+        }
+
+        int sent = b->count - (slice->after[i] - b->first);
+        __atomic_add_fetch(&notesPushed, sent, __ATOMIC_RELAXED);
+        __atomic_add_fetch(reads, (long)sent * MSG_SIZE, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&framesPushed, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&framesOffloaded, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* Let go of the slice's targets, and of the batch after its last slice.
+ * The last slice of a superseded generation lets the next one start.
+ */
+static void finishSlice(PushSlice *slice)
+{
+    PushBatch *b = slice->batch;
+    RoomFanout *rf = b->fanout;
+
+    pthread_mutex_lock(&queueLock);
+    for (int i = 0; i < slice->count; i++) {
+        if (slice->targets[i] != NULL) {
+            __atomic_sub_fetch(&slice->targets[i]->pushes_pending, 1,
+                               __ATOMIC_RELEASE);
+        }
+    }
+    if (--rf->inflight[b->gen & 1] == 0 && rf->gen > b->gen &&
+        rf->done_gen < b->gen) {
+        rf->done_gen = b->gen;
+    }
+    pthread_cond_broadcast(&idle);
+    pthread_mutex_unlock(&queueLock);
+
+    delete [] slice->targets;
+    delete [] slice->after;
+    delete slice;
+
+    if (__atomic_sub_fetch(&b->slices_left, 1, __ATOMIC_ACQ_REL) == 0) {
+        delete [] b->text;
+        delete [] b->slices;
+        delete b;
+    }
+}
+
+
+/* Give a newly offloaded room to the least loaded worker */
+static void placeRoom(Room *r)
+{
+    RoomFanout *rf = new RoomFanout;
+    rf->room = r;
+    rf->owner = leastLoaded();
+    rf->width = 1;
+    rf->pinned = false;
+    rf->gen = 0;
+    rf->done_gen = -1;
+    rf->inflight[0] = 0;
+    rf->inflight[1] = 0;
+    rf->load = 0;
+    rf->rate = 0;
+    rf->next = offloadedRooms;
+    offloadedRooms = rf;
+    offloadedCount++;
+    r->fanout = rf;
+
+    /* Until it has been measured, count a room by its size */
+    workerLoad[rf->owner] += r->subscriber_count;
+    workerRooms[rf->owner]++;
+}
+
+
+/* The worker outside any pinned range with the least load, then the
+ * fewest rooms; remote workers' load is weighted up
+ */
+static int leastLoaded()
+{
+    int best = -1;
+    double bestLoad = 0;
+    for (int w = 0; w < workerCount; w++) {
+        if (dedicated[w]) {
+            continue;
+        }
+        double load = workerLoad[w];
+        if (workers[w].node != place_home()) {
+            load = load * FANOUT_REMOTE_WEIGHT + 1;
+        }
+        if (best < 0 || load < bestLoad ||
+            (load == bestLoad && workerRooms[w] < workerRooms[best])) {
+            best = w;
+            bestLoad = load;
+        }
+    }
+    return best;
+}
+
+
+/* Send rf's future batches from workers [owner, owner + width). Returns
+ * false, changing nothing, while its last move is still draining.
+ */
+static bool moveRoom(RoomFanout *rf, int owner, int width)
+{
+    pthread_mutex_lock(&queueLock);
+    if (rf->done_gen < rf->gen - 1) {
+        pthread_mutex_unlock(&queueLock);
+        return false;
+    }
+    if (rf->inflight[rf->gen & 1] == 0) {
+        rf->done_gen = rf->gen;
+    }
+    rf->gen++;
+    pthread_mutex_unlock(&queueLock);
+
+    if (rf->width == 1) {
+        workerRooms[rf->owner]--;
+    }
+    if (width == 1) {
+        workerRooms[owner]++;
+    }
+    rf->owner = owner;
+    rf->width = width;
+    roomMoves++;
+    return true;
+}
+
+
+/* Take the last period's load, pin or unpin the busiest room, and even
+ * out the rest
+ */
+static void rebalance()
+{
+    long total = 0;
+    for (RoomFanout *rf = offloadedRooms; rf != NULL; rf = rf->next) {
+        rf->rate = rf->load;
+        rf->load = 0;
+        total += rf->rate;
+    }
+    if (total == 0) {
+        return;
+    }
+
+    if (pinnedRoom != NULL &&
+        pinnedRoom->rate < total * FANOUT_PIN_SHARE / 2) {
+        RoomFanout *rf = pinnedRoom;
+        for (int w = rf->owner; w < rf->owner + rf->width; w++) {
+            dedicated[w] = false;
+        }
+        if (moveRoom(rf, leastLoaded(), 1)) {
+            rf->pinned = false;
+            pinnedRoom = NULL;
+        } else {
+            for (int w = rf->owner; w < rf->owner + rf->width; w++) {
+                dedicated[w] = true;
+            }
+        }
+    }
+
+    if (pinnedRoom == NULL) {
+        for (RoomFanout *rf = offloadedRooms; rf != NULL; rf = rf->next) {
+            if (rf->rate < total * FANOUT_PIN_SHARE) {
+                continue;
+            }
+
+            /* A share of the workers in proportion to its share of the
+             * load, leaving at least one for everyone else
+             */
+            int width = (int)((double)rf->rate / total * workerCount + 0.5);
+            if (width > workerCount - 1) {
+                width = workerCount - 1;
+            }
+            if (moveRoom(rf, workerCount - width, width)) {
+                rf->pinned = true;
+                pinnedRoom = rf;
+                roomPins++;
+                for (int w = rf->owner; w < workerCount; w++) {
+                    dedicated[w] = true;
+                }
+                printf("Room %d pinned to %d fan-out threads (%.0f%% of "
+                       "the load)\n", rf->room->id, width,
+                       100.0 * rf->rate / total);
+            }
+            break;
+        }
+    }
+
+    evenOut();
+}
+
+
+/* Move rooms off workers in a pinned range, then from the busiest worker
+ * to the idlest while that narrows the gap
+ */
+static void evenOut()
+{
+    for (int w = 0; w < workerCount; w++) {
+        workerLoad[w] = 0;
+    }
+    for (RoomFanout *rf = offloadedRooms; rf != NULL; rf = rf->next) {
+        if (!rf->pinned) {
+            workerLoad[rf->owner] += rf->rate;
+        }
+    }
+
+    for (RoomFanout *rf = offloadedRooms; rf != NULL; rf = rf->next) {
+        if (!rf->pinned && dedicated[rf->owner]) {
+            int from = rf->owner;
+            int to = leastLoaded();
+            if (moveRoom(rf, to, 1)) {
+                workerLoad[from] -= rf->rate;
+                workerLoad[to] += rf->rate;
+            }
+        }
+    }
+
+    long shared = 0;
+    int sharedCount = 0;
+    for (int w = 0; w < workerCount; w++) {
+        if (!dedicated[w]) {
+            shared += workerLoad[w];
+            sharedCount++;
+        }
+    }
+    double average = (double)shared / sharedCount;
+
+    for (int m = 0; m < offloadedCount; m++) {
+        int hi = -1;
+        for (int w = 0; w < workerCount; w++) {
+            if (!dedicated[w] && (hi < 0 || workerLoad[w] > workerLoad[hi])) {
+                hi = w;
+            }
+        }
+        int lo = leastLoaded();
+        if (hi == lo || workerLoad[hi] <= FANOUT_IMBALANCE * average) {
+            return;
+        }
+
+        /* The busiest of its rooms that still narrows the gap */
+        long gap = workerLoad[hi] - workerLoad[lo];
+        RoomFanout *best = NULL;
+        for (RoomFanout *rf = offloadedRooms; rf != NULL; rf = rf->next) {
+            if (!rf->pinned && rf->owner == hi && rf->rate > 0 &&
+                rf->rate < gap && (best == NULL || rf->rate > best->rate)) {
+                best = rf;
+            }
+        }
+        if (best == NULL || !moveRoom(best, lo, 1)) {
+            return;
+        }
+        workerLoad[hi] -= best->rate;
+        workerLoad[lo] += best->rate;
+    }
+}
+
+
+/* Send p behind whatever is queued, keeping what the socket does not
+ * take. Pushes are dropped in favour of a resync marker rather than let
+ * the queue grow past QUEUE_PACKETS.
+ */
+static bool deliverLocked(ClientContext *ctx, Packet *p, int count)
+{
+    SendQueue *q = ctx->send_queue;
+    bool tried = false;
+
+    if (q == NULL || q->count == 0) {
+        int n = transmitBytes(ctx, p, count * sizeof(Packet), false);
+        if (n < 0) {
+            return false;
+        }
+        p += n / sizeof(Packet);
+        count -= n / sizeof(Packet);
+        if (count == 0) {
+            return true;
+        }
+
+        if (q == NULL) {
+            q = new SendQueue;
+            q->ctx = ctx;
+            q->packets = new Packet[QUEUE_PACKETS];
+            q->count = 0;
+            q->replies = 0;
+            q->markers = 0;
+            q->resync_room = 0;
+            q->backlogged = false;
+            q->next = NULL;
+            ctx->send_queue = q;
+        }
+        q->sent = n % sizeof(Packet);
+        tried = true;
+    }
+
+    for (int i = 0; i < count; i++) {
+        bool push = p[i].op == OP_NOTE_PUSH;
+        bool started = q->count == 0 && q->sent > 0;
+
+        /* Until the client has been told to resync, the room's pushes
+         * are moot
+         */
+        bool moot = push && q->markers > 0 &&
+                    p[i].room_id == q->resync_room;
+        if (moot && !started) {
+            __atomic_add_fetch(&pushesDropped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (q->count == QUEUE_PACKETS) {
+            if (!makeRoom(q)) {
+                return false;
+            }
+            if (push && q->markers > 0 && p[i].room_id == q->resync_room) {
+                __atomic_add_fetch(&pushesDropped, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+        }
+
+        q->packets[q->count++] = p[i];
+        if (!push) {
+            q->replies++;
+        }
+    }
+
+    /* Replies are not left waiting, as they never were */
+    if (q->replies > 0) {
+        return drainQueue(q, true);
+    }
+    return tried || drainQueue(q, false);
+}
+
+
+/* Free a full queue's space: drop its pushes (but not a packet already
+ * partly written) and put one resync marker for those of the subscribed
+ * room at the end, or if it holds no pushes, wait until it is sent.
+ * Pushes and markers for a room the client has since left are dropped
+ * without a marker.
+ */
+static bool makeRoom(SendQueue *q)
+{
+    int room = q->ctx->push_room;
+    int kept = q->sent > 0 ? 1 : 0;
+    int from = 0;
+    int dropped = 0;
+
+    for (int i = kept; i < q->count; i++) {
+        Packet *p = &q->packets[i];
+        if (p->op == OP_NOTE_PUSH) {
+            if (p->room_id == room && (from == 0 || p->tag < from)) {
+                from = p->tag;
+            }
+            dropped++;
+        } else if (p->op == OP_NOTE_RESYNC && p->room_id != room) {
+            q->markers--;
+        } else {
+            q->packets[kept++] = *p;
+        }
+    }
+    bool freed = kept < q->count;
+    q->count = kept;
+    __atomic_add_fetch(&pushesDropped, dropped, __ATOMIC_RELAXED);
+
+    if (from == 0) {
+        return freed || drainQueue(q, true);
+    }
+
+    Packet *marker = &q->packets[q->count++];
+    memset(marker, 0, sizeof(Packet));
+    marker->op = OP_NOTE_RESYNC;
+    marker->room_id = room;
+    marker->tag = from;
+    xor_buffer(marker->message, MSG_SIZE, q->ctx->shared_key);
+    q->markers++;
+    q->resync_room = room;
+    return true;
+}
+
+
+/* Write as much of the queue as the socket takes (all of it if wait) */
+static bool drainQueue(SendQueue *q, bool wait)
+{
+    if (q->count == 0) {
+        return true;
+    }
+
+    int len = q->count * sizeof(Packet) - q->sent;
+    int n = transmitBytes(q->ctx, (char *)q->packets + q->sent, len, wait);
+    if (n < 0) {
+        return false;
+    }
+
+    int done = (q->sent + n) / sizeof(Packet);
+    for (int i = 0; i < done; i++) {
+        if (q->packets[i].op == OP_NOTE_RESYNC) {
+            q->markers--;
+            __atomic_add_fetch(&resyncsSent, 1, __ATOMIC_RELAXED);
+        } else if (q->packets[i].op != OP_NOTE_PUSH) {
+            q->replies--;
+        }
+    }
+    memmove(q->packets, q->packets + done,
+            (q->count - done) * sizeof(Packet));
+    q->count -= done;
+    q->sent = (q->sent + n) % sizeof(Packet);
+    return true;
+}
+
+
+/* Have fanout_drain() retry q, starting the drain thread the first time */
+static void addToBacklog(SendQueue *q)
+{
+    pthread_mutex_lock(&backlogLock);
+    if (!q->backlogged) {
+        q->backlogged = true;
+        q->next = backlogHead;
+        backlogHead = q;
+        if (!drainerStarted) {
+            pthread_t thread;
+            pthread_create(&thread, NULL, drainQueues, NULL);
+            pthread_detach(thread);
+            drainerStarted = true;
+        }
+        pthread_cond_signal(&backlogReady);
+    }
+    pthread_mutex_unlock(&backlogLock);
+}
+
+
+/* Drain thread: retry the backlog every FANOUT_DRAIN_MS while it is not
+ * empty, so that a queue drains even while the event loop is idle
+ */
+static void *drainQueues(void *arg)
+{
+    struct timespec pause;
+    pause.tv_sec = 0;
+    pause.tv_nsec = FANOUT_DRAIN_MS * 1000000L;
+
+    while (true) {
+        pthread_mutex_lock(&backlogLock);
+        while (backlogHead == NULL) {
+            pthread_cond_wait(&backlogReady, &backlogLock);
+        }
+        pthread_mutex_unlock(&backlogLock);
+
+        nanosleep(&pause, NULL);
+        fanout_drain();
+    }
+    return NULL;
+}
+
+
+/* Called from fanout_release(): take ctx out of batches not yet handed
+ * over, and wait for the workers to finish with it
+ */
+static void waitForWorkers(ClientContext *ctx)
+{
+    if (__atomic_load_n(&ctx->pushes_pending, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+
+    /* Batches still waiting for the log belong to this thread */
+    for (PushBatch *b = pendingHead; b != NULL; b = b->next) {
+        for (int w = 0; w < workerCount; w++) {
+            PushSlice *slice = b->slices[w];
+            for (int i = 0; slice != NULL && i < slice->count; i++) {
+                if (slice->targets[i] == ctx) {
+                    slice->targets[i] = NULL;
+                    __atomic_sub_fetch(&ctx->pushes_pending, 1,
+                                       __ATOMIC_RELEASE);
+                }
+            }
+        }
+    }
+
+    /* The rest are with the workers */
+    pthread_mutex_lock(&queueLock);
+    while (__atomic_load_n(&ctx->pushes_pending, __ATOMIC_ACQUIRE) > 0) {
+        pthread_cond_wait(&idle, &queueLock);
+    }
+    pthread_mutex_unlock(&queueLock);
+}
+
+
+/* Called from fanout_release(), once no worker can send to ctx */
+static void freeQueue(ClientContext *ctx)
+{
+    SendQueue *q = ctx->send_queue;
+    if (q == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&backlogLock);
+    if (q->backlogged) {
+        SendQueue **link = &backlogHead;
+        while (*link != q) {
+            link = &(*link)->next;
+        }
+        *link = q->next;
+    }
+    pthread_mutex_unlock(&backlogLock);
+
+    delete [] q->packets;
+    delete q;
+    ctx->send_queue = NULL;
+}
@@ -0,0 +1,183 @@
+/* fanout.h
+ *
+ * Room Subscriptions and Push Fan-Out - Header File
+ *
+ * A connection that sends OP_SUBSCRIBE is pushed every note posted to its
+ * room from then on (see finalPacket.h), instead of having to poll with
+ * OP_LIST_NOTES.
+ *
+ * BATCHING:
+ * --------
+ * Posts are not fanned out as they arrive. handlePostNote() only marks
+ * the room as touched; once per event-loop turn, after every ready
+ * connection has been read, fanout_flush() visits each touched room once
+ * and queues all of the turn's new notes for each subscriber back to
+ * back. Every subscriber therefore gets a single frame (one send) per
+ * turn however many members posted to the room in that turn, so in a hot
+ * room sends per note drop by the number of posts per turn.
+ *
+ * Subscriber lists are linked through the ClientContext and Room
+ * structures themselves, so subscribing and pushing never allocate.
+ *
+ * OFFLOADED ROOMS:
+ * ---------------
+ * Encrypting and sending a note for every member of a room with thousands
+ * of subscribers would hold up the event loop, and with it every other
+ * client's reply, for time proportional to the room's size. Once a room
+ * has FANOUT_OFFLOAD_MEMBERS subscribers (and fanout_init() has started
+ * workers), fanout_flush() only copies the turn's new notes once into a
+ * batch and splits the subscribers among the workers; each worker then
+ * encrypts the batch per recipient and sends it straight to the socket.
+ * The loop's own cost is a copy of the notes and of the subscriber list.
+ *
+ * Workers are spread evenly over the NUMA nodes and allocate their own
+ * buffers there (see numaPlace.h).
+ *
+ * Each offloaded room is owned by one worker, which sends all of its
+ * batches. A room stays offloaded once it has been, so that its pushes
+ * never overtake ones still queued for a worker. Like replies, batches
+ * are only handed over once the log is durable (fanout_dispatch()).
+ * Workers and the event loop take the connection's send_lock around each
+ * send, and fanout_release() must be called before a connection is
+ * closed. Pushes from a worker can arrive between any two packets of a
+ * multi-packet reply.
+ *
+ * SLOW SUBSCRIBERS:
+ * ----------------
+ * Pushes, and the replies flushed by the event loop, go out through
+ * fanout_deliver(), which never waits on a client for a push. Whatever
+ * the socket does not take at once is kept in the connection's send
+ * queue and retried by fanout_drain(), on each event-loop turn and every
+ * FANOUT_DRAIN_MS from a thread of its own. A client that stops reading
+ * therefore costs at most FANOUT_QUEUE_BYTES: when the queue is full its
+ * queued pushes are dropped and replaced by a single OP_NOTE_RESYNC
+ * telling the client where in its current room to fetch from, and new
+ * pushes for that room are dropped until that has been sent (see
+ * finalPacket.h). Pushes, and markers, still queued for a room the
+ * client has since left are dropped without one. Replies are never
+ * dropped; a queue holding any is sent in full before fanout_deliver()
+ * returns, as all replies were before. Healthy subscribers, whose sockets
+ * take every frame at once, never touch the queue.
+ *
+ * REBALANCING:
+ * -----------
+ * A new room goes to the worker with the least load, but rooms do not
+ * stay equally busy. The load of each room (notes times recipients) is
+ * measured over every FANOUT_REBALANCE_MS, and when the busiest worker
+ * carries more than FANOUT_IMBALANCE times the average, its rooms are
+ * moved to the idlest worker until that is no longer so. A room carrying
+ * FANOUT_PIN_SHARE of all the load or more would saturate any one worker,
+ * so it is pinned instead: it gets a range of workers of its own, in
+ * proportion to its share, and its subscribers are split among them by
+ * connection id. It is unpinned when its share falls below half that.
+ *
+ * A move must not let the new owner push a room's notes before the old
+ * one has sent the earlier ones. Every move starts a new generation for
+ * the room; a worker holds a slice until every slice of the previous
+ * generation has been sent, and a room is not moved again until that has
+ * happened.
+ *
+ * Between moves, every push to a given connection comes from the same
+ * worker: its room's owner, or for a pinned room the worker its
+ * connection id picks within the range. A subscriber's socket, key and
+ * send queue are therefore only shared between that worker and the event
+ * loop, and a connection follows its room when the room moves, rather
+ * than rooms following connections. Requests themselves are all handled
+ * by the one event loop, so there is no reactor to steer a connection to.
+ */
+
+#ifndef _FANOUT_H
+#define _FANOUT_H
+
+#include "noteStore.h"
+#include "requestHandler.h"
+
+/* Most bytes of unsent packets kept for a connection */
+const int FANOUT_QUEUE_BYTES = 65536;
+
+/* How often the send queues are retried while the event loop is idle */
+const int FANOUT_DRAIN_MS = 10;
+
+/* Subscribers from which a room's pushes are sent by the workers */
+const int FANOUT_OFFLOAD_MEMBERS = 256;
+
+/* Milliseconds of load measured before each rebalancing */
+const int FANOUT_REBALANCE_MS = 1000;
+
+/* Load of the busiest worker, over the average, that triggers moves */
+const double FANOUT_IMBALANCE = 1.25;
+
+/* Share of the total load from which a room gets workers of its own */
+const double FANOUT_PIN_SHARE = 0.5;
+
+/* When choosing a worker for a room, the load of a worker off the home
+ * NUMA node counts this much more: notes are copied on the home node, so
+ * every recipient a remote worker serves is a cross-node read
+ */
+const double FANOUT_REMOTE_WEIGHT = 1.25;
+
+/* Totals since startup */
+struct FanoutStats {
+    long notes;             /* notes pushed (one per subscriber) */
+    long frames;            /* frames pushed */
+    long offloaded;         /* of which sent by the workers */
+    long moves;             /* rooms moved to another worker */
+    long pins;              /* rooms given workers of their own */
+    long local_bytes;       /* note bytes workers read on their own node */
+    long remote_bytes;      /* ... and from another node */
+    long dropped;           /* pushes dropped for slow subscribers */
+    long resyncs;           /* OP_NOTE_RESYNC sent in their place */
+};
+
+/* Start 'workers' push threads for large rooms (none: push inline) */
+void fanout_init(int workers);
+
+/* Push the notes posted to r after its current latest note to ctx. Ends
+ * any earlier subscription of ctx.
+ */
+void fanout_subscribe(ClientContext *ctx, Room *r);
+
+/* End ctx's subscription, if any */
+void fanout_unsubscribe(ClientContext *ctx);
+
+/* Drop ctx from batches not yet handed over, wait for the workers to
+ * finish with it and free its send queue. Call after
+ * fanout_unsubscribe(), before closing ctx.
+ */
+void fanout_release(ClientContext *ctx);
+
+/* Note that r has new notes to push this turn */
+void fanout_note_added(Room *r);
+
+/* Queue this turn's new notes for every subscriber of every touched room,
+ * then call pushed() (if not NULL) once for each connection that now has
+ * a frame waiting to be sent. pushed() may disconnect the client.
+ */
+typedef void (*PushVisitor)(ClientContext *ctx);
+void fanout_flush(PushVisitor pushed);
+
+/* Hand the workers every batch whose notes are now durable in the log,
+ * and rebalance the rooms among them when it is time to
+ */
+void fanout_dispatch();
+
+/* Send 'count' packets, already encrypted, to the client behind anything
+ * still queued for it, queueing what the socket does not take (see SLOW
+ * SUBSCRIBERS). Safe from any thread. Returns false if the connection
+ * failed.
+ */
+bool fanout_deliver(ClientContext *ctx, Packet *p, int count);
+
+/* Retry every connection's send queue without waiting */
+void fanout_drain();
+
+void fanout_stats(FanoutStats *stats);
+
+/* Provided by the program: write len bytes to the client's socket, with
+ * its send_lock held. Unless wait is set, only what the socket takes at
+ * once is written. Returns the number of bytes written, or -1 if the
+ * connection failed.
+ */
+int transmitBytes(ClientContext *ctx, const void *data, int len, bool wait);
+
+#endif
@@ -7,7 +7,9 @@
  * and view all notes in a room. All communication is encrypted using
  * Diffie-Hellman key exchange.
  *
- * Usage: finalClient <server-addr> <port>
+ * Usage: finalClient <server-addr> <port> [-f]
+ *
+ *   -f   The server was started with -f and sends its public value first
  */
 
 #include <stdio.h>
@@ -20,6 +22,9 @@
 #include "diffieHellman.h"
 #include "xor.h"
 
+/* Recent notes shown when joining a room */
+const int JOIN_PRELOAD = 10;
+
 /* Function prototypes for top-down design */
 char *getServerInfo(int argc, char *argv[], int *port);
 void connectToServer(char *server, int port);
@@ -30,11 +35,14 @@ void closeConnection();
 /* Helper functions */
 void sendEncrypted(Packet *p);
 bool recvEncrypted(Packet *p);
+void printNotes();
 
 /* Global variables */
 Socket clientSocket;
 unsigned long long sharedKey = 0;
 int currentRoomId = -1;
+int latestNoteId = 0;
+bool serverFirst = false;
 
 
 int main(int argc, char *argv[])
@@ -80,16 +88,23 @@ void doHandshake()
     unsigned long long priv = dh_generate_private();
     unsigned long long pub = dh_compute_public(priv);
 
-    /* Send public key to server */
+    /* Send public key to server (after receiving its key, if it goes
+     * first; it does not answer ours then)
+     */
     Packet p;
     memset(&p, 0, sizeof(p));
     p.op = OP_DH_PUB;
     sprintf(p.message, "%llu", pub);
-    clientSocket.send(&p, sizeof(Packet));
+    if (!serverFirst) {
+        clientSocket.send(&p, sizeof(Packet));
+    }
 
     /* Receive server's public key */
     Packet resp;
     int n = clientSocket.recv(&resp, sizeof(Packet));
+    if (n > 0 && serverFirst) {
+        clientSocket.send(&p, sizeof(Packet));
+    }
 
     if (n > 0) {
         unsigned long long server_pub = strtoull(resp.message, NULL, 10);
@@ -156,14 +171,20 @@ void processMessages()
             }
             getchar(); /* Consume newline */
 
+            /* The most recent notes come back with the join */
             req.op = OP_JOIN_ROOM;
             req.tag = code;
+            req.room_id = JOIN_PRELOAD;
             sendEncrypted(&req);
 
             if (recvEncrypted(&resp)) {
                 if (resp.op == OP_JOIN_ROOM_RESP) {
                     currentRoomId = resp.room_id;
+                    latestNoteId = resp.tag;
                     printf("Joined Room %d successfully.\n", resp.room_id);
+                    printf("\n--- Recent Notes (latest: %d) ---\n",
+                           latestNoteId);
+                    printNotes();
                 } else if (resp.op == OP_ERROR) {
                     printf("Error: %s\n", resp.message);
                 }
@@ -194,17 +215,7 @@ void processMessages()
                 sendEncrypted(&req);
 
                 printf("\n--- Room Notes ---\n");
-                bool reading = true;
-                while (reading) {
-                    if (!recvEncrypted(&resp)) {
-                        reading = false;
-                    } else if (resp.tag == 0) {
-                        reading = false; /* End marker */
-                    } else {
-                        printf("[%d] %s\n", resp.tag, resp.message);
-                    }
-                }
-                printf("------------------\n");
+                printNotes();
             } else {
                 printf("Error: Join a room first.\n");
             }
@@ -232,9 +243,10 @@ char *getServerInfo(int argc, char *argv[], int *port)
 {
     if (argc < 3) {
         fprintf(stderr, "Error: Invalid number of arguments.\n");
-        fprintf(stderr, "usage: finalClient <server-addr> <port>\n");
+        fprintf(stderr, "usage: finalClient <server-addr> <port> [-f]\n");
         exit(1);
     } else {
+        serverFirst = argc > 3 && strcmp(argv[3], "-f") == 0;
         *port = atoi(argv[2]);
         return argv[1]; /* The server address */
     }
@@ -252,6 +264,24 @@ void sendEncrypted(Packet *p)
 }
 
 
+/* Print notes as they arrive, up to the end marker */
+void printNotes()
+{
+    Packet resp;
+    bool reading = true;
+    while (reading) {
+        if (!recvEncrypted(&resp)) {
+            reading = false;
+        } else if (resp.tag == 0) {
+            reading = false; /* End marker */
+        } else {
+            printf("[%d] %s\n", resp.tag, resp.message);
+        }
+    }
+    printf("------------------\n");
+}
+
+
 bool recvEncrypted(Packet *p)
 {
     int n = clientSocket.recv(p, sizeof(Packet));
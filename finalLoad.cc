@@ -0,0 +1,694 @@
+/* finalLoad.cc
+ *
+ * SecureCollabNotes Load Generator
+ *
+ * This program drives a representative workload against a server:
+ * many connections doing handshakes, joins, posts and lists over rooms
+ * whose popularity and size follow a Zipf-like distribution (a few busy
+ * rooms, a long tail of small ones). It reports throughput and latency
+ * percentiles per operation. The same workload trains the profile for
+ * the PGO build (see pgo.sh).
+ *
+ * SOAK MODE:
+ * ---------
+ * With -S the same mix runs for hours instead of a fixed request count.
+ * Every sample interval the server's resident memory and open file
+ * descriptors are read from /proc (so the server must be local and -P
+ * given), along with the round-trip latency percentiles of that
+ * interval. At the end the run is flagged if memory or descriptors grew
+ * steadily beyond a threshold, or if latency drifted upwards; the exit
+ * status is then 2.
+ *
+ * Usage: finalLoad <server-addr> <port> [options]
+ *
+ *   -c clients    Number of connections (default 32)
+ *   -r rooms      Number of rooms (default 100)
+ *   -n requests   Number of measured requests (default 50000)
+ *   -p notes      Notes preloaded into the busiest room (default 1000)
+ *   -s seed       Random seed, for repeatable runs (default 1)
+ *   -o file       Save the latency summary to file
+ *   -b file       Print latency deltas against a saved summary
+ *   -f            Server-first handshake (for a server started with -f);
+ *                 each connection's public value rides with its first
+ *                 request
+ *   -k notes      Joins ask for this many recent notes with the reply
+ *                 (default 0: a plain join)
+ *   -v            Lists are conditional refreshes (OP_LIST_IF_CHANGED)
+ *                 with the room version from the client's last list
+ *   -z            Reconnect with 0-RTT (for a server started with -z): the
+ *                 join is sent as early data with the handshake
+ *
+ * Soak options:
+ *   -S hours      Run in soak mode for this long (fractions allowed)
+ *   -P pid        Process id of the server to sample
+ *   -i seconds    Sample interval (default 60)
+ *   -G percent    Flag RSS growth above this percentage (default 20)
+ *   -F count      Flag descriptor growth above this many fds (default 16)
+ *   -D ratio      Flag p99 drift above this ratio, last quarter of the
+ *                 run vs. the first quarter (default 2.0)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "finalPacket.h"
+#include "clientConn.h"
+#include "latencyStats.h"
+
+/* Operation mix of the measured phase, in percent */
+const int MIX_POST = 60;
+const int MIX_LIST = 30;
+const int MIX_JOIN = 8;
+/* ...and the remainder reconnects (new handshake plus a join) */
+
+/* Fraction of soak samples that must grow for growth to count as steady */
+const double SOAK_MONOTONIC_FRACTION = 0.8;
+
+/* One soak-mode measurement */
+struct SoakSample {
+    double minutes;
+    long rss_kb;
+    int fds;
+    double rate;      /* requests per second during the interval */
+    double p50;       /* round-trip latency, microseconds */
+    double p99;
+    long posts;       /* total posts sent so far */
+};
+
+/* A load-generating client and the room it is in */
+struct LoadClient {
+    ClientConn conn;
+    int room;
+    int version;      /* room version at the last list, 0 if none */
+};
+
+/* Function prototypes for top-down design */
+void getLoadOptions(int argc, char *argv[]);
+void setupRooms();
+void preloadRooms();
+void runWorkload();
+void finishWorkload();
+void printResults();
+void runSoak();
+bool analyzeSoak();
+
+/* Helper functions */
+void buildPopularity();
+int pickRoom();
+bool joinRoom(LoadClient *lc, int room);
+void reconnectEarly(LoadClient *lc, int room);
+void postNote(LoadClient *lc);
+void runRequest();
+void addSample(int op, double micros);
+long readRssKb(int pid);
+int countFds(int pid);
+bool steadyGrowth(long first, long last, long *values, int n, double limit);
+
+/* Global variables */
+char *serverAddr;
+int serverPort;
+int clientCount = 32;
+int roomCount = 100;
+int requestCount = 50000;
+int maxPreload = 1000;
+unsigned int seed = 1;
+char *resultsFile = NULL;
+char *baselineFile = NULL;
+bool earlyReconnects = false;
+bool conditionalLists = false;
+int joinPreload = 0;
+
+double soakHours = 0;
+int serverPid = 0;
+int soakInterval = 60;
+double rssGrowthLimit = 20;
+int fdGrowthLimit = 16;
+double driftLimit = 2.0;
+
+LoadClient *clients;
+int *inviteCodes;
+double *popularityCdf;
+double elapsedMicros;
+
+LatencySet latency[] = {
+    { "handshake", OP_DH_PUB,      NULL, 0, 0 },
+    { "create",    OP_CREATE_ROOM, NULL, 0, 0 },
+    { "join",      OP_JOIN_ROOM,   NULL, 0, 0 },
+    { "post",      OP_POST_NOTE,   NULL, 0, 0 },
+    { "list",      OP_LIST_NOTES,  NULL, 0, 0 },
+    { "reconnect", OP_DH_EARLY,    NULL, 0, 0 },  /* through the join */
+};
+const int LATENCY_SETS = sizeof(latency) / sizeof(latency[0]);
+
+/* Every request that waits for a reply, for the soak percentiles */
+LatencySet roundTrip = { "round-trip", 0, NULL, 0, 0 };
+long postsSent = 0;
+SoakSample *soakSamples = NULL;
+int soakCount = 0;
+
+
+int main(int argc, char *argv[])
+{
+    /* Get the server address and workload shape */
+    getLoadOptions(argc, argv);
+    srand(seed);
+
+    /* Connect every client and create the rooms */
+    setupRooms();
+
+    /* Give the rooms their Zipf-distributed starting sizes */
+    preloadRooms();
+
+    if (soakHours > 0) {
+        runSoak();
+        return analyzeSoak() ? 0 : 2;
+    }
+
+    /* Run the measured mix, then wait for the server to drain it */
+    double start = now_micros();
+    runWorkload();
+    finishWorkload();
+    elapsedMicros = now_micros() - start;
+
+    /* Report throughput and latency */
+    printResults();
+
+    for (int i = 0; i < clientCount; i++) {
+        conn_close(&clients[i].conn);
+    }
+    return 0;
+}
+
+
+void setupRooms()
+{
+    clients = (LoadClient *)calloc(clientCount, sizeof(LoadClient));
+    inviteCodes = (int *)calloc(roomCount, sizeof(int));
+    buildPopularity();
+
+    for (int i = 0; i < clientCount; i++) {
+        double start = now_micros();
+        if (!conn_open(&clients[i].conn, serverAddr, serverPort)) {
+            printf("Error: Could not connect to server.\n");
+            exit(1);
+        }
+        addSample(OP_DH_PUB, now_micros() - start);
+        clients[i].room = -1;
+        clients[i].version = 0;
+    }
+
+    /* Rooms are created round-robin by the clients */
+    for (int r = 0; r < roomCount; r++) {
+        LoadClient *lc = &clients[r % clientCount];
+        Packet req, resp;
+        memset(&req, 0, sizeof(req));
+        req.op = OP_CREATE_ROOM;
+
+        double start = now_micros();
+        conn_send(&lc->conn, &req);
+        if (!conn_recv(&lc->conn, &resp) || resp.op != OP_CREATE_ROOM_RESP) {
+            printf("Error: could not create room %d.\n", r);
+            exit(1);
+        }
+        addSample(OP_CREATE_ROOM, now_micros() - start);
+        inviteCodes[r] = resp.tag;
+        lc->room = r;
+        lc->version = 0;
+    }
+
+    /* Everyone else joins a room by popularity */
+    for (int i = 0; i < clientCount; i++) {
+        if (clients[i].room < 0) {
+            joinRoom(&clients[i], pickRoom());
+        }
+    }
+}
+
+
+void preloadRooms()
+{
+    /* Room k starts with maxPreload / (k + 1) notes */
+    LoadClient loader;
+    if (!conn_open(&loader.conn, serverAddr, serverPort)) {
+        printf("Error: Could not connect to server.\n");
+        exit(1);
+    }
+
+    for (int r = 0; r < roomCount; r++) {
+        int notes = maxPreload / (r + 1);
+        if (notes == 0) {
+            continue;
+        }
+        joinRoom(&loader, r);
+        for (int i = 0; i < notes; i++) {
+            postNote(&loader);
+        }
+    }
+
+    /* A list acts as a barrier: the server has stored every post */
+    conn_list_notes(&loader.conn);
+    conn_close(&loader.conn);
+
+    for (int i = 0; i < LATENCY_SETS; i++) {
+        latency_reset(&latency[i]);
+    }
+}
+
+
+void runWorkload()
+{
+    for (int i = 0; i < requestCount; i++) {
+        runRequest();
+    }
+}
+
+
+void finishWorkload()
+{
+    /* Posts have no reply; a final list on every connection makes sure
+     * the server has processed everything before the clock stops.
+     */
+    for (int i = 0; i < clientCount; i++) {
+        conn_list_notes(&clients[i].conn);
+    }
+}
+
+
+void printResults()
+{
+    printf("%d requests in %.3f s: %.0f req/s\n", requestCount,
+           elapsedMicros / 1e6, requestCount / (elapsedMicros / 1e6));
+    latency_print(stdout, latency, LATENCY_SETS);
+
+    if (resultsFile != NULL) {
+        FILE *out = fopen(resultsFile, "w");
+        if (out == NULL) {
+            printf("Error: could not write %s\n", resultsFile);
+        } else {
+            fprintf(out, "# throughput %.0f req/s\n",
+                    requestCount / (elapsedMicros / 1e6));
+            latency_print(out, latency, LATENCY_SETS);
+            fclose(out);
+        }
+    }
+
+    if (baselineFile != NULL) {
+        latency_compare(baselineFile, latency, LATENCY_SETS);
+    }
+}
+
+
+void runSoak()
+{
+    int maxSamples = (int)(soakHours * 3600 / soakInterval) + 2;
+    soakSamples = (SoakSample *)calloc(maxSamples, sizeof(SoakSample));
+
+    double start = now_micros();
+    double end = start + soakHours * 3600e6;
+
+    printf("Soak test: %.2f hours, sampling every %d s\n", soakHours,
+           soakInterval);
+    printf("%8s %10s %6s %10s %10s %10s\n", "minutes", "rss_kb", "fds",
+           "req/s", "p50_us", "p99_us");
+
+    while (now_micros() < end && soakCount < maxSamples) {
+        double sliceStart = now_micros();
+        double sliceEnd = sliceStart + soakInterval * 1e6;
+        long requests = 0;
+
+        latency_reset(&roundTrip);
+        while (now_micros() < sliceEnd) {
+            for (int i = 0; i < 64; i++, requests++) {
+                runRequest();
+            }
+        }
+
+        SoakSample *s = &soakSamples[soakCount++];
+        latency_sort(&roundTrip);
+        s->minutes = (now_micros() - start) / 60e6;
+        s->rss_kb = readRssKb(serverPid);
+        s->fds = countFds(serverPid);
+        s->rate = requests / ((now_micros() - sliceStart) / 1e6);
+        s->p50 = latency_percentile(&roundTrip, 50);
+        s->p99 = latency_percentile(&roundTrip, 99);
+        s->posts = postsSent;
+
+        printf("%8.1f %10ld %6d %10.0f %10.1f %10.1f\n", s->minutes,
+               s->rss_kb, s->fds, s->rate, s->p50, s->p99);
+        fflush(stdout);
+    }
+}
+
+
+/* Returns true if the soak run looks healthy */
+bool analyzeSoak()
+{
+    if (soakCount < 4) {
+        printf("Soak run too short to analyze (%d samples).\n", soakCount);
+        return true;
+    }
+
+    long *rss = (long *)malloc(soakCount * sizeof(long));
+    long *fds = (long *)malloc(soakCount * sizeof(long));
+    for (int i = 0; i < soakCount; i++) {
+        rss[i] = soakSamples[i].rss_kb;
+        fds[i] = soakSamples[i].fds;
+    }
+
+    SoakSample *first = &soakSamples[0];
+    SoakSample *last = &soakSamples[soakCount - 1];
+    bool healthy = true;
+
+    printf("\n--- Soak analysis ---\n");
+
+    /* Memory: steady growth beyond the percentage threshold */
+    double rssGrowth = 100.0 * (last->rss_kb - first->rss_kb) / first->rss_kb;
+    long postsDuring = last->posts - first->posts;
+    printf("RSS: %ld KB -> %ld KB (%+.1f%%, %.1f bytes per post)\n",
+           first->rss_kb, last->rss_kb, rssGrowth,
+           postsDuring > 0 ? 1024.0 * (last->rss_kb - first->rss_kb) /
+                             postsDuring : 0);
+    if (steadyGrowth(first->rss_kb, last->rss_kb, rss, soakCount,
+                     first->rss_kb * rssGrowthLimit / 100)) {
+        printf("FLAG: server memory grew steadily by more than %.0f%%\n",
+               rssGrowthLimit);
+        healthy = false;
+    }
+
+    /* Descriptors: any steady climb is a leak, the workload's connection
+     * count is constant
+     */
+    printf("FDs: %d -> %d\n", first->fds, last->fds);
+    if (steadyGrowth(first->fds, last->fds, fds, soakCount, fdGrowthLimit)) {
+        printf("FLAG: open descriptors grew by more than %d\n",
+               fdGrowthLimit);
+        healthy = false;
+    }
+
+    /* Latency: compare the average p99 of the last and first quarters */
+    int quarter = soakCount / 4;
+    double early = 0, late = 0;
+    for (int i = 0; i < quarter; i++) {
+        early += soakSamples[i].p99;
+        late += soakSamples[soakCount - 1 - i].p99;
+    }
+    early /= quarter;
+    late /= quarter;
+    double drift = early > 0 ? late / early : 0;
+    printf("p99: %.1f us -> %.1f us (x%.2f)\n", early, late, drift);
+    if (drift > driftLimit) {
+        printf("FLAG: p99 latency drifted by more than x%.2f\n", driftLimit);
+        healthy = false;
+    }
+
+    printf("%s\n", healthy ? "Soak PASSED" : "Soak FLAGGED");
+    free(rss);
+    free(fds);
+    return healthy;
+}
+
+
+void getLoadOptions(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Error: Invalid number of arguments.\n");
+        fprintf(stderr, "usage: finalLoad <server-addr> <port> [-c clients] "
+                        "[-r rooms] [-n requests] [-p notes] [-s seed] "
+                        "[-o results] [-b baseline] [-k notes] [-f] [-z] [-v]\n");
+        exit(1);
+    }
+
+    serverAddr = argv[1];
+    serverPort = atoi(argv[2]);
+
+    for (int i = 3; i < argc; i += 2) {
+        /* Options without a value */
+        if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "-z") == 0 ||
+            strcmp(argv[i], "-v") == 0) {
+            if (argv[i][1] == 'f') {
+                conn_set_server_first(true);
+            } else if (argv[i][1] == 'z') {
+                earlyReconnects = true;
+            } else {
+                conditionalLists = true;
+            }
+            i--;
+            continue;
+        }
+        if (i + 1 == argc) {
+            break;
+        }
+
+        if (strcmp(argv[i], "-c") == 0) {
+            clientCount = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            roomCount = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            requestCount = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            maxPreload = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            seed = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-o") == 0) {
+            resultsFile = argv[i + 1];
+        } else if (strcmp(argv[i], "-b") == 0) {
+            baselineFile = argv[i + 1];
+        } else if (strcmp(argv[i], "-k") == 0) {
+            joinPreload = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-S") == 0) {
+            soakHours = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "-P") == 0) {
+            serverPid = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            soakInterval = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-G") == 0) {
+            rssGrowthLimit = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "-F") == 0) {
+            fdGrowthLimit = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-D") == 0) {
+            driftLimit = atof(argv[i + 1]);
+        }
+    }
+
+    if (soakHours > 0 && (serverPid <= 0 || readRssKb(serverPid) < 0)) {
+        fprintf(stderr, "Error: soak mode needs -P with a local server pid.\n");
+        exit(1);
+    }
+    if (soakInterval < 1) {
+        soakInterval = 1;
+    }
+
+    if (clientCount < 1 || roomCount < 1) {
+        fprintf(stderr, "Error: need at least one client and one room.\n");
+        exit(1);
+    }
+}
+
+
+/* --- Helper Functions --- */
+
+/* One request from the operation mix, on a random client */
+void runRequest()
+{
+    LoadClient *lc = &clients[rand() % clientCount];
+    int dice = rand() % 100;
+
+    if (dice < MIX_POST) {
+        double start = now_micros();
+        postNote(lc);
+        addSample(OP_POST_NOTE, now_micros() - start);
+    }
+    else if (dice < MIX_POST + MIX_LIST) {
+        double start = now_micros();
+        if (conditionalLists) {
+            conn_list_if_changed(&lc->conn, &lc->version);
+        } else {
+            conn_list_notes(&lc->conn);
+        }
+        addSample(OP_LIST_NOTES, now_micros() - start);
+    }
+    else if (dice < MIX_POST + MIX_LIST + MIX_JOIN) {
+        joinRoom(lc, pickRoom());
+    }
+    else {
+        conn_close(&lc->conn);
+        double start = now_micros();
+        if (earlyReconnects) {
+            reconnectEarly(lc, pickRoom());
+        } else {
+            if (!conn_open(&lc->conn, serverAddr, serverPort)) {
+                printf("Error: Could not reconnect to server.\n");
+                exit(1);
+            }
+            addSample(OP_DH_PUB, now_micros() - start);
+            joinRoom(lc, pickRoom());
+        }
+        addSample(OP_DH_EARLY, now_micros() - start);
+    }
+}
+
+
+/* Room k is chosen with probability proportional to 1 / (k + 1) */
+void buildPopularity()
+{
+    popularityCdf = (double *)malloc(roomCount * sizeof(double));
+    double total = 0;
+    for (int r = 0; r < roomCount; r++) {
+        total += 1.0 / (r + 1);
+        popularityCdf[r] = total;
+    }
+    for (int r = 0; r < roomCount; r++) {
+        popularityCdf[r] /= total;
+    }
+}
+
+
+int pickRoom()
+{
+    double u = (double)rand() / RAND_MAX;
+    int lo = 0, hi = roomCount - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (popularityCdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+bool joinRoom(LoadClient *lc, int room)
+{
+    Packet req, resp;
+    memset(&req, 0, sizeof(req));
+    req.op = OP_JOIN_ROOM;
+    req.tag = inviteCodes[room];
+    req.room_id = joinPreload;
+
+    double start = now_micros();
+    conn_send(&lc->conn, &req);
+    if (!conn_recv(&lc->conn, &resp) || resp.op != OP_JOIN_ROOM_RESP) {
+        return false;
+    }
+    if (joinPreload > 0 && conn_read_notes(&lc->conn) < 0) {
+        return false;
+    }
+    addSample(OP_JOIN_ROOM, now_micros() - start);
+    lc->room = room;
+    lc->version = 0;
+    return true;
+}
+
+
+/* Reconnect with the join as 0-RTT early data */
+void reconnectEarly(LoadClient *lc, int room)
+{
+    Packet req, resp;
+    memset(&req, 0, sizeof(req));
+    req.op = OP_JOIN_ROOM;
+    req.tag = inviteCodes[room];
+    req.room_id = joinPreload;
+
+    if (!conn_open_early(&lc->conn, serverAddr, serverPort, &req, 1)) {
+        printf("Error: Could not reconnect to server.\n");
+        exit(1);
+    }
+    if (conn_recv(&lc->conn, &resp) && resp.op == OP_JOIN_ROOM_RESP) {
+        lc->room = room;
+        lc->version = 0;
+        if (joinPreload > 0) {
+            conn_read_notes(&lc->conn);
+        }
+    }
+}
+
+
+void postNote(LoadClient *lc)
+{
+    Packet req;
+    memset(&req, 0, sizeof(req));
+    req.op = OP_POST_NOTE;
+    snprintf(req.message, MSG_SIZE, "load note %d for room %d", rand(),
+             lc->room);
+    conn_send(&lc->conn, &req);
+    postsSent++;
+}
+
+
+void addSample(int op, double micros)
+{
+    /* A soak only reports roundTrip, which is reset every slice; the
+     * per-op sets would grow for the whole run
+     */
+    for (int i = 0; soakHours <= 0 && i < LATENCY_SETS; i++) {
+        if (latency[i].op == op) {
+            latency_add(&latency[i], micros);
+        }
+    }
+    if (op != OP_POST_NOTE) {
+        latency_add(&roundTrip, micros);
+    }
+}
+
+
+long readRssKb(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+
+int countFds(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int count = 0;
+    while (readdir(dir) != NULL) {
+        count++;
+    }
+    closedir(dir);
+    return count - 2; /* . and .. */
+}
+
+
+/* Growth counts as steady when it exceeds the limit overall and most
+ * consecutive samples did not go down
+ */
+bool steadyGrowth(long first, long last, long *values, int n, double limit)
+{
+    if (last - first <= limit) {
+        return false;
+    }
+
+    int rising = 0;
+    for (int i = 1; i < n; i++) {
+        if (values[i] >= values[i - 1]) {
+            rising++;
+        }
+    }
+    return rising >= SOAK_MONOTONIC_FRACTION * (n - 1);
+}
@@ -13,6 +13,7 @@ const int MSG_SIZE = 256;
 
 /* Operation Codes */
 const int OP_DH_PUB           = 1;
+const int OP_DH_EARLY         = 2;
 
 const int OP_CREATE_ROOM      = 10;
 const int OP_CREATE_ROOM_RESP = 11;
@@ -23,10 +24,97 @@ const int OP_JOIN_ROOM_RESP   = 13;
 const int OP_POST_NOTE        = 20;
 const int OP_LIST_NOTES       = 21;
 const int OP_LIST_NOTES_RESP  = 22;
+const int OP_LIST_IF_CHANGED  = 23;
+const int OP_NOT_MODIFIED     = 24;
+const int OP_ROOM_DIGEST      = 25;
+const int OP_ROOM_DIGEST_RESP = 26;
+const int OP_LIST_RANGE       = 27;
 
 const int OP_DISCONNECT       = 30;
+
 const int OP_ERROR            = 40;
 
+const int OP_SUBSCRIBE        = 50;
+const int OP_SUBSCRIBE_RESP   = 51;
+const int OP_NOTE_PUSH        = 52;
+const int OP_NOTE_RESYNC      = 53;
+
+/* 0-RTT handshake (server started with -z, see earlyKey.h):
+ *
+ * Every OP_DH_PUB from such a server carries "<pub> <key-id> <static-pub>"
+ * in its message; clients that only read the first number are unaffected.
+ * A client that cached key-id and static-pub may open a connection with
+ *
+ *   OP_DH_EARLY  message = its public value, tag = key-id,
+ *                room_id = number of early requests that follow
+ *
+ * followed at once by that many OP_JOIN_ROOM / OP_POST_NOTE requests,
+ * encrypted under dh_compute_shared(static-pub, its private value). The
+ * server answers with OP_DH_EARLY carrying its own public value (as in
+ * OP_DH_PUB) and tag = the number of early requests it accepted, which is
+ * either all of them or 0. Refused requests are dropped unread, and the
+ * client sends them again. Everything after the early requests, including
+ * the replies to them, uses the usual connection key.
+ */
+const int EARLY_MAX_REQUESTS  = 4;
+
+/* Join with preload: an OP_JOIN_ROOM whose room_id is K > 0 asks for the
+ * room's K most recent notes (at most JOIN_PRELOAD_MAX) along with the
+ * join. OP_JOIN_ROOM_RESP then carries the room's latest note id in tag
+ * and is followed by the notes, newest first, as OP_LIST_NOTES_RESP
+ * packets and the usual end marker (tag 0). A failed join is answered by
+ * OP_ERROR alone. With room_id 0 the join is answered as before, by
+ * OP_JOIN_ROOM_RESP alone (tag still set).
+ */
+const int JOIN_PRELOAD_MAX    = 64;
+
+/* Room versions: every room has a version that goes up whenever its
+ * notes change. The end marker (OP_LIST_NOTES_RESP, tag 0) of a reply to
+ * OP_LIST_NOTES or OP_LIST_RANGE carries it in room_id; that of a join
+ * preload does not. A client refreshing a room it has listed before
+ * may send
+ *
+ *   OP_LIST_IF_CHANGED  tag = the version it last saw
+ *
+ * and is answered, if the room is still at that version, by a single
+ * OP_NOT_MODIFIED (room_id = version) instead of the notes. Otherwise the
+ * reply is exactly that of OP_LIST_NOTES. Without a room the reply is the
+ * empty list, whose end marker carries version 0.
+ */
+
+/* Room digests (see roomDigest.h for the tree):
+ *
+ *   OP_ROOM_DIGEST  tag = level (0 for the leaves, -1 for the root, -2
+ *                   for the level below it, ...), room_id = first node
+ *
+ * is answered by OP_ROOM_DIGEST_RESP with the room's note count in
+ * room_id, the number of levels in its tree in tag, and in message up to
+ * DIGEST_PER_PACKET 8-byte digests of that level, from the first node
+ * asked for; how many depends on the note count (digest_level_size()).
+ * Without a room, or past the end of the level, none are sent.
+ *
+ *   OP_LIST_RANGE   room_id = first note id, tag = last note id
+ *
+ * is answered by the notes with ids in that range, oldest first, as
+ * OP_LIST_NOTES_RESP packets and the usual end marker.
+ */
+
+/* Subscriptions: OP_SUBSCRIBE with tag 1 subscribes to the current room
+ * (tag 0 unsubscribes). OP_SUBSCRIBE_RESP carries the room in room_id and
+ * its latest note id in tag (-1 with no room). From then on every note
+ * posted to the room, including the subscriber's own, arrives unasked as
+ * OP_NOTE_PUSH (room_id, tag = note id, message = note), oldest first;
+ * the notes of one server event-loop turn arrive together. Joining a
+ * different room ends the subscription.
+ *
+ * A subscriber that does not keep up is not sent every note: once more
+ * than FANOUT_QUEUE_BYTES of pushes are waiting for it, they are dropped
+ * and it is sent OP_NOTE_RESYNC (room_id, tag = id of the first note
+ * dropped) instead. Pushes resume after that packet; the client should
+ * fetch the notes from that id on (e.g. with OP_LIST_RANGE) and ignore
+ * any note it then also receives as a push.
+ */
+
 /* * The packet contains:
  * op:       The operation code (int)
  * room_id:  The ID of the room (int)
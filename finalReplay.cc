@@ -0,0 +1,386 @@
+/* finalReplay.cc
+ *
+ * SecureCollabNotes Traffic Replay
+ *
+ * This program re-drives a traffic capture recorded by finalServer -c
+ * against a server (normally a new build on loopback). Every captured
+ * connection is reopened, every request is re-sent at its recorded time
+ * (optionally sped up), and the latency of each request/response pair is
+ * measured. A summary per operation is printed and can be saved so that
+ * two builds can be compared.
+ *
+ * Rooms and invite codes differ between server runs, so the captured
+ * room ids are mapped onto the rooms created during the replay. Note
+ * payloads are not captured; filler text of the recorded length is sent.
+ *
+ * Joins are replayed with their preload count, and conditional lists,
+ * digests, ranged lists and subscriptions with their recorded arguments;
+ * a conditional list sends the version the replayed connection last saw.
+ * Pushes to subscribed connections are read (and counted) before each of
+ * their requests. Events of any other kind are counted as skipped.
+ *
+ * Usage: finalReplay <server-addr> <port> <capture-file> [speed]
+ *                    [-o results-file] [-b baseline-results-file]
+ *
+ *   speed     Replay speed multiplier (1 = real time, 0 = no delays)
+ *   -o        Save the latency summary to results-file
+ *   -b        Print latency deltas against a previously saved summary
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "finalPacket.h"
+#include "capture.h"
+#include "clientConn.h"
+#include "latencyStats.h"
+
+/* Mapping of a captured room onto the room created during the replay */
+struct ReplayRoom {
+    int room_id;
+    int invite_code;
+};
+
+/* Function prototypes for top-down design */
+void getReplayOptions(int argc, char *argv[]);
+void loadCapture();
+void replayAll();
+void replayRecord(CaptureRecord *rec);
+void printSummary(FILE *out);
+
+/* Helper functions */
+void waitUntil(double targetMicros);
+void closeConn(size_t id);
+bool createRoom(ClientConn *c, int capturedRoom);
+void addSample(int op, double micros);
+
+/* Global variables */
+char *serverAddr;
+int serverPort;
+char *captureFile;
+double speed = 1.0;
+char *resultsFile = NULL;
+char *baselineFile = NULL;
+
+CaptureRecord *records = NULL;
+size_t recordCount = 0;
+
+ClientConn *conns = NULL;
+int *versions = NULL;       /* room version each connection last saw */
+bool *subscribers = NULL;   /* connections that have subscribed */
+size_t connCount = 0;
+ReplayRoom *rooms = NULL;
+size_t roomCount = 0;
+
+double replayStart;
+double maxLag = 0;
+long skipped = 0;
+long pushes = 0;
+
+LatencySet latency[] = {
+    { "handshake", OP_DH_PUB,          NULL, 0, 0 },
+    { "create",    OP_CREATE_ROOM,     NULL, 0, 0 },
+    { "join",      OP_JOIN_ROOM,       NULL, 0, 0 },
+    { "post",      OP_POST_NOTE,       NULL, 0, 0 },
+    { "list",      OP_LIST_NOTES,      NULL, 0, 0 },
+    { "list-if",   OP_LIST_IF_CHANGED, NULL, 0, 0 },
+    { "digest",    OP_ROOM_DIGEST,     NULL, 0, 0 },
+    { "range",     OP_LIST_RANGE,      NULL, 0, 0 },
+    { "subscribe", OP_SUBSCRIBE,       NULL, 0, 0 },
+};
+const int LATENCY_SETS = sizeof(latency) / sizeof(latency[0]);
+
+
+int main(int argc, char *argv[])
+{
+    /* Get the server address, capture file and options */
+    getReplayOptions(argc, argv);
+
+    /* Read the capture into memory and size the lookup tables */
+    loadCapture();
+
+    /* Re-drive every captured event against the server */
+    replayAll();
+
+    /* Report the results */
+    printSummary(stdout);
+
+    if (resultsFile != NULL) {
+        FILE *out = fopen(resultsFile, "w");
+        if (out == NULL) {
+            printf("Error: could not write %s\n", resultsFile);
+        } else {
+            printSummary(out);
+            fclose(out);
+        }
+    }
+
+    if (baselineFile != NULL) {
+        latency_compare(baselineFile, latency, LATENCY_SETS);
+    }
+
+    return 0;
+}
+
+
+void loadCapture()
+{
+    if (!capture_load(captureFile, &records, &recordCount)) {
+        printf("Error: %s is not a capture file.\n", captureFile);
+        exit(1);
+    }
+
+    /* Connection and room ids are small and dense, so plain arrays
+     * indexed by the captured id are used for the mappings.
+     */
+    uint32_t maxConn = 0;
+    int maxRoom = 0;
+    for (size_t i = 0; i < recordCount; i++) {
+        if (records[i].conn_id > maxConn) {
+            maxConn = records[i].conn_id;
+        }
+        if (records[i].room_id > maxRoom) {
+            maxRoom = records[i].room_id;
+        }
+    }
+
+    connCount = maxConn + 1;
+    conns = (ClientConn *)calloc(connCount, sizeof(ClientConn));
+    versions = (int *)calloc(connCount, sizeof(int));
+    subscribers = (bool *)calloc(connCount, sizeof(bool));
+    roomCount = maxRoom + 1;
+    rooms = (ReplayRoom *)calloc(roomCount, sizeof(ReplayRoom));
+
+    printf("Loaded %zu events (%zu connections, %zu rooms).\n",
+           recordCount, connCount - 1, roomCount - 1);
+}
+
+
+void replayAll()
+{
+    replayStart = now_micros();
+
+    for (size_t i = 0; i < recordCount; i++) {
+        if (speed > 0) {
+            waitUntil(replayStart + records[i].time_us / speed);
+        }
+        replayRecord(&records[i]);
+    }
+
+    /* Close anything the capture left open */
+    for (size_t i = 0; i < connCount; i++) {
+        closeConn(i);
+    }
+}
+
+
+void replayRecord(CaptureRecord *rec)
+{
+    ClientConn *c = &conns[rec->conn_id];
+
+    if (rec->op == OP_DISCONNECT) {
+        closeConn(rec->conn_id);
+        return;
+    }
+
+    double start = now_micros();
+    if (speed > 0) {
+        double lag = start - (replayStart + rec->time_us / speed);
+        if (lag > maxLag) {
+            maxLag = lag;
+        }
+    }
+
+    if (rec->op == OP_DH_PUB) {
+        closeConn(rec->conn_id);
+        if (conn_open(c, serverAddr, serverPort)) {
+            addSample(OP_DH_PUB, now_micros() - start);
+        }
+        return;
+    }
+
+    /* Requests on a connection we never saw open are skipped */
+    if (!conn_is_open(c)) {
+        return;
+    }
+    if (subscribers[rec->conn_id]) {
+        conn_drain_pushes(c);
+    }
+
+    Packet req, resp;
+    memset(&req, 0, sizeof(req));
+
+    if (rec->op == OP_CREATE_ROOM) {
+        versions[rec->conn_id] = 0;
+        if (createRoom(c, rec->room_id)) {
+            addSample(OP_CREATE_ROOM, now_micros() - start);
+        }
+    }
+    else if (rec->op == OP_JOIN_ROOM) {
+        bool known = rec->room_id > 0 && rooms[rec->room_id].room_id != 0;
+
+        if (rec->room_id > 0 && !known) {
+            /* The room was created before the capture started; make a
+             * stand-in so later posts and lists have somewhere to go.
+             */
+            createRoom(c, rec->room_id);
+            return;
+        }
+
+        req.op = OP_JOIN_ROOM;
+        req.room_id = rec->arg;
+        req.tag = known ? rooms[rec->room_id].invite_code : rec->tag;
+        versions[rec->conn_id] = 0;
+        conn_send(c, &req);
+        if (!conn_recv_reply(c, &resp)) {
+            return;
+        }
+
+        /* The preloaded notes follow a successful join */
+        if (rec->arg > 0 && resp.op == OP_JOIN_ROOM_RESP &&
+            conn_read_notes(c) < 0) {
+            return;
+        }
+        addSample(OP_JOIN_ROOM, now_micros() - start);
+    }
+    else if (rec->op == OP_POST_NOTE) {
+        req.op = OP_POST_NOTE;
+        int len = rec->payload_len < MSG_SIZE ? rec->payload_len
+                                              : MSG_SIZE - 1;
+        memset(req.message, 'x', len);
+        conn_send(c, &req);
+        addSample(OP_POST_NOTE, now_micros() - start);
+    }
+    else if (rec->op == OP_LIST_NOTES) {
+        conn_list_notes(c);
+        addSample(OP_LIST_NOTES, now_micros() - start);
+    }
+    else if (rec->op == OP_LIST_IF_CHANGED) {
+        if (conn_list_if_changed(c, &versions[rec->conn_id]) >= 0) {
+            addSample(OP_LIST_IF_CHANGED, now_micros() - start);
+        }
+    }
+    else if (rec->op == OP_ROOM_DIGEST) {
+        uint64_t digests[MSG_SIZE / sizeof(uint64_t)];
+        int notes, levels;
+        if (conn_room_digest(c, rec->tag, rec->arg, digests, &notes,
+                             &levels) >= 0) {
+            addSample(OP_ROOM_DIGEST, now_micros() - start);
+        }
+    }
+    else if (rec->op == OP_LIST_RANGE) {
+        if (conn_list_range(c, rec->arg, rec->tag) >= 0) {
+            addSample(OP_LIST_RANGE, now_micros() - start);
+        }
+    }
+    else if (rec->op == OP_SUBSCRIBE) {
+        req.op = OP_SUBSCRIBE;
+        req.tag = rec->tag;
+        conn_send(c, &req);
+        if (conn_recv_reply(c, &resp)) {
+            subscribers[rec->conn_id] = rec->tag != 0;
+            addSample(OP_SUBSCRIBE, now_micros() - start);
+        }
+    }
+    else {
+        skipped++;
+    }
+}
+
+
+void printSummary(FILE *out)
+{
+    latency_print(out, latency, LATENCY_SETS);
+
+    if (out == stdout && speed > 0) {
+        printf("# max schedule lag: %.1f us\n", maxLag);
+    }
+    if (out == stdout && pushes > 0) {
+        printf("# pushes received: %ld\n", pushes);
+    }
+    if (out == stdout && skipped > 0) {
+        printf("# events not replayed: %ld\n", skipped);
+    }
+}
+
+
+void getReplayOptions(int argc, char *argv[])
+{
+    if (argc < 4) {
+        fprintf(stderr, "Error: Invalid number of arguments.\n");
+        fprintf(stderr, "usage: finalReplay <server-addr> <port> "
+                        "<capture-file> [speed] [-o results] [-b baseline]\n");
+        exit(1);
+    }
+
+    serverAddr = argv[1];
+    serverPort = atoi(argv[2]);
+    captureFile = argv[3];
+
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            resultsFile = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baselineFile = argv[++i];
+        } else {
+            speed = atof(argv[i]);
+        }
+    }
+}
+
+
+/* --- Helper Functions --- */
+
+void waitUntil(double targetMicros)
+{
+    double remaining = targetMicros - now_micros();
+    if (remaining > 0) {
+        usleep((useconds_t)remaining);
+    }
+}
+
+
+/* Close a replayed connection, counting the pushes it was sent */
+void closeConn(size_t id)
+{
+    if (conn_is_open(&conns[id])) {
+        if (subscribers[id]) {
+            conn_drain_pushes(&conns[id]);
+        }
+        pushes += conns[id].pushes;
+    }
+    conn_close(&conns[id]);
+    subscribers[id] = false;
+}
+
+
+bool createRoom(ClientConn *c, int capturedRoom)
+{
+    Packet req, resp;
+    memset(&req, 0, sizeof(req));
+    req.op = OP_CREATE_ROOM;
+    conn_send(c, &req);
+
+    if (!conn_recv_reply(c, &resp) || resp.op != OP_CREATE_ROOM_RESP) {
+        return false;
+    }
+
+    if (capturedRoom > 0 && (size_t)capturedRoom < roomCount) {
+        rooms[capturedRoom].room_id = resp.room_id;
+        rooms[capturedRoom].invite_code = resp.tag;
+    }
+    return true;
+}
+
+
+void addSample(int op, double micros)
+{
+    for (int i = 0; i < LATENCY_SETS; i++) {
+        if (latency[i].op == op) {
+            latency_add(&latency[i], micros);
+        }
+    }
+}
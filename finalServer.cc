@@ -7,7 +7,32 @@
  * share encrypted notes within those rooms. All communication uses
  * Diffie-Hellman key exchange for security.
  *
- * Usage: finalServer [port]
+ * Usage: finalServer [port] [-c capture-file] [-d data-dir] [-j threads]
+ *                    [-k seconds] [-f] [-z seconds] [-p threads]
+ *                    [-b percent] [-n node]
+ *
+ *   -c capture-file   Record every request to capture-file for finalReplay
+ *   -d data-dir       Keep rooms and notes in a write-ahead log in data-dir,
+ *                     replaying it on startup (see walLog.h)
+ *   -j threads        Worker threads for that replay (default: one per CPU)
+ *   -k seconds        Checkpoint changed rooms this often and empty the log
+ *                     (default 60; see checkpoint.h)
+ *   -f                Server-first handshake: send the server's public value
+ *                     as soon as a connection is accepted, so the client can
+ *                     send its own with its first request (see
+ *                     beginHandshake() in requestHandler.h)
+ *   -z seconds        Accept 0-RTT early requests from returning clients,
+ *                     rotating the semi-static key this often (see
+ *                     earlyKey.h)
+ *   -p threads        Fan-out threads pushing notes to rooms with many
+ *                     subscribers (default: one per CPU; 0 pushes every
+ *                     note from the event loop; see fanout.h)
+ *   -b percent        Share of all CPUs that background tasks such as
+ *                     checkpoint merges may use (default 50; see
+ *                     taskPool.h)
+ *   -n node           NUMA node id for the event loop and the rooms and
+ *                     notes it allocates (default: the first node with
+ *                     CPUs; see numaPlace.h)
  */
 
 #include <stdio.h>
@@ -15,11 +40,22 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
 #include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "finalPacket.h"
-#include "diffieHellman.h"
-#include "xor.h"
+#include "capture.h"
+#include "walLog.h"
+#include "checkpoint.h"
+#include "earlyKey.h"
+#include "fanout.h"
+#include "taskPool.h"
+#include "numaPlace.h"
+#include "bufferPool.h"
+#include "requestHandler.h"
 #include "socket.h"
 #include "selector.h"
 
@@ -29,54 +65,53 @@ const int DEFAULT_PORT = 30000;
 /* Maximum number of concurrent client connections */
 const int MAX_CLIENTS = 1024;
 
-/* Data structure for storing notes in a room */
-struct Note {
-    int id;
-    char ciphertext[MSG_SIZE];
-    Note *next;
-};
-
-/* Data structure for storing room information */
-struct Room {
-    int id;
-    int invite_code;
-    unsigned long long room_key;
-    Note *notes;
-    int note_count;
-    Room *next;
-};
-
-/* Data structure for tracking client connection state */
-struct ClientContext {
-    Socket *sock;
-    unsigned long long shared_key;
-    bool dh_completed;
-    int current_room_id;
-};
+/* Default seconds between checkpoints */
+const int DEFAULT_CHECKPOINT_INTERVAL = 60;
 
 /* Function prototypes for top-down design */
 void sigHandler(int sig);
+void shutdownServer();
 int getPortNumber(int argc, char *argv[]);
+char *getOption(int argc, char *argv[], const char *flag);
+bool hasFlag(int argc, char *argv[], const char *flag);
+void initCapture(char *path);
+void initStorage(char *dir, char *threads, char *interval);
+void maybeCheckpoint();
 void initServerSocket(int portNum);
 void initSelector();
 void processRequests();
 void handleClientConnection();
 void handleClientRequest(int fd);
 void disconnectClient(int fd);
-
-/* Helper functions for room and note management */
-Room* createRoom();
-Room* findRoomById(int id);
-Room* findRoomByInvite(int code);
-void addNote(Room *r, const char *content);
-bool sendPacketEncrypted(Socket *sock, Packet *p, unsigned long long key);
+void replyWhenDurable(int fd);
+void replyAfterPush(ClientContext *ctx);
+void releaseDurableReplies();
+bool flushClient(ClientContext *ctx);
 
 /* Global variables */
 ServerSocket theServer;
 InputSelector inputSet;
 ClientContext *clientList[MAX_CLIENTS];
-Room *roomListHead = NULL;
-int nextRoomId = 1;
+uint32_t nextConnId = 1;
+
+/* Set by Ctrl-C; the loop shuts down once its current turn is over. The
+ * handler also writes to wakePipe so that an idle select() returns.
+ */
+volatile sig_atomic_t stopRequested = 0;
+int wakePipe[2] = { -1, -1 };
+
+/* Connections with replies held until the log is durable (may contain
+ * stale or repeated fds; awaiting_log is the authority)
+ */
+int awaitingFds[MAX_CLIENTS];
+int awaitingCount = 0;
+
+/* Send OP_DH_PUB on accept (-f) */
+bool serverFirst = false;
+
+/* Checkpoint schedule */
+int checkpointInterval = DEFAULT_CHECKPOINT_INTERVAL;
+time_t lastCheckpoint;
 
 
 int main(int argc, char *argv[])
@@ -95,12 +130,61 @@ int main(int argc, char *argv[])
     /* Get the port number to use for the listening socket */
     int portNum = getPortNumber(argc, argv);
 
+    /* Everything the loop allocates from here on belongs on the home node */
+    place_init();
+    char *home = getOption(argc, argv, "-n");
+    place_set_home(home != NULL ? atoi(home) : place_node_id(0));
+    place_prefer_memory(place_home());
+
+    /* Background work runs on a shared pool, off the event loop */
+    char *background = getOption(argc, argv, "-b");
+    tasks_init((int)sysconf(_SC_NPROCESSORS_ONLN),
+               background != NULL ? atoi(background)
+                                  : TASK_DEFAULT_CPU_PERCENT);
+
+    /* Rebuild rooms and notes from the log before accepting anyone */
+    initStorage(getOption(argc, argv, "-d"), getOption(argc, argv, "-j"),
+                getOption(argc, argv, "-k"));
+
     /* Initialize the listening socket */
     initServerSocket(portNum);
 
+    /* Start recording traffic if a capture file was requested */
+    initCapture(getOption(argc, argv, "-c"));
+
+    serverFirst = hasFlag(argc, argv, "-f");
+    if (serverFirst) {
+        printf("Server-first handshake enabled\n");
+    }
+
+    char *rotation = getOption(argc, argv, "-z");
+    if (rotation != NULL) {
+        early_init(atoi(rotation));
+        printf("0-RTT enabled (semi-static key rotated every %d s)\n",
+               atoi(rotation));
+    }
+
+    char *pushThreads = getOption(argc, argv, "-p");
+    int pushWorkers = pushThreads != NULL ? atoi(pushThreads)
+                                          : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    fanout_init(pushWorkers);
+    if (pushWorkers > 0) {
+        printf("Rooms with %d or more subscribers pushed by %d threads\n",
+               FANOUT_OFFLOAD_MEMBERS, pushWorkers);
+    }
+
     /* Initialize the input selector */
     initSelector();
 
+    /* Only now is the loop kept on the home node; the threads started
+     * above may run anywhere
+     */
+    if (place_nodes() > 1) {
+        place_run_on_node(place_home());
+        printf("Event loop on NUMA node %d (%d nodes with CPUs)\n",
+               place_node_id(place_home()), place_nodes());
+    }
+
     /* Process protocol requests */
     processRequests();
 
@@ -112,7 +196,7 @@ void processRequests()
 {
     int *activeSet;
 
-    while (true) {
+    while (!stopRequested) {
         activeSet = inputSet.select();
 
         int i = 0;
@@ -121,12 +205,33 @@ void processRequests()
 
             if (fd == theServer.fd()) {
                 handleClientConnection();
+            } else if (fd == wal_event_fd()) {
+                wal_reap();
+            } else if (fd == wakePipe[0]) {
+                char byte;
+                read(wakePipe[0], &byte, 1);
             } else {
                 handleClientRequest(fd);
             }
             i++;
         }
+
+        /* Push this pass's posts to subscribers, one frame each */
+        fanout_flush(replyAfterPush);
+
+        /* Commit this pass's log records as one group, then send every
+         * reply whose records are now on disk
+         */
+        wal_flush();
+        maybeCheckpoint();
+        releaseDurableReplies();
+        fanout_dispatch();
+
+        /* Retry what slow clients' sockets would not take */
+        fanout_drain();
     }
+
+    shutdownServer();
 }
 
 
@@ -149,18 +254,29 @@ void handleClientConnection()
         return;
     }
 
+    /* Replies are already batched per read by flushClient(), so Nagle
+     * would only hold the batch back waiting for the client's ACK
+     */
+    int one = 1;
+    setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
     /* Add to input selector */
     inputSet.add(clientFd);
 
     /* Create and initialize client context */
     ClientContext *ctx = new ClientContext();
-    ctx->sock = theClient;
-    ctx->dh_completed = false;
-    ctx->shared_key = 0;
-    ctx->current_room_id = -1;
+    initClientContext(ctx, theClient, nextConnId++);
 
     clientList[clientFd] = ctx;
     printf("New client connected (fd: %d)\n", clientFd);
+
+    /* Our public value goes out now rather than in reply to the client's */
+    if (serverFirst) {
+        beginHandshake(ctx);
+        if (!flushClient(ctx)) {
+            disconnectClient(clientFd);
+        }
+    }
 }
 
 
@@ -172,99 +288,98 @@ void handleClientRequest(int fd)
         return;
     }
 
-    Packet req;
-    int n = ctx->sock->recv(&req, sizeof(Packet));
+    /* Borrow a receive buffer only while bytes are in flight */
+    if (ctx->rbuf == NULL) {
+        ctx->rbuf = pool_borrow();
+    }
+    PoolBuffer *rb = ctx->rbuf;
+
+    /* Take whatever has arrived without waiting for a whole packet; the
+     * remainder of a split packet is kept in rbuf until the next read.
+     */
+    int n = recv(fd, rb->data + rb->len, POOL_BUFFER_SIZE - rb->len,
+                 MSG_DONTWAIT);
 
-    if (n <= 0) {
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
         disconnectClient(fd);
         return;
     }
+    if (n > 0) {
+        rb->len += n;
+    }
 
-    /* Handle Diffie-Hellman handshake */
-    if (req.op == OP_DH_PUB) {
-        unsigned long long client_pub = strtoull(req.message, NULL, 10);
-        unsigned long long my_priv = dh_generate_private();
-        unsigned long long my_pub = dh_compute_public(my_priv);
-        ctx->shared_key = dh_compute_shared(client_pub, my_priv);
-        ctx->dh_completed = true;
+    /* Handle every complete packet in place */
+    int used = 0;
+    while (rb->len - used >= (int)sizeof(Packet)) {
+        handleRequest(ctx, (Packet *)(rb->data + used));
+        used += sizeof(Packet);
+    }
 
-        Packet resp;
-        memset(&resp, 0, sizeof(resp));
-        resp.op = OP_DH_PUB;
-        sprintf(resp.message, "%llu", my_pub);
+    if (used < rb->len) {
+        memmove(rb->data, rb->data + used, rb->len - used);
+    }
+    rb->len -= used;
 
-        ctx->sock->send(&resp, sizeof(Packet));
-        printf("Handshake complete (fd: %d)\n", fd);
-        return;
+    if (rb->len == 0) {
+        pool_return(rb);
+        ctx->rbuf = NULL;
     }
 
-    /* Ensure client has completed handshake before processing encrypted requests */
-    if (!ctx->dh_completed) {
-        printf("Client not authenticated (fd: %d)\n", fd);
+    /* Send all replies produced by this read together, once the log
+     * holds everything they may depend on
+     */
+    replyWhenDurable(fd);
+}
+
+
+void replyWhenDurable(int fd)
+{
+    ClientContext *ctx = clientList[fd];
+
+    if (ctx->wbuf != NULL && wal_durable() < wal_sequence()) {
+        ctx->ack_seq = wal_sequence();
+        if (!ctx->awaiting_log) {
+            ctx->awaiting_log = true;
+            awaitingFds[awaitingCount++] = fd;
+        }
         return;
     }
 
-    /* Decrypt incoming message */
-    xor_buffer(req.message, MSG_SIZE, ctx->shared_key);
-
-    Packet resp;
-    memset(&resp, 0, sizeof(resp));
-
-    /* Handle create room request */
-    if (req.op == OP_CREATE_ROOM) {
-        Room *r = createRoom();
-        ctx->current_room_id = r->id;
-        resp.op = OP_CREATE_ROOM_RESP;
-        resp.room_id = r->id;
-        resp.tag = r->invite_code;
-        snprintf(resp.message, MSG_SIZE, "Room Created");
-        sendPacketEncrypted(ctx->sock, &resp, ctx->shared_key);
-        printf("Room %d created (invite: %d)\n", r->id, r->invite_code);
-    }
-    /* Handle join room request */
-    else if (req.op == OP_JOIN_ROOM) {
-        Room *r = findRoomByInvite(req.tag);
-        if (r != NULL) {
-            ctx->current_room_id = r->id;
-            resp.op = OP_JOIN_ROOM_RESP;
-            resp.room_id = r->id;
-            snprintf(resp.message, MSG_SIZE, "Joined Room");
-        } else {
-            resp.op = OP_ERROR;
-            snprintf(resp.message, MSG_SIZE, "Invalid Code");
+    if (!ctx->awaiting_log && !flushClient(ctx)) {
+        disconnectClient(fd);
+    }
+}
+
+
+/* Pushed notes go out like replies: once the log holds them */
+void replyAfterPush(ClientContext *ctx)
+{
+    replyWhenDurable(ctx->sock->fd());
+}
+
+
+void releaseDurableReplies()
+{
+    int kept = 0;
+
+    for (int i = 0; i < awaitingCount; i++) {
+        int fd = awaitingFds[i];
+        ClientContext *ctx = clientList[fd];
+
+        if (ctx == NULL || !ctx->awaiting_log) {
+            continue;
         }
-        sendPacketEncrypted(ctx->sock, &resp, ctx->shared_key);
-    }
-    /* Handle post note request */
-    else if (req.op == OP_POST_NOTE) {
-        Room *r = findRoomById(ctx->current_room_id);
-        if (r != NULL) {
-            addNote(r, req.message);
-            printf("Note posted to Room %d\n", r->id);
+        if (ctx->ack_seq > wal_durable()) {
+            awaitingFds[kept++] = fd;
+            continue;
         }
-    }
-    /* Handle list notes request */
-    else if (req.op == OP_LIST_NOTES) {
-        Room *r = findRoomById(ctx->current_room_id);
-        if (r != NULL) {
-            Note *cur = r->notes;
-            while (cur != NULL) {
-                Packet noteP;
-                memset(&noteP, 0, sizeof(noteP));
-                noteP.op = OP_LIST_NOTES_RESP;
-                noteP.tag = cur->id;
-                memcpy(noteP.message, cur->ciphertext, MSG_SIZE);
-                sendPacketEncrypted(ctx->sock, &noteP, ctx->shared_key);
-                cur = cur->next;
-            }
+
+        ctx->awaiting_log = false;
+        if (!flushClient(ctx)) {
+            disconnectClient(fd);
         }
-        /* Send end marker */
-        Packet endP;
-        memset(&endP, 0, sizeof(endP));
-        endP.op = OP_LIST_NOTES_RESP;
-        endP.tag = 0;
-        sendPacketEncrypted(ctx->sock, &endP, ctx->shared_key);
     }
+    awaitingCount = kept;
 }
 
 
@@ -274,7 +389,18 @@ void disconnectClient(int fd)
     inputSet.remove(fd);
 
     if (clientList[fd] != NULL) {
+        fanout_unsubscribe(clientList[fd]);
+        fanout_release(clientList[fd]);
+        capture_record(clientList[fd]->conn_id, OP_DISCONNECT,
+                       clientList[fd]->current_room_id, 0, 0, 0);
+        if (clientList[fd]->rbuf != NULL) {
+            pool_return(clientList[fd]->rbuf);
+        }
+        if (clientList[fd]->wbuf != NULL) {
+            pool_return(clientList[fd]->wbuf);
+        }
         clientList[fd]->sock->close();
+        pthread_mutex_destroy(&clientList[fd]->send_lock);
         delete clientList[fd]->sock;
         delete clientList[fd];
         clientList[fd] = NULL;
@@ -285,6 +411,12 @@ void disconnectClient(int fd)
 void initSelector()
 {
     inputSet.add(theServer.fd());
+
+    if (pipe(wakePipe) != 0) {
+        printf("Error: could not create the shutdown pipe\n");
+        exit(1);
+    }
+    inputSet.add(wakePipe[0]);
 }
 
 
@@ -302,7 +434,7 @@ void initServerSocket(int portNum)
 
 int getPortNumber(int argc, char *argv[])
 {
-    if (argc > 1) {
+    if (argc > 1 && argv[1][0] != '-') {
         return atoi(argv[1]);
     } else {
         return DEFAULT_PORT;
@@ -310,71 +442,246 @@ int getPortNumber(int argc, char *argv[])
 }
 
 
-void sigHandler(int sig)
+/* Returns the value following flag on the command line, or NULL */
+char *getOption(int argc, char *argv[], const char *flag)
 {
-    printf("Shutting down the server.\n");
-    theServer.close();
-    exit(0);
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], flag) == 0) {
+            return argv[i + 1];
+        }
+    }
+    return NULL;
 }
 
 
-/* --- Helper Functions --- */
+/* Returns true if flag appears on the command line */
+bool hasFlag(int argc, char *argv[], const char *flag)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], flag) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 
-bool sendPacketEncrypted(Socket *sock, Packet *p, unsigned long long key)
+void initCapture(char *path)
 {
-    Packet tmp;
-    memcpy(&tmp, p, sizeof(Packet));
-    xor_buffer(tmp.message, MSG_SIZE, key);
-    int n = sock->send(&tmp, sizeof(Packet));
-    return n == sizeof(Packet);
+    if (path == NULL) {
+        return;
+    }
+
+    if (capture_open(path)) {
+        printf("Capturing traffic to %s\n", path);
+    } else {
+        printf("Error: could not open capture file %s\n", path);
+        exit(1);
+    }
 }
 
 
-Room* createRoom()
+void initStorage(char *dir, char *threads, char *interval)
 {
-    Room *r = new Room();
-    r->id = nextRoomId++;
-    r->invite_code = rand() % 9000 + 1000;
-    r->room_key = ((unsigned long long)rand() << 32) | rand();
-    r->notes = NULL;
-    r->note_count = 0;
-    r->next = roomListHead;
-    roomListHead = r;
-    return r;
+    if (dir == NULL) {
+        return;
+    }
+
+    /* Checkpoints first, then the log records written since */
+    CkptStats loaded;
+    if (!ckpt_load(dir, &loaded)) {
+        printf("Error: could not load the checkpoints in %s\n", dir);
+        exit(1);
+    }
+    printf("Loaded %ld rooms and %ld notes from the base and %d deltas "
+           "(%.1f MB) in %.1f ms\n", loaded.rooms, loaded.notes,
+           loaded.deltas, loaded.bytes / 1e6, loaded.millis);
+
+    int workers = threads != NULL ? atoi(threads)
+                                  : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    WalRecoveryStats stats;
+    if (!wal_recover(dir, workers, &stats)) {
+        printf("Error: could not recover the log in %s\n", dir);
+        exit(1);
+    }
+    printf("Recovered %d rooms and %ld notes (%.1f MB) in %.1f ms "
+           "using %d threads\n", stats.rooms, stats.notes,
+           stats.bytes / 1e6, stats.millis, stats.threads);
+    if (stats.torn > 0) {
+        printf("Dropped %ld bytes of incomplete or damaged records "
+               "(%d segments failed their checksum)\n", stats.torn,
+               stats.damaged);
+    }
+
+    if (!wal_open(dir)) {
+        printf("Error: could not open the log in %s\n", dir);
+        exit(1);
+    }
+    printf("Logging to %s (%s)\n", dir, wal_engine());
+
+    if (!ckpt_open(dir)) {
+        printf("Error: could not checkpoint into %s\n", dir);
+        exit(1);
+    }
+    if (interval != NULL) {
+        checkpointInterval = atoi(interval);
+    }
+    lastCheckpoint = time(NULL);
+
+    if (wal_event_fd() >= 0) {
+        inputSet.add(wal_event_fd());
+    }
 }
 
 
-Room* findRoomById(int id)
+/* Every checkpointInterval seconds, write the rooms that changed to a
+ * delta checkpoint and start the log afresh
+ */
+void maybeCheckpoint()
 {
-    Room *cur = roomListHead;
-    while (cur != NULL) {
-        if (cur->id == id) {
-            return cur;
+    if (!wal_enabled() || !ckpt_pending() ||
+        time(NULL) - lastCheckpoint < checkpointInterval) {
+        return;
+    }
+    lastCheckpoint = time(NULL);
+
+    /* The delta is written from memory, so the log must already hold
+     * everything in it; only then can the log be emptied
+     */
+    wal_sync();
+    CkptStats stats;
+    if (!ckpt_write(&stats)) {
+        printf("Error: checkpoint failed; keeping the log\n");
+        return;
+    }
+    wal_reset();
+
+    printf("Checkpoint %u: %ld rooms, %ld notes (%.1f KB) in %.1f ms\n",
+           stats.sequence, stats.rooms, stats.notes, stats.bytes / 1e3,
+           stats.millis);
+}
+
+
+/* Only async-signal-safe work here: the loop does the shutdown itself,
+ * so that nothing it holds (poolLock, a log commit) is torn down under it
+ */
+void sigHandler(int sig)
+{
+    stopRequested = 1;
+    if (write(wakePipe[1], "", 1) < 0) {
+        /* No pipe yet: the loop sees the flag after its next turn */
+    }
+}
+
+
+/* Report the totals and close the capture, log and checkpoints; runs on
+ * the event loop after it has stopped
+ */
+void shutdownServer()
+{
+    FanoutStats pushed;
+    fanout_stats(&pushed);
+    if (pushed.frames > 0) {
+        printf("Pushed %ld notes to subscribers in %ld frames "
+               "(%ld from the fan-out threads)\n", pushed.notes,
+               pushed.frames, pushed.offloaded);
+    }
+    if (pushed.offloaded > 0 && place_nodes() > 1) {
+        printf("Fan-out threads read %.1f MB of notes on the home node "
+               "and %.1f MB across nodes\n", pushed.local_bytes / 1e6,
+               pushed.remote_bytes / 1e6);
+    }
+    if (pushed.dropped > 0) {
+        printf("Dropped %ld pushes to slow subscribers, sent %ld resync "
+               "markers\n", pushed.dropped, pushed.resyncs);
+    }
+    if (pushed.moves > 0 || pushed.pins > 0) {
+        printf("Rebalanced the fan-out threads: %ld room moves, "
+               "%ld rooms pinned\n", pushed.moves, pushed.pins);
+    }
+    for (int cls = 0; cls < task_classes(); cls++) {
+        TaskClassStats task;
+        task_stats(cls, &task);
+        printf("Background %s: %ld tasks (%ld stolen), %.1f ms CPU, "
+               "%.1f ms throttled\n", task.name, task.tasks, task.steals,
+               task.cpu_ms, task.throttled_ms);
+    }
+    printf("Shutting down the server.\n");
+    capture_close();
+    wal_close();
+    ckpt_close();
+    theServer.close();
+    exit(0);
+}
+
+
+/* --- Helper Functions --- */
+
+/* Queue a packet in the client's send buffer. The buffer is sent by
+ * flushClient() once the current read has been handled, or earlier if
+ * it fills up (e.g. while listing a large room).
+ */
+bool transmitPacket(ClientContext *ctx, Packet *p)
+{
+    if (ctx->wbuf != NULL &&
+        ctx->wbuf->len + (int)sizeof(Packet) > POOL_BUFFER_SIZE) {
+        /* Nowhere to hold more replies, so wait for the log instead */
+        if (wal_durable() < wal_sequence() || ctx->awaiting_log) {
+            wal_sync();
+        }
+        if (!flushClient(ctx)) {
+            return false;
         }
-        cur = cur->next;
     }
-    return NULL;
+    if (ctx->wbuf == NULL) {
+        ctx->wbuf = pool_borrow();
+    }
+
+    memcpy(ctx->wbuf->data + ctx->wbuf->len, p, sizeof(Packet));
+    ctx->wbuf->len += sizeof(Packet);
+    return true;
 }
 
 
-Room* findRoomByInvite(int code)
+/* Called by fanout_deliver() (see fanout.h) */
+int transmitBytes(ClientContext *ctx, const void *data, int len, bool wait)
 {
-    Room *cur = roomListHead;
-    while (cur != NULL) {
-        if (cur->invite_code == code) {
-            return cur;
+    int flags = MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT);
+    int done = 0;
+    while (done < len) {
+        int n = send(ctx->sock->fd(), (const char *)data + done, len - done,
+                     flags);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN && !wait) {
+            break;
         }
-        cur = cur->next;
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
     }
-    return NULL;
+    return done;
 }
 
 
-void addNote(Room *r, const char *content)
+/* Send everything queued for the client and return the buffer. Pushes
+ * the client is too slow to take may be kept for later, or dropped (see
+ * fanout.h).
+ */
+bool flushClient(ClientContext *ctx)
 {
-    Note *n = new Note();
-    n->id = ++(r->note_count);
-    memcpy(n->ciphertext, content, MSG_SIZE);
-    n->next = r->notes;
-    r->notes = n;
+    PoolBuffer *wb = ctx->wbuf;
+    if (wb == NULL) {
+        return true;
+    }
+
+    bool sent = fanout_deliver(ctx, (Packet *)wb->data,
+                               wb->len / sizeof(Packet));
+
+    pool_return(wb);
+    ctx->wbuf = NULL;
+    return sent;
 }
@@ -0,0 +1,128 @@
+/* idleBench.cc
+ *
+ * SecureCollabNotes Idle-Connection Footprint Benchmark
+ *
+ * This program opens N connections to a running server, completes the
+ * handshake on each and then leaves them idle. It reads the server's
+ * resident set size from /proc before and after, and reports the cost
+ * in bytes per connection. It then has every connection list a room
+ * once and measures again, to check that buffers borrowed while data
+ * was in flight went back to the shared pool.
+ *
+ * The server must run on the same machine, since its memory is read
+ * from /proc/<pid>/status.
+ *
+ * Usage: idleBench <server-addr> <port> <server-pid> [connections]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "finalPacket.h"
+#include "clientConn.h"
+
+/* Default number of idle connections to open */
+const int DEFAULT_CONNECTIONS = 900;
+
+/* Function prototypes for top-down design */
+long readRssBytes(int pid);
+void raiseFdLimit();
+void report(const char *phase, long before, long after, int conns);
+
+/* Global variables */
+ClientConn *conns;
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        fprintf(stderr, "Error: Invalid number of arguments.\n");
+        fprintf(stderr, "usage: idleBench <server-addr> <port> <server-pid> "
+                        "[connections]\n");
+        exit(1);
+    }
+
+    char *server = argv[1];
+    int port = atoi(argv[2]);
+    int pid = atoi(argv[3]);
+    int count = argc > 4 ? atoi(argv[4]) : DEFAULT_CONNECTIONS;
+
+    raiseFdLimit();
+    conns = (ClientConn *)calloc(count, sizeof(ClientConn));
+
+    long baseline = readRssBytes(pid);
+    if (baseline < 0) {
+        printf("Error: cannot read memory of pid %d\n", pid);
+        exit(1);
+    }
+
+    /* Phase 1: connect and handshake, then sit idle */
+    int opened = 0;
+    for (int i = 0; i < count; i++) {
+        if (!conn_open(&conns[i], server, port)) {
+            printf("Connection %d failed; measuring %d connections.\n", i, i);
+            break;
+        }
+        opened++;
+    }
+    sleep(1);
+    long idle = readRssBytes(pid);
+    report("idle after handshake", baseline, idle, opened);
+
+    /* Phase 2: one request each, then idle again */
+    for (int i = 0; i < opened; i++) {
+        conn_list_notes(&conns[i]);
+    }
+    sleep(1);
+    long afterActivity = readRssBytes(pid);
+    report("idle after one request", baseline, afterActivity, opened);
+
+    for (int i = 0; i < opened; i++) {
+        conn_close(&conns[i]);
+    }
+    return 0;
+}
+
+
+void report(const char *phase, long before, long after, int conns)
+{
+    printf("%-24s %6d conns  RSS %8ld KB -> %8ld KB  %8.0f bytes/conn\n",
+           phase, conns, before / 1024, after / 1024,
+           conns > 0 ? (double)(after - before) / conns : 0);
+}
+
+
+/* --- Helper Functions --- */
+
+long readRssBytes(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb < 0 ? -1 : kb * 1024;
+}
+
+
+void raiseFdLimit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
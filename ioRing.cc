@@ -0,0 +1,179 @@
+/* ioRing.cc
+ *
+ * Minimal io_uring Wrapper - Implementation
+ *
+ * The submission and completion rings are shared with the kernel, so
+ * their head and tail indexes are read with acquire and published with
+ * release ordering.
+ */
+
+#include "ioRing.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+static int sysSetup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sysEnter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+                        NULL, 0);
+}
+
+
+static int sysRegister(int fd, unsigned op, void *arg, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+
+bool ring_init(IoRing *ring, unsigned entries)
+{
+    memset(ring, 0, sizeof(IoRing));
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = sysSetup(entries, &p);
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(IoRingResult);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_map_size > ring->sq_map_size) {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+
+    if (single) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_size);
+            close(ring->fd);
+            return false;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(IoRingEntry);
+    ring->sqes = (IoRingEntry *)mmap(NULL, ring->sqes_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->fd,
+                                     IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (!single) {
+            munmap(ring->cq_map, ring->cq_map_size);
+        }
+        munmap(ring->sq_map, ring->sq_map_size);
+        close(ring->fd);
+        return false;
+    }
+
+    char *sq = (char *)ring->sq_map;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    char *cq = (char *)ring->cq_map;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (IoRingResult *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+
+bool ring_register_buffers(IoRing *ring, struct iovec *iov, unsigned count)
+{
+    return sysRegister(ring->fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+}
+
+
+bool ring_register_eventfd(IoRing *ring, int efd)
+{
+    return sysRegister(ring->fd, IORING_REGISTER_EVENTFD, &efd, 1) == 0;
+}
+
+
+IoRingEntry *ring_next(IoRing *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+
+    unsigned index = ring->sq_local_tail & ring->sq_mask;
+    IoRingEntry *e = &ring->sqes[index];
+    memset(e, 0, sizeof(IoRingEntry));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return e;
+}
+
+
+bool ring_submit(IoRing *ring, unsigned wait_for)
+{
+    unsigned count = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    if (count == 0 && wait_for == 0) {
+        return true;
+    }
+
+    unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int n;
+    do {
+        n = sysEnter(ring->fd, count, wait_for, flags);
+    } while (n < 0 && errno == EINTR);
+    return n >= 0;
+}
+
+
+IoRingResult *ring_peek(IoRing *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+
+void ring_seen(IoRing *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+void ring_close(IoRing *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
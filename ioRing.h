@@ -0,0 +1,83 @@
+/* ioRing.h
+ *
+ * Minimal io_uring Wrapper - Header File
+ *
+ * Just enough of io_uring for the write-ahead log to queue writes and
+ * fsyncs and learn when they finish, without a library dependency: the
+ * rings are set up and driven with the raw system calls.
+ *
+ * A typical round:
+ *
+ *   IoRingEntry *e = ring_next(&ring);    fill in e, repeat as needed
+ *   ring_submit(&ring, 0);                start them (0 = don't wait)
+ *   ...
+ *   IoRingResult *c;
+ *   while ((c = ring_peek(&ring)) != NULL) {
+ *       use c->user_data and c->res
+ *       ring_seen(&ring);
+ *   }
+ */
+
+#ifndef _IORING_H
+#define _IORING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct io_uring_sqe IoRingEntry;
+typedef struct io_uring_cqe IoRingResult;
+
+struct IoRing {
+    int fd;
+
+    /* Submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     /* entries handed out but not submitted */
+    IoRingEntry *sqes;
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    IoRingResult *cqes;
+
+    /* Mappings, for ring_close() */
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+/* Set up a ring with room for the given number of queued entries.
+ * Returns false if io_uring is unavailable (old kernel, seccomp, ...).
+ */
+bool ring_init(IoRing *ring, unsigned entries);
+
+/* Pin buffers for IORING_OP_WRITE_FIXED (buf_index = position in iov) */
+bool ring_register_buffers(IoRing *ring, struct iovec *iov, unsigned count);
+
+/* Have the kernel signal an eventfd whenever a completion is posted */
+bool ring_register_eventfd(IoRing *ring, int efd);
+
+/* Returns a zeroed entry to fill in, or NULL if the queue is full */
+IoRingEntry *ring_next(IoRing *ring);
+
+/* Submit every entry from ring_next() and optionally wait until at
+ * least wait_for completions are available. Returns false on error.
+ */
+bool ring_submit(IoRing *ring, unsigned wait_for);
+
+/* Oldest unconsumed completion, or NULL; release it with ring_seen() */
+IoRingResult *ring_peek(IoRing *ring);
+void ring_seen(IoRing *ring);
+
+/* Tear down the ring (and with it any registrations) */
+void ring_close(IoRing *ring);
+
+#endif
@@ -0,0 +1,130 @@
+/* latencyStats.cc
+ *
+ * Latency Statistics - Implementation
+ */
+
+#include "latencyStats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+double now_micros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+void latency_add(LatencySet *s, double micros)
+{
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->samples = (double *)realloc(s->samples, s->cap * sizeof(double));
+    }
+    s->samples[s->count++] = micros;
+}
+
+
+void latency_reset(LatencySet *s)
+{
+    s->count = 0;
+}
+
+
+void latency_sort(LatencySet *s)
+{
+    qsort(s->samples, s->count, sizeof(double), compareDoubles);
+}
+
+
+double latency_percentile(LatencySet *s, double pct)
+{
+    if (s->count == 0) {
+        return 0;
+    }
+    size_t idx = (size_t)(pct / 100.0 * (s->count - 1) + 0.5);
+    return s->samples[idx];
+}
+
+
+double latency_mean(LatencySet *s)
+{
+    if (s->count == 0) {
+        return 0;
+    }
+    double total = 0;
+    for (size_t i = 0; i < s->count; i++) {
+        total += s->samples[i];
+    }
+    return total / s->count;
+}
+
+
+void latency_print(FILE *out, LatencySet *sets, int n)
+{
+    fprintf(out, "# op count p50_us p90_us p99_us max_us mean_us\n");
+
+    for (int i = 0; i < n; i++) {
+        LatencySet *s = &sets[i];
+        if (s->count == 0) {
+            continue;
+        }
+
+        latency_sort(s);
+        fprintf(out, "%s %zu %.1f %.1f %.1f %.1f %.1f\n", s->name, s->count,
+                latency_percentile(s, 50), latency_percentile(s, 90),
+                latency_percentile(s, 99), s->samples[s->count - 1],
+                latency_mean(s));
+    }
+}
+
+
+void latency_compare(const char *path, LatencySet *sets, int n)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        printf("Error: could not read baseline %s\n", path);
+        return;
+    }
+
+    printf("\n--- Latency delta vs %s ---\n", path);
+    printf("%-10s %12s %12s\n", "op", "p50 delta", "p99 delta");
+
+    char line[256];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char name[32];
+        size_t count;
+        double p50, p90, p99, pmax, mean;
+
+        if (line[0] == '#' ||
+            sscanf(line, "%31s %zu %lf %lf %lf %lf %lf", name, &count, &p50,
+                   &p90, &p99, &pmax, &mean) != 7) {
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            LatencySet *s = &sets[i];
+            if (strcmp(s->name, name) != 0 || s->count == 0) {
+                continue;
+            }
+            latency_sort(s);
+            double d50 = latency_percentile(s, 50) - p50;
+            double d99 = latency_percentile(s, 99) - p99;
+            printf("%-10s %+10.1fus %+10.1fus  (%+.1f%% / %+.1f%%)\n", name,
+                   d50, d99, p50 > 0 ? 100 * d50 / p50 : 0,
+                   p99 > 0 ? 100 * d99 / p99 : 0);
+        }
+    }
+    fclose(in);
+}
@@ -0,0 +1,52 @@
+/* latencyStats.h
+ *
+ * Latency Statistics - Header File
+ *
+ * Collects latency samples for one kind of request and reports
+ * percentiles. Shared by the benchmarking tools.
+ */
+
+#ifndef _LATENCYSTATS_H
+#define _LATENCYSTATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Latency samples (microseconds) for one kind of request */
+struct LatencySet {
+    const char *name;
+    int op;
+    double *samples;
+    size_t count;
+    size_t cap;
+};
+
+/* Current time on the monotonic clock, in microseconds */
+double now_micros();
+
+/* Record one sample */
+void latency_add(LatencySet *s, double micros);
+
+/* Forget all samples (keeps the buffer) */
+void latency_reset(LatencySet *s);
+
+/* Sort the samples; required before latency_percentile() */
+void latency_sort(LatencySet *s);
+
+/* The pct'th percentile (0-100) of a sorted set, 0 if it is empty */
+double latency_percentile(LatencySet *s, double pct);
+
+/* Mean of all samples, 0 if the set is empty */
+double latency_mean(LatencySet *s);
+
+/* Print "# op count p50_us ..." followed by one line per non-empty set.
+ * The format is read back by latency_compare().
+ */
+void latency_print(FILE *out, LatencySet *sets, int n);
+
+/* Print p50/p99 deltas of the given sets against a file written by
+ * latency_print() (e.g. from a previous build).
+ */
+void latency_compare(const char *path, LatencySet *sets, int n);
+
+#endif
@@ -0,0 +1,294 @@
+/* noteStore.cc
+ *
+ * Room and Note Storage - Implementation
+ *
+ * See noteStore.h for the memory layout and indexes.
+ */
+
+#include "noteStore.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Global room list (newest first) */
+Room *roomListHead = NULL;
+int nextRoomId = 1;
+
+/* The block new rooms are currently carved from */
+static Room *roomBlock = NULL;
+static int roomBlockUsed = ROOM_BLOCK;
+
+/* Id index: chained hash table, bucket = id & (idIndexSize - 1) */
+static Room **idIndex = NULL;
+static int idIndexSize = 0;
+static int roomTotal = 0;
+
+/* Invite index: one chain per invite code, newest room first */
+static Room *inviteIndex[INVITE_MAX - INVITE_MIN + 1];
+
+/* Rooms changed since the last checkpoint */
+static Room *dirtyListHead = NULL;
+
+
+static NoteChunk* newNoteChunk(int capacity, NoteChunk *prev)
+{
+    NoteChunk *c = new NoteChunk();
+    c->count = 0;
+    c->capacity = capacity;
+    c->prev = prev;
+    c->notes = new Note[capacity];
+    return c;
+}
+
+
+static void initRoom(Room *r, int id, int invite_code,
+                     unsigned long long room_key)
+{
+    r->id = id;
+    r->invite_code = invite_code;
+    r->room_key = room_key;
+    r->notes = NULL;
+    r->note_count = 0;
+    r->version = 0;
+    r->next = NULL;
+    r->next_by_id = NULL;
+    r->next_by_invite = NULL;
+    r->saved_notes = -1;
+    r->dirty = false;
+    r->next_dirty = NULL;
+    r->subscribers = NULL;
+    r->subscriber_count = 0;
+    r->fanout = NULL;
+    r->touched = false;
+    r->next_touched = NULL;
+    r->digest = NULL;
+}
+
+
+Room* createRoom()
+{
+    int invite_code = rand() % (INVITE_MAX - INVITE_MIN + 1) + INVITE_MIN;
+    return createRoomFrom(invite_code,
+                          ((unsigned long long)rand() << 32) | rand());
+}
+
+
+Room* createRoomFrom(int invite_code, unsigned long long room_key)
+{
+    if (roomBlockUsed == ROOM_BLOCK) {
+        roomBlock = new Room[ROOM_BLOCK];
+        roomBlockUsed = 0;
+    }
+
+    Room *r = &roomBlock[roomBlockUsed++];
+    initRoom(r, nextRoomId, invite_code, room_key);
+
+    reserveRoomIndex(roomTotal + 1);
+    indexRoomById(r);
+    linkRestoredRoom(r);
+    return r;
+}
+
+
+Room* findRoomById(int id)
+{
+    if (idIndex == NULL) {
+        return NULL;
+    }
+
+    Room *cur = idIndex[id & (idIndexSize - 1)];
+    while (cur != NULL) {
+        if (cur->id == id) {
+            return cur;
+        }
+        cur = cur->next_by_id;
+    }
+    return NULL;
+}
+
+
+Room* findRoomByInvite(int code)
+{
+    if (code < INVITE_MIN || code > INVITE_MAX) {
+        return NULL;
+    }
+    return inviteIndex[code - INVITE_MIN];
+}
+
+
+Note* addNote(Room *r, const char *content)
+{
+    NoteChunk *c = r->notes;
+
+    if (c == NULL) {
+        c = newNoteChunk(NOTE_CHUNK_MIN, NULL);
+        r->notes = c;
+    } else if (c->count == c->capacity) {
+        int capacity = c->capacity * 2;
+        if (capacity > NOTE_CHUNK_MAX) {
+            capacity = NOTE_CHUNK_MAX;
+        }
+        c = newNoteChunk(capacity, c);
+        r->notes = c;
+    }
+
+    Note *n = &c->notes[c->count++];
+    n->id = ++(r->note_count);
+    memcpy(n->ciphertext, content, MSG_SIZE);
+    r->version++;
+    return n;
+}
+
+
+Note* appendNotes(Room *r, int count)
+{
+    if (count <= 0) {
+        return NULL;
+    }
+
+    NoteChunk *c = newNoteChunk(count, r->notes);
+    r->notes = c;
+    c->count = count;
+    for (int i = 0; i < count; i++) {
+        c->notes[i].id = ++(r->note_count);
+    }
+    r->version += count;
+    return c->notes;
+}
+
+
+void forEachNote(Room *r, NoteVisitor visit, void *arg)
+{
+    for (NoteChunk *c = r->notes; c != NULL; c = c->prev) {
+        for (int i = c->count - 1; i >= 0; i--) {
+            if (!visit(&c->notes[i], arg)) {
+                return;
+            }
+        }
+    }
+}
+
+
+/* Chunks are linked newest first, so older chunks are visited on the
+ * way back out. Returns false if the visitor stopped early.
+ */
+static bool visitChunksAfter(NoteChunk *c, int after, NoteVisitor visit,
+                             void *arg)
+{
+    if (c == NULL || c->count == 0) {
+        return true;
+    }
+    if (c->notes[0].id > after && !visitChunksAfter(c->prev, after, visit, arg)) {
+        return false;
+    }
+    for (int i = 0; i < c->count; i++) {
+        if (c->notes[i].id > after && !visit(&c->notes[i], arg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void forEachNoteAfter(Room *r, int after, NoteVisitor visit, void *arg)
+{
+    visitChunksAfter(r->notes, after, visit, arg);
+}
+
+
+/* --- Recovery support --- */
+
+Room* newRoom(int id, int invite_code, unsigned long long room_key)
+{
+    Room *r = new Room();
+    initRoom(r, id, invite_code, room_key);
+    return r;
+}
+
+
+void reserveRoomIndex(int rooms)
+{
+    if (rooms <= idIndexSize) {
+        return;
+    }
+
+    int size = idIndexSize > 0 ? idIndexSize : ROOM_INDEX_MIN;
+    while (size < rooms) {
+        size *= 2;
+    }
+
+    /* Rehash everything already indexed into the bigger table */
+    Room **table = new Room*[size]();
+    for (int i = 0; i < idIndexSize; i++) {
+        Room *cur = idIndex[i];
+        while (cur != NULL) {
+            Room *next = cur->next_by_id;
+            int b = cur->id & (size - 1);
+            cur->next_by_id = table[b];
+            table[b] = cur;
+            cur = next;
+        }
+    }
+
+    delete[] idIndex;
+    idIndex = table;
+    idIndexSize = size;
+}
+
+
+void indexRoomById(Room *r)
+{
+    int b = r->id & (idIndexSize - 1);
+    r->next_by_id = idIndex[b];
+    idIndex[b] = r;
+}
+
+
+void linkRestoredRoom(Room *r)
+{
+    r->next = roomListHead;
+    roomListHead = r;
+
+    if (r->invite_code >= INVITE_MIN && r->invite_code <= INVITE_MAX) {
+        Room **chain = &inviteIndex[r->invite_code - INVITE_MIN];
+        r->next_by_invite = *chain;
+        *chain = r;
+    }
+
+    if (r->id >= nextRoomId) {
+        nextRoomId = r->id + 1;
+    }
+    roomTotal++;
+}
+
+
+int roomCount()
+{
+    return roomTotal;
+}
+
+
+/* --- Dirty tracking --- */
+
+void markRoomDirty(Room *r)
+{
+    if (!r->dirty) {
+        r->dirty = true;
+        r->next_dirty = dirtyListHead;
+        dirtyListHead = r;
+    }
+}
+
+
+bool anyDirtyRooms()
+{
+    return dirtyListHead != NULL;
+}
+
+
+Room* takeDirtyRooms()
+{
+    Room *list = dirtyListHead;
+    dirtyListHead = NULL;
+    return list;
+}
@@ -0,0 +1,160 @@
+/* noteStore.h
+ *
+ * Room and Note Storage - Header File
+ *
+ * Holds every room the server knows about and the notes posted to them.
+ * The server, the benchmarks and the allocation harness all use these
+ * functions directly.
+ *
+ * MEMORY LAYOUT:
+ * -------------
+ * Rooms are carved out of blocks of ROOM_BLOCK rooms, and each room keeps
+ * its notes in a chain of chunks whose capacity doubles (up to
+ * NOTE_CHUNK_MAX notes). A small room therefore costs a few hundred bytes
+ * while a busy room only allocates once every NOTE_CHUNK_MAX posts, so
+ * posting a note does not normally call the allocator at all.
+ *
+ * INDEXES:
+ * -------
+ * Rooms are found through two hash indexes rather than by walking the
+ * room list: one by id (a power-of-two table that doubles as rooms are
+ * added) and one by invite code (one chain per possible code). The room
+ * list is kept for code that needs to visit every room.
+ */
+
+#ifndef _NOTESTORE_H
+#define _NOTESTORE_H
+
+#include "finalPacket.h"
+
+struct ClientContext;
+struct RoomFanout;
+struct RoomDigest;
+
+/* Number of rooms allocated together when the current block runs out */
+const int ROOM_BLOCK = 64;
+
+/* Initial size of the id index (always a power of two) */
+const int ROOM_INDEX_MIN = 1024;
+
+/* Range of invite codes handed out by createRoom() */
+const int INVITE_MIN = 1000;
+const int INVITE_MAX = 9999;
+
+/* Capacity of a room's first note chunk, and the cap chunks grow to */
+const int NOTE_CHUNK_MIN = 4;
+const int NOTE_CHUNK_MAX = 256;
+
+/* Data structure for storing notes in a room */
+struct Note {
+    int id;
+    char ciphertext[MSG_SIZE];
+};
+
+/* A run of consecutive notes. Notes are stored oldest first within a
+ * chunk, and a room's chunks are linked newest first.
+ */
+struct NoteChunk {
+    int count;
+    int capacity;
+    NoteChunk *prev;
+    Note *notes;
+};
+
+/* Data structure for storing room information */
+struct Room {
+    int id;
+    int invite_code;
+    unsigned long long room_key;
+    NoteChunk *notes;
+    int note_count;
+    int version;            /* bumped by every change to the notes */
+    Room *next;             /* room list, newest first */
+    Room *next_by_id;       /* id index chain */
+    Room *next_by_invite;   /* invite index chain */
+    int saved_notes;        /* notes already checkpointed, -1 if the room
+                               itself is not in a checkpoint yet */
+    bool dirty;             /* on the dirty list */
+    Room *next_dirty;       /* dirty list */
+    ClientContext *subscribers;     /* see fanout.h */
+    int subscriber_count;
+    RoomFanout *fanout;     /* fan-out thread placement, NULL unless the
+                               room is pushed by the fan-out threads */
+    bool touched;           /* posted to in this event-loop turn */
+    Room *next_touched;     /* rooms posted to this turn (see fanout.h) */
+    RoomDigest *digest;     /* Merkle tree, NULL until first asked for
+                               (see roomDigest.h) */
+};
+
+/* Create a new room with a fresh id and random invite code */
+Room* createRoom();
+
+/* Create a room with a fresh id but a given invite code and key, for a
+ * room brought over from elsewhere (see roomArchive.h)
+ */
+Room* createRoomFrom(int invite_code, unsigned long long room_key);
+
+/* Look up a room; both return NULL if there is no match */
+Room* findRoomById(int id);
+Room* findRoomByInvite(int code);
+
+/* Append a note to a room. The note gets id note_count + 1, and the
+ * room's version goes up by one. Different rooms may be appended to from
+ * different threads.
+ */
+Note* addNote(Room *r, const char *content);
+
+/* Append count notes to a room at once, in a single chunk, and return
+ * the first of them. They get the next count ids in order; the caller
+ * fills in their text. The version goes up by count. Used for bulk
+ * loads.
+ */
+Note* appendNotes(Room *r, int count);
+
+/* Visit a room's notes, newest first. The callback returns false to
+ * stop early.
+ */
+typedef bool (*NoteVisitor)(Note *n, void *arg);
+void forEachNote(Room *r, NoteVisitor visit, void *arg);
+
+/* Visit the notes with ids above 'after', oldest first */
+void forEachNoteAfter(Room *r, int after, NoteVisitor visit, void *arg);
+
+/* --- Recovery support ---
+ *
+ * Crash recovery (walLog.cc) rebuilds rooms on several threads at once:
+ *
+ *   1. Each worker makes its rooms with newRoom() and fills them with
+ *      addNote(). Neither touches shared state.
+ *   2. The main thread calls reserveRoomIndex() with the total count.
+ *   3. Workers call indexRoomById() for their rooms. This is safe to do
+ *      concurrently provided each value of (id % P) belongs to a single
+ *      worker, for some power of two P <= ROOM_INDEX_MIN: the index size
+ *      is a multiple of P, so such workers never share a bucket.
+ *   4. The main thread calls linkRestoredRoom() for every room.
+ */
+Room* newRoom(int id, int invite_code, unsigned long long room_key);
+void reserveRoomIndex(int rooms);
+void indexRoomById(Room *r);
+void linkRestoredRoom(Room *r);
+
+/* Number of rooms in the store */
+int roomCount();
+
+/* --- Dirty tracking ---
+ *
+ * Rooms created or posted to since the last checkpoint (checkpoint.cc)
+ * are kept on a dirty list, so a checkpoint only visits what changed.
+ * Neither function is thread-safe.
+ */
+void markRoomDirty(Room *r);
+
+/* Returns true if the dirty list is not empty */
+bool anyDirtyRooms();
+
+/* Returns the dirty list (linked by next_dirty) and starts a new one.
+ * The rooms keep their dirty flag until the caller clears it.
+ */
+Room* takeDirtyRooms();
+
+#endif
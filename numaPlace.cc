@@ -0,0 +1,171 @@
+/* numaPlace.cc
+ *
+ * NUMA Placement - Implementation
+ */
+
+#include "numaPlace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+static int nodeCount = 1;
+static int nodeIds[PLACE_MAX_NODES];   /* kernel id of each node */
+static int homeNode = 0;
+static int cpuNode[CPU_SETSIZE];       /* node of each CPU, or -1 */
+
+/* Function prototypes for top-down design */
+static int readCpuList(int id, int node);
+
+
+void place_init()
+{
+    /* Ids can have gaps (e.g. after a node is offlined), and a node with
+     * no CPUs gets no number
+     */
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        cpuNode[cpu] = -1;
+    }
+    nodeCount = 0;
+    for (int id = 0; id < PLACE_MAX_NODES; id++) {
+        if (readCpuList(id, nodeCount) > 0) {
+            nodeIds[nodeCount++] = id;
+        }
+    }
+
+    /* Without NUMA information every CPU is on the one node */
+    if (nodeCount == 0) {
+        memset(cpuNode, 0, sizeof(cpuNode));
+        nodeIds[0] = 0;
+        nodeCount = 1;
+    }
+    if (homeNode >= nodeCount) {
+        homeNode = 0;
+    }
+}
+
+
+int place_nodes()
+{
+    return nodeCount;
+}
+
+
+int place_node_id(int node)
+{
+    return node >= 0 && node < nodeCount ? nodeIds[node] : -1;
+}
+
+
+int place_node_of_cpu(int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    return cpuNode[cpu];
+}
+
+
+int place_current_node()
+{
+    return place_node_of_cpu(sched_getcpu());
+}
+
+
+void place_set_home(int id)
+{
+    homeNode = 0;
+    for (int node = 0; node < nodeCount; node++) {
+        if (nodeIds[node] == id) {
+            homeNode = node;
+        }
+    }
+}
+
+
+int place_home()
+{
+    return homeNode;
+}
+
+
+bool place_run_on_node(int node)
+{
+    if (nodeCount == 1) {
+        return true;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (cpuNode[cpu] == node) {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+
+bool place_prefer_memory(int node)
+{
+    if (nodeCount == 1) {
+        return true;
+    }
+
+    if (node < 0 || node >= nodeCount) {
+        return false;
+    }
+    int id = nodeIds[node];
+    unsigned long mask[PLACE_MAX_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[id / (8 * sizeof(unsigned long))] |=
+        1UL << (id % (8 * sizeof(unsigned long)));
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                   sizeof(mask) * 8 + 1) == 0;
+}
+
+
+/* --- Helper Functions --- */
+
+/* Mark the CPUs listed for the node with kernel id 'id' (e.g.
+ * "0-3,8-11") as being on 'node'. Returns the number marked: 0 if the
+ * node does not exist or has no CPUs.
+ */
+static int readCpuList(int id, int node)
+{
+    char path[96];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/node/node%d/cpulist", id);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    char list[4096];
+    if (fgets(list, sizeof(list), f) == NULL) {
+        list[0] = '\0';
+    }
+    fclose(f);
+
+    int marked = 0;
+    char *p = list;
+    while (*p >= '0' && *p <= '9') {
+        int first = strtol(p, &p, 10);
+        int last = first;
+        if (*p == '-') {
+            last = strtol(p + 1, &p, 10);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            cpuNode[cpu] = node;
+            marked++;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return marked;
+}
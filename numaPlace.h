@@ -0,0 +1,64 @@
+/* numaPlace.h
+ *
+ * NUMA Placement - Header File
+ *
+ * On a host with several NUMA nodes, memory is only fast from the node it
+ * was allocated on. The server's data (rooms, notes, client contexts and
+ * I/O buffers) is allocated by the event loop, so it lands on whatever
+ * node the loop runs on: the home node. This module finds the nodes and
+ * their CPUs (from /sys/devices/system/node), keeps threads on a node and
+ * steers a thread's allocations to a node, so that:
+ *
+ *   - the event loop runs on the home node, and the notes it allocates
+ *     are first touched there;
+ *   - recovery workers, which may run anywhere, still allocate the rooms
+ *     and notes they rebuild on the home node;
+ *   - fan-out threads are spread over the nodes, and rooms go to threads
+ *     on the home node while those are not much busier (see fanout.h).
+ *
+ * Memory policy is set with the set_mempolicy() system call directly, so
+ * libnuma is not needed. On a single-node host every call succeeds
+ * without doing anything.
+ *
+ * Node ids can have gaps, and some nodes have memory but no CPUs, which
+ * no thread can be kept on. The nodes this module deals in are therefore
+ * only those with CPUs, numbered 0 .. place_nodes() - 1 in id order;
+ * place_node_id() gives a node's id as the kernel knows it.
+ */
+
+#ifndef _NUMAPLACE_H
+#define _NUMAPLACE_H
+
+/* Most nodes handled */
+const int PLACE_MAX_NODES = 64;
+
+/* Read the node layout; without NUMA information there is one node */
+void place_init();
+
+/* Number of nodes with CPUs (at least 1) */
+int place_nodes();
+
+/* Kernel id of a node */
+int place_node_id(int node);
+
+/* Node of a CPU, and of the CPU the calling thread is running on (-1 for
+ * a CPU no node lists)
+ */
+int place_node_of_cpu(int cpu);
+int place_current_node();
+
+/* The node the event loop and the store live on, set by its kernel id
+ * (the first node if no node with CPUs has that id)
+ */
+void place_set_home(int id);
+int place_home();
+
+/* Keep the calling thread on node's CPUs. Returns false on failure. */
+bool place_run_on_node(int node);
+
+/* Allocate the calling thread's new memory on node where possible.
+ * Returns false on failure.
+ */
+bool place_prefer_memory(int node);
+
+#endif
@@ -0,0 +1,83 @@
+#!/bin/sh
+# pgo.sh
+#
+# Profile-guided, link-time optimized build of finalServer.
+#
+#   ./pgo.sh build   Instrument, train with finalLoad, rebuild as
+#                    finalServer-pgo (-O2 -flto -fprofile-use)
+#   ./pgo.sh bench   Do the above, then benchmark finalServer-pgo against
+#                    a plain -O2 build (finalServer-o2) with the same load
+#
+# The training and benchmark workloads can be changed through PGO_TRAIN
+# and PGO_BENCH (finalLoad options); PGO_PORT picks the port.
+#
+# The regular finalServer is rebuilt with the default flags at the end,
+# so the tree is left as a normal `make` would leave it.
+
+set -e
+
+PORT=${PGO_PORT:-30999}
+TRAIN=${PGO_TRAIN:-"-c 64 -r 200 -n 100000 -p 2000 -s 7"}
+BENCH=${PGO_BENCH:-"-c 64 -r 200 -n 200000 -p 2000 -s 11"}
+
+GEN_FLAGS="-O2 -fprofile-generate -fprofile-update=single"
+USE_FLAGS="-O2 -flto -fprofile-use -fprofile-correction -Wno-missing-profile"
+
+# Run a server binary, drive finalLoad against it, stop it with SIGINT
+# (which exits cleanly, so instrumented builds write their profile).
+run_load() {
+    server=$1
+    shift
+    ./$server $PORT > /dev/null &
+    pid=$!
+    sleep 0.5
+    ./finalLoad 127.0.0.1 $PORT "$@"
+    kill -INT $pid
+    wait $pid || true
+}
+
+build() {
+    echo "=== Building instrumented server ==="
+    rm -f *.gcda
+    make clean-server
+    make finalServer CXXFLAGS="$GEN_FLAGS" LDFLAGS="-fprofile-generate"
+
+    echo "=== Training with the representative workload ==="
+    run_load finalServer $TRAIN > /dev/null
+
+    echo "=== Rebuilding with the profile ==="
+    make clean-server
+    make finalServer CXXFLAGS="$USE_FLAGS" LDFLAGS="-O2 -flto"
+    mv finalServer finalServer-pgo
+}
+
+bench() {
+    echo "=== Building plain -O2 server ==="
+    make clean-server
+    make finalServer
+    cp finalServer finalServer-o2
+
+    echo "=== Benchmark: -O2 ==="
+    run_load finalServer-o2 $BENCH -o pgo-o2.txt
+
+    echo "=== Benchmark: PGO + LTO ==="
+    run_load finalServer-pgo $BENCH -b pgo-o2.txt
+}
+
+case "$1" in
+    build)
+        build
+        ;;
+    bench)
+        build
+        bench
+        ;;
+    *)
+        echo "usage: pgo.sh build|bench"
+        exit 1
+        ;;
+esac
+
+# Leave a regular build behind
+make clean-server
+make finalServer
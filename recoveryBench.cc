@@ -0,0 +1,140 @@
+/* recoveryBench.cc
+ *
+ * SecureCollabNotes Crash Recovery Benchmark
+ *
+ * This program writes a synthetic write-ahead log (see walLog.h) and then
+ * times wal_recover() on it with 1, 2, 4, ... worker threads, so that the
+ * parallel replay can be checked to actually scale with cores.
+ *
+ * Every run happens in its own child process, so each one rebuilds an
+ * empty store. The log is written with O_DIRECT where possible, so the
+ * first run reads it from disk and later runs find it in the page cache;
+ * drop the caches between runs to compare them on equal terms.
+ *
+ * Usage: recoveryBench [rooms] [notes-per-room] [max-threads] [dir]
+ *
+ *   rooms            Rooms in the log (default 200000)
+ *   notes-per-room   Notes posted to each room (default 20)
+ *   max-threads      Largest thread count to try (default WAL_SEGMENTS)
+ *   dir              Where to write the log (default /tmp/recoveryBench)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "finalPacket.h"
+#include "noteStore.h"
+#include "walLog.h"
+
+/* Length of each synthetic note's text */
+const int NOTE_TEXT_LEN = 64;
+
+/* Function prototypes for top-down design */
+void writeLog(const char *dir, long rooms, long notesPerRoom);
+void removeLog(const char *dir);
+bool timeRecovery(const char *dir, int threads, WalRecoveryStats *out);
+
+
+int main(int argc, char *argv[])
+{
+    long rooms = argc > 1 ? atol(argv[1]) : 200000;
+    long notesPerRoom = argc > 2 ? atol(argv[2]) : 20;
+    int maxThreads = argc > 3 ? atoi(argv[3]) : WAL_SEGMENTS;
+    const char *dir = argc > 4 ? argv[4] : "/tmp/recoveryBench";
+
+    removeLog(dir);
+    writeLog(dir, rooms, notesPerRoom);
+    printf("Log: %ld rooms, %ld notes in %s (%ld online CPUs)\n",
+           rooms, rooms * notesPerRoom, dir, sysconf(_SC_NPROCESSORS_ONLN));
+
+    printf("%8s %12s %12s %10s\n", "threads", "ms", "MB/s", "speedup");
+    double baseline = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        WalRecoveryStats stats;
+        if (!timeRecovery(dir, threads, &stats)) {
+            printf("%8d (recovery failed)\n", threads);
+            continue;
+        }
+        if (baseline == 0) {
+            baseline = stats.millis;
+        }
+        printf("%8d %12.1f %12.1f %9.2fx\n", threads, stats.millis,
+               stats.bytes / 1e3 / stats.millis, baseline / stats.millis);
+    }
+
+    removeLog(dir);
+    return 0;
+}
+
+
+/* Create every room, then post notes round-robin across them so that
+ * each segment interleaves rooms the way a live server would.
+ */
+void writeLog(const char *dir, long rooms, long notesPerRoom)
+{
+    if (!wal_open(dir)) {
+        printf("Error: could not create a log in %s\n", dir);
+        exit(1);
+    }
+
+    Room r;
+    memset(&r, 0, sizeof(r));
+    for (long id = 1; id <= rooms; id++) {
+        r.id = id;
+        r.invite_code = INVITE_MIN + id % (INVITE_MAX - INVITE_MIN + 1);
+        r.room_key = id * 2654435761ULL;
+        wal_log_room(&r);
+    }
+
+    Note n;
+    memset(&n, 0, sizeof(n));
+    memset(n.ciphertext, 'n', NOTE_TEXT_LEN);
+    for (long i = 1; i <= notesPerRoom; i++) {
+        n.id = i;
+        for (long id = 1; id <= rooms; id++) {
+            r.id = id;
+            wal_log_note(&r, &n);
+        }
+    }
+
+    wal_close();
+}
+
+
+void removeLog(const char *dir)
+{
+    for (int i = 0; i < WAL_SEGMENTS; i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/wal-%02d.log", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+
+/* Run one recovery in a child and hand its stats back through shared
+ * memory
+ */
+bool timeRecovery(const char *dir, int threads, WalRecoveryStats *out)
+{
+    WalRecoveryStats *shared = (WalRecoveryStats *)mmap(NULL,
+        sizeof(WalRecoveryStats), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        bool ok = wal_recover(dir, threads, shared);
+        _exit(ok ? 0 : 1);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    memcpy(out, shared, sizeof(WalRecoveryStats));
+    munmap(shared, sizeof(WalRecoveryStats));
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
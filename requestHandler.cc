@@ -0,0 +1,468 @@
+/* requestHandler.cc
+ *
+ * Server Request Handling - Implementation
+ *
+ * See requestHandler.h for how this module fits into the server.
+ */
+
+#include "requestHandler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diffieHellman.h"
+#include "xor.h"
+#include "capture.h"
+#include "noteStore.h"
+#include "walLog.h"
+#include "earlyKey.h"
+#include "fanout.h"
+#include "roomDigest.h"
+
+/* Notes still to send with a join */
+struct PreloadState {
+    ClientContext *ctx;
+    int left;
+};
+
+/* Notes still to send for a range */
+struct RangeState {
+    ClientContext *ctx;
+    int last;
+};
+
+/* Function prototypes for top-down design */
+void handleHandshake(ClientContext *ctx, Packet *req);
+void handleEarlyHandshake(ClientContext *ctx, Packet *req);
+void setServerPublic(Packet *resp, unsigned long long pub);
+int handleCreateRoom(ClientContext *ctx, Packet *req);
+int handleJoinRoom(ClientContext *ctx, Packet *req);
+void handlePostNote(ClientContext *ctx, Packet *req);
+void handleListNotes(ClientContext *ctx, Packet *req);
+void handleListIfChanged(ClientContext *ctx, Packet *req);
+void handleSubscribe(ClientContext *ctx, Packet *req);
+void handleRoomDigest(ClientContext *ctx, Packet *req);
+void handleListRange(ClientContext *ctx, Packet *req);
+void sendEndMarker(ClientContext *ctx, int version);
+static bool sendListedNote(Note *n, void *arg);
+static bool sendPreloadedNote(Note *n, void *arg);
+static bool sendRangeNote(Note *n, void *arg);
+
+
+void handleRequest(ClientContext *ctx, Packet *req)
+{
+    /* Handle Diffie-Hellman handshake */
+    if (req->op == OP_DH_PUB) {
+        handleHandshake(ctx, req);
+        return;
+    }
+    if (req->op == OP_DH_EARLY) {
+        handleEarlyHandshake(ctx, req);
+        return;
+    }
+
+    /* Ensure client has completed handshake before processing encrypted requests */
+    if (!ctx->dh_completed) {
+        printf("Client not authenticated (conn: %u)\n", ctx->conn_id);
+        return;
+    }
+
+    /* Early requests are under the early key, and only joins and posts
+     * may be sent early
+     */
+    unsigned long long key = ctx->shared_key;
+    if (ctx->early_left > 0) {
+        ctx->early_left--;
+        if (ctx->early_key == 0 ||
+            (req->op != OP_JOIN_ROOM && req->op != OP_POST_NOTE)) {
+            printf("Early request dropped (conn: %u)\n", ctx->conn_id);
+            return;
+        }
+        key = ctx->early_key;
+    }
+
+    /* Decrypt incoming message */
+    xor_buffer(req->message, MSG_SIZE, key);
+
+    /* Room the request applied to, and its own room_id field (a count or
+     * note id for some requests), for the capture file
+     */
+    int capturedRoom = ctx->current_room_id;
+    int capturedArg = req->room_id;
+
+    if (req->op == OP_CREATE_ROOM) {
+        capturedRoom = handleCreateRoom(ctx, req);
+    }
+    else if (req->op == OP_JOIN_ROOM) {
+        capturedRoom = handleJoinRoom(ctx, req);
+    }
+    else if (req->op == OP_POST_NOTE) {
+        handlePostNote(ctx, req);
+    }
+    else if (req->op == OP_LIST_NOTES) {
+        handleListNotes(ctx, req);
+    }
+    else if (req->op == OP_LIST_IF_CHANGED) {
+        handleListIfChanged(ctx, req);
+    }
+    else if (req->op == OP_SUBSCRIBE) {
+        handleSubscribe(ctx, req);
+    }
+    else if (req->op == OP_ROOM_DIGEST) {
+        handleRoomDigest(ctx, req);
+    }
+    else if (req->op == OP_LIST_RANGE) {
+        handleListRange(ctx, req);
+    }
+
+    if (capture_enabled()) {
+        int payloadLen = 0;
+        if (req->op == OP_POST_NOTE) {
+            payloadLen = strnlen(req->message, MSG_SIZE);
+        }
+        capture_record(ctx->conn_id, req->op, capturedRoom, req->tag,
+                       capturedArg, payloadLen);
+    }
+}
+
+
+void initClientContext(ClientContext *ctx, Socket *sock, uint32_t conn_id)
+{
+    ctx->sock = sock;
+    ctx->shared_key = 0;
+    ctx->dh_private = 0;
+    ctx->early_key = 0;
+    ctx->early_left = 0;
+    ctx->dh_completed = false;
+    ctx->current_room_id = -1;
+    ctx->conn_id = conn_id;
+    ctx->rbuf = NULL;
+    ctx->wbuf = NULL;
+    ctx->ack_seq = 0;
+    ctx->awaiting_log = false;
+    ctx->subscribed = NULL;
+    ctx->push_after = 0;
+    ctx->prev_subscriber = NULL;
+    ctx->next_subscriber = NULL;
+    ctx->pushed = false;
+    ctx->next_pushed = NULL;
+    ctx->pushes_pending = 0;
+    pthread_mutex_init(&ctx->send_lock, NULL);
+    ctx->send_queue = NULL;
+    ctx->push_room = 0;
+}
+
+
+void beginHandshake(ClientContext *ctx)
+{
+    ctx->dh_private = dh_generate_private();
+
+    Packet resp;
+    memset(&resp, 0, sizeof(resp));
+    resp.op = OP_DH_PUB;
+    setServerPublic(&resp, dh_compute_public(ctx->dh_private));
+    transmitPacket(ctx, &resp);
+}
+
+
+void handleHandshake(ClientContext *ctx, Packet *req)
+{
+    unsigned long long client_pub = strtoull(req->message, NULL, 10);
+
+    /* The client already has our public value if we went first */
+    if (ctx->dh_private != 0) {
+        ctx->shared_key = dh_compute_shared(client_pub, ctx->dh_private);
+        ctx->dh_private = 0;
+        ctx->dh_completed = true;
+    } else {
+        unsigned long long my_priv = dh_generate_private();
+        unsigned long long my_pub = dh_compute_public(my_priv);
+        ctx->shared_key = dh_compute_shared(client_pub, my_priv);
+        ctx->dh_completed = true;
+
+        Packet resp;
+        memset(&resp, 0, sizeof(resp));
+        resp.op = OP_DH_PUB;
+        setServerPublic(&resp, my_pub);
+        transmitPacket(ctx, &resp);
+    }
+
+    capture_record(ctx->conn_id, OP_DH_PUB, -1, 0, 0, 0);
+    printf("Handshake complete (conn: %u)\n", ctx->conn_id);
+}
+
+
+/* 0-RTT handshake: the usual exchange, plus the key for the early
+ * requests that follow if the client's semi-static key is still good
+ * and this is not a replay
+ */
+void handleEarlyHandshake(ClientContext *ctx, Packet *req)
+{
+    unsigned long long client_pub = strtoull(req->message, NULL, 10);
+    int count = req->room_id > 0 ? req->room_id : 0;
+
+    /* Reuse our public value if it has already gone out (-f) */
+    unsigned long long my_priv = ctx->dh_private != 0 ? ctx->dh_private
+                                                      : dh_generate_private();
+    ctx->dh_private = 0;
+    ctx->shared_key = dh_compute_shared(client_pub, my_priv);
+    ctx->dh_completed = true;
+
+    ctx->early_key = 0;
+    ctx->early_left = count;
+    bool accepted = count > 0 && count <= EARLY_MAX_REQUESTS &&
+                    early_accept(req->tag, client_pub, &ctx->early_key);
+    if (!accepted) {
+        ctx->early_key = 0;
+    }
+
+    Packet resp;
+    memset(&resp, 0, sizeof(resp));
+    resp.op = OP_DH_EARLY;
+    resp.tag = accepted ? count : 0;
+    setServerPublic(&resp, dh_compute_public(my_priv));
+    transmitPacket(ctx, &resp);
+
+    capture_record(ctx->conn_id, OP_DH_PUB, -1, 0, 0, 0);
+    printf("Handshake complete (conn: %u, %d early requests %s)\n",
+           ctx->conn_id, count, accepted ? "accepted" : "refused");
+}
+
+
+/* Fill in a handshake reply: our public value, then the semi-static key
+ * for 0-RTT if it is enabled
+ */
+void setServerPublic(Packet *resp, unsigned long long pub)
+{
+    if (early_enabled()) {
+        uint32_t keyId;
+        unsigned long long staticPub;
+        early_current(&keyId, &staticPub);
+        snprintf(resp->message, MSG_SIZE, "%llu %u %llu", pub, keyId,
+                 staticPub);
+    } else {
+        snprintf(resp->message, MSG_SIZE, "%llu", pub);
+    }
+}
+
+
+/* Handle create room request. Returns the new room's id. */
+int handleCreateRoom(ClientContext *ctx, Packet *req)
+{
+    Packet resp;
+    memset(&resp, 0, sizeof(resp));
+
+    Room *r = createRoom();
+    wal_log_room(r);
+    markRoomDirty(r);
+    ctx->current_room_id = r->id;
+    resp.op = OP_CREATE_ROOM_RESP;
+    resp.room_id = r->id;
+    resp.tag = r->invite_code;
+    snprintf(resp.message, MSG_SIZE, "Room Created");
+    sendPacketEncrypted(ctx, &resp);
+    printf("Room %d created (invite: %d)\n", r->id, r->invite_code);
+    return r->id;
+}
+
+
+/* Handle join room request, sending the most recent req->room_id notes
+ * with the reply if asked. Returns the joined room's id, or -1.
+ */
+int handleJoinRoom(ClientContext *ctx, Packet *req)
+{
+    Packet resp;
+    memset(&resp, 0, sizeof(resp));
+
+    Room *r = findRoomByInvite(req->tag);
+    if (r != NULL) {
+        if (ctx->subscribed != NULL && ctx->subscribed != r) {
+            fanout_unsubscribe(ctx);
+        }
+        ctx->current_room_id = r->id;
+        resp.op = OP_JOIN_ROOM_RESP;
+        resp.room_id = r->id;
+        resp.tag = r->note_count;
+        snprintf(resp.message, MSG_SIZE, "Joined Room");
+    } else {
+        resp.op = OP_ERROR;
+        snprintf(resp.message, MSG_SIZE, "Invalid Code");
+    }
+    sendPacketEncrypted(ctx, &resp);
+
+    if (r != NULL && req->room_id > 0) {
+        PreloadState st;
+        st.ctx = ctx;
+        st.left = req->room_id < JOIN_PRELOAD_MAX ? req->room_id
+                                                   : JOIN_PRELOAD_MAX;
+        forEachNote(r, sendPreloadedNote, &st);
+        sendEndMarker(ctx, 0);
+    }
+    return r != NULL ? r->id : -1;
+}
+
+
+/* Handle post note request */
+void handlePostNote(ClientContext *ctx, Packet *req)
+{
+    Room *r = findRoomById(ctx->current_room_id);
+    if (r != NULL) {
+        Note *n = addNote(r, req->message);
+        wal_log_note(r, n);
+        markRoomDirty(r);
+        fanout_note_added(r);
+        printf("Note posted to Room %d\n", r->id);
+    }
+}
+
+
+static bool sendListedNote(Note *n, void *arg)
+{
+    ClientContext *ctx = (ClientContext *)arg;
+
+    Packet noteP;
+    memset(&noteP, 0, sizeof(noteP));
+    noteP.op = OP_LIST_NOTES_RESP;
+    noteP.tag = n->id;
+    memcpy(noteP.message, n->ciphertext, MSG_SIZE);
+    return sendPacketEncrypted(ctx, &noteP);
+}
+
+
+static bool sendPreloadedNote(Note *n, void *arg)
+{
+    PreloadState *st = (PreloadState *)arg;
+    if (st->left == 0) {
+        return false;
+    }
+    st->left--;
+    return sendListedNote(n, st->ctx);
+}
+
+
+static bool sendRangeNote(Note *n, void *arg)
+{
+    RangeState *st = (RangeState *)arg;
+    if (n->id > st->last) {
+        return false;
+    }
+    return sendListedNote(n, st->ctx);
+}
+
+
+/* Handle list notes request */
+void handleListNotes(ClientContext *ctx, Packet *req)
+{
+    Room *r = findRoomById(ctx->current_room_id);
+    if (r != NULL) {
+        forEachNote(r, sendListedNote, ctx);
+    }
+    sendEndMarker(ctx, r != NULL ? r->version : 0);
+}
+
+
+/* Handle conditional list request: one packet if the room is still at
+ * the client's version (req->tag), else the full list
+ */
+void handleListIfChanged(ClientContext *ctx, Packet *req)
+{
+    Room *r = findRoomById(ctx->current_room_id);
+    if (r == NULL || r->version != req->tag) {
+        handleListNotes(ctx, req);
+        return;
+    }
+
+    Packet resp;
+    memset(&resp, 0, sizeof(resp));
+    resp.op = OP_NOT_MODIFIED;
+    resp.room_id = r->version;
+    sendPacketEncrypted(ctx, &resp);
+}
+
+
+/* Handle subscribe request (tag 1) or unsubscribe (tag 0) */
+void handleSubscribe(ClientContext *ctx, Packet *req)
+{
+    Packet resp;
+    memset(&resp, 0, sizeof(resp));
+    resp.op = OP_SUBSCRIBE_RESP;
+    resp.room_id = -1;
+    resp.tag = -1;
+
+    Room *r = findRoomById(ctx->current_room_id);
+    if (req->tag != 0 && r != NULL) {
+        fanout_subscribe(ctx, r);
+        resp.room_id = r->id;
+        resp.tag = r->note_count;
+    } else {
+        fanout_unsubscribe(ctx);
+        if (r != NULL) {
+            resp.room_id = r->id;
+            resp.tag = r->note_count;
+        }
+    }
+    sendPacketEncrypted(ctx, &resp);
+}
+
+
+/* Handle room digest request: digests of level req->tag (counted down
+ * from the root if negative) starting at node req->room_id
+ */
+void handleRoomDigest(ClientContext *ctx, Packet *req)
+{
+    Packet resp;
+    memset(&resp, 0, sizeof(resp));
+    resp.op = OP_ROOM_DIGEST_RESP;
+
+    Room *r = findRoomById(ctx->current_room_id);
+    if (r != NULL) {
+        digest_update(r);
+        int levels = digest_levels(r);
+        int level = req->tag < 0 ? levels + req->tag : req->tag;
+
+        uint64_t digests[DIGEST_PER_PACKET];
+        int n = digest_read(r, level, req->room_id, digests,
+                            DIGEST_PER_PACKET);
+        memcpy(resp.message, digests, n * sizeof(uint64_t));
+        resp.room_id = r->note_count;
+        resp.tag = levels;
+    }
+    sendPacketEncrypted(ctx, &resp);
+}
+
+
+/* Handle list range request: notes req->room_id to req->tag */
+void handleListRange(ClientContext *ctx, Packet *req)
+{
+    Room *r = findRoomById(ctx->current_room_id);
+    if (r != NULL) {
+        RangeState st;
+        st.ctx = ctx;
+        st.last = req->tag;
+        int after = req->room_id > 1 ? req->room_id - 1 : 0;
+        forEachNoteAfter(r, after, sendRangeNote, &st);
+    }
+    sendEndMarker(ctx, r != NULL ? r->version : 0);
+}
+
+
+/* End a run of OP_LIST_NOTES_RESP packets, giving the room's version */
+void sendEndMarker(ClientContext *ctx, int version)
+{
+    Packet endP;
+    memset(&endP, 0, sizeof(endP));
+    endP.op = OP_LIST_NOTES_RESP;
+    endP.room_id = version;
+    endP.tag = 0;
+    sendPacketEncrypted(ctx, &endP);
+}
+
+
+bool sendPacketEncrypted(ClientContext *ctx, Packet *p)
+{
+    Packet tmp;
+    memcpy(&tmp, p, sizeof(Packet));
+    xor_buffer(tmp.message, MSG_SIZE, ctx->shared_key);
+    return transmitPacket(ctx, &tmp);
+}
@@ -0,0 +1,91 @@
+/* requestHandler.h
+ *
+ * Server Request Handling - Header File
+ *
+ * Everything the server does with a packet once it has been read off a
+ * connection: the Diffie-Hellman handshake, decryption, and the room and
+ * note operations. Socket I/O stays in finalServer.cc; responses leave
+ * through transmitPacket(), which the program linking this module must
+ * provide. That seam lets the allocation harness (allocCheck) run the
+ * real request handling without any sockets.
+ */
+
+#ifndef _REQUESTHANDLER_H
+#define _REQUESTHANDLER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "finalPacket.h"
+#include "noteStore.h"
+#include "bufferPool.h"
+#include "socket.h"
+
+/* Data structure for tracking client connection state
+ *
+ * rbuf and wbuf are borrowed from the buffer pool only while a partial
+ * request or unsent replies are pending; both are NULL when idle.
+ * While awaiting_log is set, wbuf is held until the write-ahead log is
+ * durable up to ack_seq (see walLog.h). dh_private is set when the server
+ * has sent its public value first (beginHandshake()), and is 0 otherwise.
+ * The next early_left requests are 0-RTT early data, decrypted with
+ * early_key, or dropped if it is 0 (see earlyKey.h). A subscribed
+ * connection is on its room's subscriber list and has been pushed every
+ * note up to push_after (see fanout.h); pushes_pending counts fan-out
+ * batches that still refer to it, and send_lock serializes its sends
+ * with those of the fan-out workers. send_queue holds what the socket
+ * would not take at once, and is NULL until the first time that happens;
+ * push_room is the id of the subscribed room (0 if none) for the threads
+ * that manage it, and is guarded by send_lock.
+ */
+struct SendQueue;
+
+struct ClientContext {
+    Socket *sock;
+    unsigned long long shared_key;
+    unsigned long long dh_private;
+    unsigned long long early_key;
+    int early_left;
+    bool dh_completed;
+    int current_room_id;
+    uint32_t conn_id;
+    PoolBuffer *rbuf;
+    PoolBuffer *wbuf;
+    uint64_t ack_seq;
+    bool awaiting_log;
+    Room *subscribed;
+    int push_after;
+    ClientContext *prev_subscriber;
+    ClientContext *next_subscriber;
+    bool pushed;                /* has a frame queued this turn */
+    ClientContext *next_pushed;
+    int pushes_pending;
+    pthread_mutex_t send_lock;
+    SendQueue *send_queue;
+    int push_room;
+};
+
+/* Set up a new connection's context: no handshake, room or subscription
+ * yet, nothing buffered or queued
+ */
+void initClientContext(ClientContext *ctx, Socket *sock, uint32_t conn_id);
+
+/* Server-first handshake: queue the server's OP_DH_PUB on a new
+ * connection before the client has sent anything. The client can then
+ * derive the key at once and send its own public value together with its
+ * first request; the server does not answer that OP_DH_PUB.
+ */
+void beginHandshake(ClientContext *ctx);
+
+/* Handle one packet exactly as received from the client */
+void handleRequest(ClientContext *ctx, Packet *req);
+
+/* Encrypt a copy of p with the client's key and transmit it */
+bool sendPacketEncrypted(ClientContext *ctx, Packet *p);
+
+/* Provided by the program: write a packet to the client unchanged.
+ * Returns true if the whole packet was sent.
+ */
+bool transmitPacket(ClientContext *ctx, Packet *p);
+
+#endif
@@ -0,0 +1,245 @@
+/* roomArchive.cc
+ *
+ * Room Archives - Implementation
+ *
+ * See roomArchive.h for the file layout.
+ */
+
+#include "roomArchive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "finalPacket.h"
+#include "crc32c.h"
+
+/* stdio buffer used when exporting */
+const size_t ARCHIVE_BUFFER_SIZE = 1 << 20;
+
+/* Function prototypes for top-down design */
+static void sealHeader(ArchiveHeader *hdr);
+static char *readWholeFile(const char *path, long *size);
+static bool checkNotes(const char *p, const char *end, int count);
+static int freeInviteCode(int wanted);
+static double elapsedMillis(struct timespec *start);
+
+
+bool archive_export(Room *r, const char *path, ArchiveStats *stats)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(stats, 0, sizeof(ArchiveStats));
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        return false;
+    }
+    setvbuf(f, NULL, _IOFBF, ARCHIVE_BUFFER_SIZE);
+
+    ArchiveHeader hdr;
+    memcpy(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic));
+    hdr.version = ARCHIVE_VERSION;
+    hdr.invite_code = r->invite_code;
+    hdr.room_key = r->room_key;
+    hdr.note_count = r->note_count;
+    sealHeader(&hdr);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    /* Chunks are linked newest first; write them oldest first */
+    int chunks = 0;
+    for (NoteChunk *c = r->notes; c != NULL; c = c->prev) {
+        chunks++;
+    }
+    NoteChunk **order = (NoteChunk **)malloc(chunks * sizeof(NoteChunk *));
+    int i = chunks;
+    for (NoteChunk *c = r->notes; c != NULL; c = c->prev) {
+        order[--i] = c;
+    }
+
+    uint32_t crc = 0;
+    for (i = 0; i < chunks; i++) {
+        for (int k = 0; k < order[i]->count; k++) {
+            const char *text = order[i]->notes[k].ciphertext;
+            uint16_t len = MSG_SIZE;
+            while (len > 0 && text[len - 1] == '\0') {
+                len--;
+            }
+            fwrite(&len, sizeof(len), 1, f);
+            fwrite(text, 1, len, f);
+            crc = crc32c(crc32c(crc, &len, sizeof(len)), text, len);
+        }
+    }
+    free(order);
+    fwrite(&crc, sizeof(crc), 1, f);
+
+    stats->notes = r->note_count;
+    stats->bytes = ftell(f);
+    bool written = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !written) {
+        unlink(path);
+        return false;
+    }
+
+    stats->millis = elapsedMillis(&start);
+    return true;
+}
+
+
+Room* archive_import(const char *path, ArchiveStats *stats)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(stats, 0, sizeof(ArchiveStats));
+
+    long size;
+    char *data = readWholeFile(path, &size);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    /* Check the header, then every note against the trailing CRC in one
+     * pass, before anything is added to the store
+     */
+    ArchiveHeader hdr;
+    uint32_t want = 0;
+    bool ok = size >= (long)(sizeof(hdr) + sizeof(want));
+    if (ok) {
+        memcpy(&hdr, data, sizeof(hdr));
+        uint32_t crc = hdr.crc;
+        sealHeader(&hdr);
+        ok = memcmp(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic)) == 0 &&
+             hdr.version == ARCHIVE_VERSION && hdr.crc == crc &&
+             hdr.note_count >= 0;
+    }
+
+    const char *notes = data + sizeof(hdr);
+    const char *end = data + size - sizeof(want);
+    if (ok) {
+        memcpy(&want, end, sizeof(want));
+        ok = crc32c(0, notes, end - notes) == want &&
+             checkNotes(notes, end, hdr.note_count);
+    }
+    if (!ok) {
+        printf("Error: %s is not a room archive or is damaged\n", path);
+        free(data);
+        return NULL;
+    }
+
+    Room *r = createRoomFrom(freeInviteCode(hdr.invite_code), hdr.room_key);
+    Note *n = appendNotes(r, hdr.note_count);
+    const char *p = notes;
+    for (int i = 0; i < hdr.note_count; i++) {
+        uint16_t len;
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        memcpy(n[i].ciphertext, p, len);
+        memset(n[i].ciphertext + len, 0, MSG_SIZE - len);
+        p += len;
+    }
+    markRoomDirty(r);
+    free(data);
+
+    stats->notes = hdr.note_count;
+    stats->bytes = size;
+    stats->millis = elapsedMillis(&start);
+    return r;
+}
+
+
+/* --- Helper Functions --- */
+
+/* Set the header's crc to cover the rest of it */
+static void sealHeader(ArchiveHeader *hdr)
+{
+    hdr->crc = 0;
+    hdr->crc = crc32c(0, hdr, sizeof(ArchiveHeader));
+}
+
+
+/* Read all of path into a new buffer, or return NULL */
+static char *readWholeFile(const char *path, long *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: could not open %s\n", path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    char *data = (char *)malloc(st.st_size > 0 ? st.st_size : 1);
+    long done = 0;
+    while (done < st.st_size) {
+        ssize_t n = read(fd, data + done, st.st_size - done);
+        if (n <= 0) {
+            printf("Error: could not read %s\n", path);
+            free(data);
+            close(fd);
+            return NULL;
+        }
+        done += n;
+    }
+    close(fd);
+
+    *size = done;
+    return data;
+}
+
+
+/* Returns true if [p, end) holds exactly count well-formed notes */
+static bool checkNotes(const char *p, const char *end, int count)
+{
+    for (int i = 0; i < count; i++) {
+        uint16_t len;
+        if (end - p < (long)sizeof(len)) {
+            return false;
+        }
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        if (len > MSG_SIZE || end - p < len) {
+            return false;
+        }
+        p += len;
+    }
+    return p == end;
+}
+
+
+/* Keep the wanted invite code if no room uses it, otherwise pick a
+ * random unused one (or any, if every code is taken)
+ */
+static int freeInviteCode(int wanted)
+{
+    if (wanted >= INVITE_MIN && wanted <= INVITE_MAX &&
+        findRoomByInvite(wanted) == NULL) {
+        return wanted;
+    }
+
+    int range = INVITE_MAX - INVITE_MIN + 1;
+    int code = rand() % range + INVITE_MIN;
+    for (int i = 0; i < range; i++) {
+        int c = INVITE_MIN + (code - INVITE_MIN + i) % range;
+        if (findRoomByInvite(c) == NULL) {
+            return c;
+        }
+    }
+    return code;
+}
+
+
+static double elapsedMillis(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3 +
+           (end.tv_nsec - start->tv_nsec) / 1e6;
+}
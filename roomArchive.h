@@ -0,0 +1,61 @@
+/* roomArchive.h
+ *
+ * Room Archives - Header File
+ *
+ * A room archive is one room (its invite code, key and every note) in a
+ * single compact binary file, for moving a room between servers or
+ * seeding a test server without replaying OP_POST_NOTE one packet at a
+ * time. roomTool exports and imports archives against a data directory.
+ *
+ * FILE LAYOUT:
+ * -----------
+ *   ArchiveHeader
+ *   note_count notes of (uint16 length, text), oldest first
+ *   uint32 crc              (CRC32C of the notes)
+ *
+ * Note text is stored without its trailing zero bytes, as in the log and
+ * checkpoints. The notes are still encrypted under the room key, which
+ * travels with them.
+ *
+ * Export streams the notes straight out of the room's chunks. Import
+ * reads the whole file with one read, checks it, and copies the notes
+ * into a single chunk (appendNotes() in noteStore.h), so its cost is the
+ * read plus one pass over memory.
+ */
+
+#ifndef _ROOMARCHIVE_H
+#define _ROOMARCHIVE_H
+
+#include <stdint.h>
+
+#include "noteStore.h"
+
+const char ARCHIVE_MAGIC[8] = { 'S', 'N', 'R', 'O', 'O', 'M', '0', '1' };
+const uint32_t ARCHIVE_VERSION = 1;
+
+struct ArchiveHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t invite_code;
+    uint64_t room_key;
+    int32_t note_count;
+    uint32_t crc;           /* CRC32C of this header with crc set to 0 */
+};
+
+struct ArchiveStats {
+    long notes;
+    long bytes;
+    double millis;
+};
+
+/* Write room r to path. Returns false if the file could not be written. */
+bool archive_export(Room *r, const char *path, ArchiveStats *stats);
+
+/* Load the archive at path into the store as a new room, which is marked
+ * dirty so the next checkpoint saves it. The room gets a fresh id; it
+ * keeps its invite code unless another room already uses it, in which
+ * case it gets a new one. Returns NULL if the file is missing or damaged.
+ */
+Room* archive_import(const char *path, ArchiveStats *stats);
+
+#endif
@@ -0,0 +1,203 @@
+/* roomBench.cc
+ *
+ * SecureCollabNotes Room and Note Microbenchmark
+ *
+ * This program measures the room and note data structures in noteStore
+ * directly (no sockets, no crypto) at several scales, so that changes to
+ * those structures can be measured rather than guessed. For each scale it
+ * reports nanoseconds per operation and heap bytes per object.
+ *
+ * Every scale runs in its own child process, so each one starts with an
+ * empty store and its memory figures are not polluted by the previous
+ * scale. Lookups that are slow at large scales are time-boxed: they run
+ * until LOOKUP_OPS operations or LOOKUP_BUDGET_NS, whichever comes first.
+ *
+ * Usage: roomBench [max-rooms] [max-notes]
+ *
+ *   max-rooms   Largest room count to try (default 10000000)
+ *   max-notes   Largest note count per room to try (default 1000000)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/wait.h>
+
+#include "finalPacket.h"
+#include "noteStore.h"
+
+/* Scales to measure (each capped by the command-line maximums) */
+const long ROOM_SCALES[] = { 1000, 100000, 10000000 };
+const long NOTE_SCALES[] = { 1000, 100000, 1000000 };
+const int SCALE_COUNT = 3;
+
+/* Limits for each timed lookup run */
+const long LOOKUP_OPS = 1000000;
+const double LOOKUP_BUDGET_NS = 2e9;
+
+/* Function prototypes for top-down design */
+void benchRooms(long rooms);
+void benchNotes(long notes);
+void runInChild(void (*bench)(long), long scale);
+
+/* Helper functions */
+double nowNanos();
+size_t heapInUse();
+void report(const char *scale, const char *op, long ops, double ns);
+bool countNote(Note *n, void *arg);
+
+/* Global variables */
+long maxRooms = 10000000;
+long maxNotes = 1000000;
+
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        maxRooms = atol(argv[1]);
+    }
+    if (argc > 2) {
+        maxNotes = atol(argv[2]);
+    }
+
+    srand(1);
+    printf("%-14s %-18s %12s %12s\n", "scale", "operation", "ops", "ns/op");
+
+    for (int i = 0; i < SCALE_COUNT; i++) {
+        if (ROOM_SCALES[i] <= maxRooms) {
+            runInChild(benchRooms, ROOM_SCALES[i]);
+        }
+    }
+    for (int i = 0; i < SCALE_COUNT; i++) {
+        if (NOTE_SCALES[i] <= maxNotes) {
+            runInChild(benchNotes, NOTE_SCALES[i]);
+        }
+    }
+
+    return 0;
+}
+
+
+/* Room registry: create N rooms, then look them up by id and invite */
+void benchRooms(long rooms)
+{
+    char scale[32];
+    snprintf(scale, sizeof(scale), "%ld rooms", rooms);
+
+    size_t heapBefore = heapInUse();
+    double start = nowNanos();
+    for (long i = 0; i < rooms; i++) {
+        createRoom();
+    }
+    double elapsed = nowNanos() - start;
+    size_t heapAfter = heapInUse();
+    report(scale, "createRoom", rooms, elapsed);
+
+    /* Random existing ids */
+    long ops = 0;
+    long found = 0;
+    start = nowNanos();
+    while (ops < LOOKUP_OPS && nowNanos() - start < LOOKUP_BUDGET_NS) {
+        for (int j = 0; j < 16; j++, ops++) {
+            found += findRoomById(1 + rand() % rooms) != NULL;
+        }
+    }
+    report(scale, "findRoomById", ops, nowNanos() - start);
+
+    /* Random codes from the invite code range */
+    ops = 0;
+    start = nowNanos();
+    while (ops < LOOKUP_OPS && nowNanos() - start < LOOKUP_BUDGET_NS) {
+        for (int j = 0; j < 16; j++, ops++) {
+            found += findRoomByInvite(1000 + rand() % 9000) != NULL;
+        }
+    }
+    report(scale, "findRoomByInvite", ops, nowNanos() - start);
+
+    printf("%-14s %-18s %25.1f bytes/room\n", scale, "memory",
+           (double)(heapAfter - heapBefore) / rooms);
+    if (found == 0) {
+        printf("Error: no lookups succeeded\n");
+    }
+}
+
+
+/* Note log: append N notes to one room, then walk them */
+void benchNotes(long notes)
+{
+    char scale[32];
+    snprintf(scale, sizeof(scale), "%ld notes", notes);
+
+    char content[MSG_SIZE];
+    memset(content, 'n', sizeof(content));
+
+    Room *r = createRoom();
+    size_t heapBefore = heapInUse();
+    double start = nowNanos();
+    for (long i = 0; i < notes; i++) {
+        addNote(r, content);
+    }
+    double elapsed = nowNanos() - start;
+    size_t heapAfter = heapInUse();
+    report(scale, "addNote", notes, elapsed);
+
+    long visited = 0;
+    start = nowNanos();
+    forEachNote(r, countNote, &visited);
+    report(scale, "forEachNote/note", visited, nowNanos() - start);
+
+    printf("%-14s %-18s %25.1f bytes/note\n", scale, "memory",
+           (double)(heapAfter - heapBefore) / notes);
+}
+
+
+void runInChild(void (*bench)(long), long scale)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        bench(scale);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%-14ld (benchmark failed)\n", scale);
+    }
+}
+
+
+/* --- Helper Functions --- */
+
+double nowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+size_t heapInUse()
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+
+void report(const char *scale, const char *op, long ops, double ns)
+{
+    printf("%-14s %-18s %12ld %12.1f\n", scale, op, ops, ops ? ns / ops : 0);
+}
+
+
+bool countNote(Note *n, void *arg)
+{
+    (*(long *)arg)++;
+    return true;
+}
@@ -0,0 +1,160 @@
+/* roomDigest.cc
+ *
+ * Room Digests (Merkle Trees) - Implementation
+ *
+ * Every level is an array of digests that doubles as the room grows. The
+ * tree belongs to the thread that handles the room's requests.
+ */
+
+#include "roomDigest.h"
+
+#include <string.h>
+
+/* Starting value of an inner node, so that a node never has the digest
+ * of a leaf with the same input
+ */
+const uint64_t NODE_SEED = 0x6a09e667f3bcc908ULL;
+
+struct RoomDigest {
+    int notes;                              /* notes hashed so far */
+    int levels;
+    uint64_t *nodes[DIGEST_MAX_LEVELS];
+    int count[DIGEST_MAX_LEVELS];
+    int capacity[DIGEST_MAX_LEVELS];
+};
+
+/* Function prototypes for top-down design */
+static bool hashNote(Note *n, void *arg);
+static void growLevel(RoomDigest *d, int level, int count);
+static uint64_t mix(uint64_t h, uint64_t word);
+
+
+void digest_update(Room *r)
+{
+    if (r->digest == NULL) {
+        r->digest = new RoomDigest();
+        memset(r->digest, 0, sizeof(RoomDigest));
+    }
+    RoomDigest *d = r->digest;
+    if (d->notes == r->note_count) {
+        return;
+    }
+
+    /* Extend the leaves, then recombine everything from the first leaf
+     * that changed to the end of each level
+     */
+    int first = d->notes / DIGEST_LEAF_NOTES;
+    forEachNoteAfter(r, d->notes, hashNote, d);
+
+    int level = 0;
+    while (d->count[level] > 1) {
+        int below = d->count[level];
+        level++;
+        first /= 2;
+        growLevel(d, level, (below + 1) / 2);
+        for (int j = first; j < d->count[level]; j++) {
+            uint64_t right = 2 * j + 1 < below ? d->nodes[level - 1][2 * j + 1]
+                                               : 0;
+            d->nodes[level][j] = digest_combine(d->nodes[level - 1][2 * j],
+                                                right);
+        }
+    }
+    d->levels = level + 1;
+}
+
+
+int digest_levels(Room *r)
+{
+    return r->digest != NULL ? r->digest->levels : 0;
+}
+
+
+int digest_read(Room *r, int level, int first, uint64_t *out, int max)
+{
+    RoomDigest *d = r->digest;
+    if (d == NULL || level < 0 || level >= d->levels || first < 0 ||
+        first >= d->count[level]) {
+        return 0;
+    }
+
+    int n = d->count[level] - first;
+    if (n > max) {
+        n = max;
+    }
+    memcpy(out, &d->nodes[level][first], n * sizeof(uint64_t));
+    return n;
+}
+
+
+int digest_level_size(int notes, int level)
+{
+    int size = (notes + DIGEST_LEAF_NOTES - 1) / DIGEST_LEAF_NOTES;
+    for (int k = 0; k < level && size > 1; k++) {
+        size = (size + 1) / 2;
+    }
+    return size;
+}
+
+
+uint64_t digest_note(uint64_t leaf, int id, const char *text)
+{
+    uint64_t h = mix(leaf, (uint64_t)(uint32_t)id);
+    for (int i = 0; i < MSG_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, text + i, sizeof(word));
+        h = mix(h, word);
+    }
+    return h;
+}
+
+
+uint64_t digest_combine(uint64_t left, uint64_t right)
+{
+    return mix(mix(NODE_SEED, left), right);
+}
+
+
+/* --- Helper Functions --- */
+
+/* Add a note to its leaf */
+static bool hashNote(Note *n, void *arg)
+{
+    RoomDigest *d = (RoomDigest *)arg;
+    int leaf = (n->id - 1) / DIGEST_LEAF_NOTES;
+    growLevel(d, 0, leaf + 1);
+    d->nodes[0][leaf] = digest_note(d->nodes[0][leaf], n->id, n->ciphertext);
+    d->notes = n->id;
+    return true;
+}
+
+
+/* Make a level count nodes long; new nodes start at 0 */
+static void growLevel(RoomDigest *d, int level, int count)
+{
+    if (count > d->capacity[level]) {
+        int capacity = d->capacity[level] > 0 ? d->capacity[level] : 4;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        uint64_t *nodes = new uint64_t[capacity];
+        memcpy(nodes, d->nodes[level], d->count[level] * sizeof(uint64_t));
+        delete [] d->nodes[level];
+        d->nodes[level] = nodes;
+        d->capacity[level] = capacity;
+    }
+    for (int j = d->count[level]; j < count; j++) {
+        d->nodes[level][j] = 0;
+    }
+    if (count > d->count[level]) {
+        d->count[level] = count;
+    }
+}
+
+
+/* One multiply-xorshift round */
+static uint64_t mix(uint64_t h, uint64_t word)
+{
+    h ^= word;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 32);
+}
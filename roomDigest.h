@@ -0,0 +1,76 @@
+/* roomDigest.h
+ *
+ * Room Digests (Merkle Trees) - Header File
+ *
+ * Bringing a client cache or a replica of a large room up to date should
+ * not mean transferring every note. Each room can keep a Merkle tree over
+ * its notes, so two parties compare digests instead of notes and only
+ * fetch the ranges that differ (OP_ROOM_DIGEST and OP_LIST_RANGE, see
+ * finalPacket.h).
+ *
+ * THE TREE:
+ * --------
+ * Leaf i covers the note ids i * DIGEST_LEAF_NOTES + 1 up to
+ * (i + 1) * DIGEST_LEAF_NOTES. Its digest chains digest_note() over the
+ * notes it has so far, oldest first. Node j of level k > 0 is
+ * digest_combine() of nodes 2j and 2j + 1 of level k - 1 (0 stands in for
+ * a missing right child). The top level has a single node, the root.
+ *
+ * Because a node's range depends only on its position, and not on how
+ * many notes the room has, the nodes of two copies of a room that hold
+ * the same notes in that range have the same digest even if the copies
+ * differ in length. Comparing the roots and then, level by level, the
+ * children of each differing node finds the differing leaves in one
+ * round trip per level.
+ *
+ * Notes are only ever appended, so only the last leaf and its ancestors
+ * change. A room's tree is built on its first digest request and from
+ * then on brought up to date at each request by hashing just the notes
+ * added since the last one and recombining their ancestors.
+ *
+ * The digests detect divergence; they are not a cryptographic hash and
+ * do not protect against a party that forges notes on purpose.
+ */
+
+#ifndef _ROOMDIGEST_H
+#define _ROOMDIGEST_H
+
+#include <stdint.h>
+
+#include "noteStore.h"
+
+/* Notes covered by one leaf */
+const int DIGEST_LEAF_NOTES = 64;
+
+/* Most levels a tree can have (enough for any int note count) */
+const int DIGEST_MAX_LEVELS = 32;
+
+/* Digests that fit in one packet's message */
+const int DIGEST_PER_PACKET = MSG_SIZE / sizeof(uint64_t);
+
+/* Bring r's tree up to date with its notes, building it on first use */
+void digest_update(Room *r);
+
+/* Levels in r's tree as of the last digest_update() (0 for a room with
+ * no notes). Level 0 holds the leaves and the root is at levels - 1.
+ */
+int digest_levels(Room *r);
+
+/* Copy up to max digests of a level, starting at node first, into out.
+ * Returns the number copied (0 if level or first is out of range).
+ */
+int digest_read(Room *r, int level, int first, uint64_t *out, int max);
+
+/* Number of nodes at a level of the tree of a room with 'notes' notes,
+ * so that the other party can work out the shape of the tree
+ */
+int digest_level_size(int notes, int level);
+
+/* The hashing rules, for a party building its own tree: extend a leaf's
+ * digest (0 for an empty leaf) with the next note, and combine two
+ * children
+ */
+uint64_t digest_note(uint64_t leaf, int id, const char *text);
+uint64_t digest_combine(uint64_t left, uint64_t right);
+
+#endif
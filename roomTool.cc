@@ -0,0 +1,142 @@
+/* roomTool.cc
+ *
+ * SecureCollabNotes Room Export/Import Tool
+ *
+ * This program copies rooms in and out of a server's data directory as
+ * room archives (see roomArchive.h), without going through the protocol.
+ * The data directory is loaded the same way the server loads it on
+ * startup, so the server must not be running on it at the same time.
+ *
+ * Imported rooms are made durable with a checkpoint delta, exactly as the
+ * server would checkpoint them, and the log is emptied afterwards; the
+ * next server start loads them with everything else.
+ *
+ * Usage: roomTool export <data-dir> <room-id> <file>
+ *        roomTool import <data-dir> <file> [file ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "noteStore.h"
+#include "walLog.h"
+#include "checkpoint.h"
+#include "roomArchive.h"
+
+/* Function prototypes for top-down design */
+void usage();
+void loadDataDir(const char *dir);
+int exportRoom(const char *dir, int roomId, const char *path);
+int importRooms(const char *dir, int count, char *paths[]);
+
+
+int main(int argc, char *argv[])
+{
+    srand(time(NULL));
+
+    if (argc == 5 && strcmp(argv[1], "export") == 0) {
+        return exportRoom(argv[2], atoi(argv[3]), argv[4]);
+    }
+    if (argc >= 4 && strcmp(argv[1], "import") == 0) {
+        return importRooms(argv[2], argc - 3, argv + 3);
+    }
+
+    usage();
+    return 1;
+}
+
+
+void usage()
+{
+    printf("Usage: roomTool export <data-dir> <room-id> <file>\n");
+    printf("       roomTool import <data-dir> <file> [file ...]\n");
+}
+
+
+int exportRoom(const char *dir, int roomId, const char *path)
+{
+    loadDataDir(dir);
+
+    Room *r = findRoomById(roomId);
+    if (r == NULL) {
+        printf("Error: there is no room %d in %s\n", roomId, dir);
+        return 1;
+    }
+
+    ArchiveStats stats;
+    if (!archive_export(r, path, &stats)) {
+        printf("Error: could not write %s\n", path);
+        return 1;
+    }
+    printf("Exported room %d (invite code %d): %ld notes, %.1f MB "
+           "in %.1f ms (%.0f MB/s)\n", r->id, r->invite_code, stats.notes,
+           stats.bytes / 1e6, stats.millis,
+           stats.bytes / 1e3 / (stats.millis > 0 ? stats.millis : 1e-3));
+    return 0;
+}
+
+
+int importRooms(const char *dir, int count, char *paths[])
+{
+    loadDataDir(dir);
+
+    for (int i = 0; i < count; i++) {
+        ArchiveStats stats;
+        Room *r = archive_import(paths[i], &stats);
+        if (r == NULL) {
+            printf("Error: nothing was imported\n");
+            return 1;
+        }
+        printf("Imported %s as room %d (invite code %d): %ld notes, "
+               "%.1f MB in %.1f ms (%.0f MB/s)\n", paths[i], r->id,
+               r->invite_code, stats.notes, stats.bytes / 1e6, stats.millis,
+               stats.bytes / 1e3 / (stats.millis > 0 ? stats.millis : 1e-3));
+    }
+
+    /* Save the new rooms, along with anything recovered from the log, in
+     * one delta; the log can then be emptied
+     */
+    if (!wal_open(dir)) {
+        printf("Error: could not open the log in %s\n", dir);
+        return 1;
+    }
+    if (!ckpt_open(dir)) {
+        wal_close();
+        return 1;
+    }
+
+    CkptStats stats;
+    if (!ckpt_write(&stats)) {
+        printf("Error: could not write a checkpoint in %s\n", dir);
+        wal_close();
+        return 1;
+    }
+    wal_reset();
+    ckpt_close();
+    wal_close();
+
+    printf("Checkpoint %u: %ld rooms, %ld notes (%.1f KB) in %.1f ms\n",
+           stats.sequence, stats.rooms, stats.notes, stats.bytes / 1e3,
+           stats.millis);
+    return 0;
+}
+
+
+/* Load checkpoints and replay the log, as the server does on startup */
+void loadDataDir(const char *dir)
+{
+    CkptStats loaded;
+    if (!ckpt_load(dir, &loaded)) {
+        printf("Error: could not load the checkpoints in %s\n", dir);
+        exit(1);
+    }
+
+    WalRecoveryStats stats;
+    if (!wal_recover(dir, (int)sysconf(_SC_NPROCESSORS_ONLN), &stats)) {
+        printf("Error: could not recover the log in %s\n", dir);
+        exit(1);
+    }
+}
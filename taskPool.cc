@@ -0,0 +1,381 @@
+/* taskPool.cc
+ *
+ * Background Task Pool - Implementation
+ *
+ * Each deque is a ring buffer under its own lock; the lock is only ever
+ * contended when a thief and the owner meet on the same deque, which is
+ * rare for the coarse tasks submitted here.
+ */
+
+#include "taskPool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+struct Task {
+    TaskFunc fn;
+    void *arg;
+    int cls;
+};
+
+/* Owner pushes and pops at the bottom, thieves take from the top */
+struct TaskDeque {
+    pthread_mutex_t lock;
+    Task *items;
+    int capacity;           /* a power of two */
+    long top;
+    long bottom;
+};
+
+struct TaskThread {
+    pthread_t thread;
+    int index;
+    TaskDeque lanes[TASK_LANES];
+    int cls;                /* class of the running task */
+    struct timespec cpuMark;
+};
+
+struct ClassRecord {
+    char name[32];
+    long tasks;
+    long steals;
+    long cpuNs;
+    long throttledNs;
+};
+
+static TaskThread *threads = NULL;
+static int threadCount = 0;
+static int nextThread = 0;              /* for dealing outside tasks */
+static __thread TaskThread *self = NULL;
+
+/* queued and unfinished, and the classes, are guarded by poolLock */
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t allDone = PTHREAD_COND_INITIALIZER;
+static long queued = 0;
+static long unfinished = 0;
+static ClassRecord classes[TASK_MAX_CLASSES];
+static int classCount = 0;
+
+/* The CPU cap: budgetNs of CPU time per window */
+static pthread_mutex_t capLock = PTHREAD_MUTEX_INITIALIZER;
+static long budgetNs = 0;
+static long windowUsedNs = 0;
+static struct timespec windowStart;
+
+/* Function prototypes for top-down design */
+static void *runTasks(void *arg);
+static bool takeTask(TaskThread *t, Task *task, bool *stolen);
+static bool popBottom(TaskDeque *d, Task *task);
+static bool stealTop(TaskDeque *d, Task *task);
+static void pushBottom(TaskDeque *d, Task *task);
+static void account(TaskThread *t);
+static void throttle(TaskThread *t);
+static long elapsedNs(struct timespec *from, struct timespec *to);
+
+
+void tasks_init(int count, int cpuPercent)
+{
+    if (threads != NULL) {
+        return;
+    }
+    if (count < 1) {
+        count = 1;
+    }
+    if (cpuPercent < 1) {
+        cpuPercent = 1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    budgetNs = (long)TASK_CPU_WINDOW_MS * 1000000 * cpus * cpuPercent / 100;
+    clock_gettime(CLOCK_MONOTONIC, &windowStart);
+
+    threadCount = count;
+    threads = new TaskThread[count];
+    for (int i = 0; i < count; i++) {
+        threads[i].index = i;
+        threads[i].cls = 0;
+        for (int lane = 0; lane < TASK_LANES; lane++) {
+            TaskDeque *d = &threads[i].lanes[lane];
+            pthread_mutex_init(&d->lock, NULL);
+            d->capacity = 64;
+            d->items = new Task[d->capacity];
+            d->top = 0;
+            d->bottom = 0;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_create(&threads[i].thread, NULL, runTasks, &threads[i]);
+    }
+}
+
+
+int task_class(const char *name)
+{
+    pthread_mutex_lock(&poolLock);
+    int id = 0;
+    while (id < classCount && strcmp(classes[id].name, name) != 0) {
+        id++;
+    }
+    if (id == TASK_MAX_CLASSES) {
+        id = -1;    /* Table full: don't mix its stats into another's */
+    } else if (id == classCount) {
+        memset(&classes[id], 0, sizeof(ClassRecord));
+        strncpy(classes[id].name, name, sizeof(classes[id].name) - 1);
+        classCount++;
+    }
+    pthread_mutex_unlock(&poolLock);
+    return id;
+}
+
+
+void task_submit(int cls, int lane, TaskFunc fn, void *arg)
+{
+    if (threads == NULL) {
+        tasks_init((int)sysconf(_SC_NPROCESSORS_ONLN),
+                   TASK_DEFAULT_CPU_PERCENT);
+    }
+
+    Task task;
+    task.fn = fn;
+    task.arg = arg;
+    task.cls = cls;
+
+    TaskThread *t = self;
+    if (t == NULL) {
+        pthread_mutex_lock(&poolLock);
+        t = &threads[nextThread];
+        nextThread = (nextThread + 1) % threadCount;
+        pthread_mutex_unlock(&poolLock);
+    }
+
+    /* Count the task before it can be seen: once pushed it may be stolen
+     * and finished at once, and neither counter may drop below the tasks
+     * really outstanding. A thread woken in between finds nothing yet and
+     * looks again.
+     */
+    pthread_mutex_lock(&poolLock);
+    queued++;
+    unfinished++;
+    pthread_mutex_unlock(&poolLock);
+
+    pushBottom(&t->lanes[lane], &task);
+    pthread_cond_signal(&workReady);
+}
+
+
+void task_yield()
+{
+    if (self != NULL) {
+        account(self);
+        throttle(self);
+    }
+}
+
+
+void tasks_wait()
+{
+    pthread_mutex_lock(&poolLock);
+    while (unfinished > 0) {
+        pthread_cond_wait(&allDone, &poolLock);
+    }
+    pthread_mutex_unlock(&poolLock);
+}
+
+
+void task_stats(int cls, TaskClassStats *stats)
+{
+    pthread_mutex_lock(&poolLock);
+    stats->name = classes[cls].name;
+    stats->tasks = classes[cls].tasks;
+    stats->steals = classes[cls].steals;
+    stats->cpu_ms = classes[cls].cpuNs / 1e6;
+    stats->throttled_ms = classes[cls].throttledNs / 1e6;
+    pthread_mutex_unlock(&poolLock);
+}
+
+
+int task_classes()
+{
+    pthread_mutex_lock(&poolLock);
+    int count = classCount;
+    pthread_mutex_unlock(&poolLock);
+    return count;
+}
+
+
+/* --- Helper Functions --- */
+
+/* Pool thread: run tasks, sleeping while there are none */
+static void *runTasks(void *arg)
+{
+    TaskThread *t = (TaskThread *)arg;
+    self = t;
+
+    while (true) {
+        Task task;
+        bool stolen;
+        if (!takeTask(t, &task, &stolen)) {
+            pthread_mutex_lock(&poolLock);
+            while (queued == 0) {
+                pthread_cond_wait(&workReady, &poolLock);
+            }
+            pthread_mutex_unlock(&poolLock);
+            continue;
+        }
+
+        pthread_mutex_lock(&poolLock);
+        queued--;
+        pthread_mutex_unlock(&poolLock);
+
+        t->cls = task.cls;
+        throttle(t);
+        task.fn(task.arg);
+        account(t);
+
+        pthread_mutex_lock(&poolLock);
+        classes[task.cls].tasks++;
+        if (stolen) {
+            classes[task.cls].steals++;
+        }
+        if (--unfinished == 0) {
+            pthread_cond_broadcast(&allDone);
+        }
+        pthread_mutex_unlock(&poolLock);
+    }
+    return NULL;
+}
+
+
+/* The next task for t: its own newest, else another thread's oldest,
+ * trying each lane in priority order
+ */
+static bool takeTask(TaskThread *t, Task *task, bool *stolen)
+{
+    for (int lane = 0; lane < TASK_LANES; lane++) {
+        if (popBottom(&t->lanes[lane], task)) {
+            *stolen = false;
+            return true;
+        }
+        for (int i = 1; i < threadCount; i++) {
+            TaskThread *victim = &threads[(t->index + i) % threadCount];
+            if (stealTop(&victim->lanes[lane], task)) {
+                *stolen = true;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+static bool popBottom(TaskDeque *d, Task *task)
+{
+    pthread_mutex_lock(&d->lock);
+    bool found = d->bottom > d->top;
+    if (found) {
+        d->bottom--;
+        *task = d->items[d->bottom & (d->capacity - 1)];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+
+static bool stealTop(TaskDeque *d, Task *task)
+{
+    pthread_mutex_lock(&d->lock);
+    bool found = d->bottom > d->top;
+    if (found) {
+        *task = d->items[d->top & (d->capacity - 1)];
+        d->top++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+
+static void pushBottom(TaskDeque *d, Task *task)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top == d->capacity) {
+        Task *items = new Task[d->capacity * 2];
+        for (long i = d->top; i < d->bottom; i++) {
+            items[i & (d->capacity * 2 - 1)] = d->items[i & (d->capacity - 1)];
+        }
+        delete [] d->items;
+        d->items = items;
+        d->capacity *= 2;
+    }
+    d->items[d->bottom & (d->capacity - 1)] = *task;
+    d->bottom++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+
+/* Charge the CPU t has used since its last mark to its task's class and
+ * to the current window
+ */
+static void account(TaskThread *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    long used = elapsedNs(&t->cpuMark, &now);
+    t->cpuMark = now;
+
+    pthread_mutex_lock(&poolLock);
+    classes[t->cls].cpuNs += used;
+    pthread_mutex_unlock(&poolLock);
+
+    pthread_mutex_lock(&capLock);
+    windowUsedNs += used;
+    pthread_mutex_unlock(&capLock);
+}
+
+
+/* Sleep until the current window ends if its budget is spent */
+static void throttle(TaskThread *t)
+{
+    while (true) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        pthread_mutex_lock(&capLock);
+        long windowNs = (long)TASK_CPU_WINDOW_MS * 1000000;
+        long intoWindow = elapsedNs(&windowStart, &now);
+        if (intoWindow >= windowNs) {
+            /* CPU beyond the budget is carried into the next window */
+            windowUsedNs = windowUsedNs > budgetNs ? windowUsedNs - budgetNs
+                                                   : 0;
+            windowStart = now;
+            intoWindow = 0;
+        }
+        bool over = windowUsedNs >= budgetNs;
+        pthread_mutex_unlock(&capLock);
+
+        if (!over) {
+            break;
+        }
+
+        long waitNs = windowNs - intoWindow;
+        struct timespec pause;
+        pause.tv_sec = waitNs / 1000000000;
+        pause.tv_nsec = waitNs % 1000000000;
+        nanosleep(&pause, NULL);
+
+        pthread_mutex_lock(&poolLock);
+        classes[t->cls].throttledNs += waitNs;
+        pthread_mutex_unlock(&poolLock);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t->cpuMark);
+}
+
+
+static long elapsedNs(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000L +
+           (to->tv_nsec - from->tv_nsec);
+}
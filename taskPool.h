@@ -0,0 +1,86 @@
+/* taskPool.h
+ *
+ * Background Task Pool - Header File
+ *
+ * Maintenance work (merging checkpoints, and anything else that needs CPU
+ * but must stay off the request event loop) is submitted here as tasks
+ * rather than each subsystem starting threads of its own. The pool's
+ * threads are shared, so they are only as busy as the work requires.
+ *
+ * SCHEDULING:
+ * ----------
+ * Every thread has a deque per priority lane. A task submitted from a
+ * pool thread goes to the bottom of that thread's own deque, and one from
+ * anywhere else is dealt to the threads in turn. A thread takes its own
+ * newest task first (its data is still in cache) and, with nothing of its
+ * own left, steals the oldest task from another thread. TASK_HIGH tasks
+ * are always taken before TASK_LOW ones.
+ *
+ * CPU ACCOUNTING AND CAP:
+ * ----------------------
+ * Each task is submitted under a class (task_class()), and the thread CPU
+ * time of every task is added to its class. All classes together may use
+ * at most the configured share of the machine's CPUs: the pool counts
+ * CPU time in windows of TASK_CPU_WINDOW_MS, and once a window's budget
+ * is spent, threads pause before their next task (or inside a long task,
+ * at task_yield()) until the window ends.
+ */
+
+#ifndef _TASKPOOL_H
+#define _TASKPOOL_H
+
+/* Priority lanes */
+const int TASK_HIGH = 0;
+const int TASK_LOW = 1;
+const int TASK_LANES = 2;
+
+/* Most task classes that can be registered */
+const int TASK_MAX_CLASSES = 16;
+
+/* Length of a CPU accounting window */
+const int TASK_CPU_WINDOW_MS = 100;
+
+/* Share of all CPUs background tasks may use unless told otherwise */
+const int TASK_DEFAULT_CPU_PERCENT = 50;
+
+typedef void (*TaskFunc)(void *arg);
+
+struct TaskClassStats {
+    const char *name;
+    long tasks;             /* finished */
+    long steals;            /* run by a thread that stole them */
+    double cpu_ms;          /* thread CPU time used */
+    double throttled_ms;    /* time spent paused by the cap */
+};
+
+/* Start 'threads' pool threads whose tasks may use at most cpuPercent of
+ * all CPUs. If this is never called, the first task_submit() starts one
+ * thread per CPU with TASK_DEFAULT_CPU_PERCENT.
+ */
+void tasks_init(int threads, int cpuPercent);
+
+/* Register a class of tasks by name, returning its id (the existing id
+ * if the name is already registered). At most TASK_MAX_CLASSES names can
+ * be registered; once they have been, a new name gets -1.
+ */
+int task_class(const char *name);
+
+/* Run fn(arg) on a pool thread. cls must be an id from task_class(). */
+void task_submit(int cls, int lane, TaskFunc fn, void *arg);
+
+/* Called by long tasks between steps: account the CPU used so far, and
+ * pause while background work is over its share. Does nothing outside
+ * the pool.
+ */
+void task_yield();
+
+/* Wait until every task submitted so far has finished */
+void tasks_wait();
+
+/* Statistics for class cls since startup */
+void task_stats(int cls, TaskClassStats *stats);
+
+/* Number of classes registered */
+int task_classes();
+
+#endif
@@ -0,0 +1,766 @@
+/* walLog.cc
+ *
+ * Write-Ahead Log - Implementation
+ *
+ * See walLog.h for the segment layout and durability guarantees.
+ */
+
+#include "walLog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "ioRing.h"
+#include "crc32c.h"
+#include "numaPlace.h"
+
+/* Queue depth of the ring: a write and a sync per segment, twice over */
+const unsigned WAL_RING_ENTRIES = 4 * WAL_SEGMENTS;
+
+/* Marks the sync half of a segment's write/sync pair in user_data */
+const uint64_t WAL_SYNC_TAG = 1 << 16;
+
+/* Writer state for one open segment. buf[active] holds the file from
+ * offset base (a block boundary) onwards; the other buffer is the one
+ * the last commit wrote from.
+ */
+struct WalSegment {
+    int fd;
+    char *buf[2];
+    int active;
+    long base;
+    int len;                /* bytes of log in buf[active] */
+    int writing;            /* bytes the in-flight write covers */
+    bool dirty;             /* appended to since the last commit */
+};
+
+static WalSegment segmentWriters[WAL_SEGMENTS];
+static bool walOpen = false;
+static bool directIo = false;
+
+/* io_uring state; useRing is false when commits are synchronous */
+static IoRing ring;
+static bool useRing = false;
+static bool fixedBuffers = false;
+static int eventFd = -1;
+
+/* Group commit state */
+static uint64_t walSequence = 0;     /* records logged */
+static uint64_t walDurable = 0;      /* records known to be on disk */
+static uint64_t commitSequence = 0;  /* records the in-flight commit covers */
+static int commitPending = 0;        /* completions it still waits for */
+
+/* Recovery state for one segment. Rooms are kept in rooms[id / WAL_SEGMENTS]
+ * until they are linked into the store.
+ */
+struct SegmentState {
+    int segment;
+    char path[512];
+    Room **rooms;
+    int slots;              /* allocated length of rooms[] */
+    int roomCount;
+    long notes;
+    long bytes;
+    long torn;
+    long mismatched;
+    bool damaged;
+    bool ok;
+};
+
+/* What each recovery worker is given */
+struct RecoveryWorker {
+    pthread_t thread;
+    int first;              /* first segment; then every step-th one */
+    int step;
+};
+
+static SegmentState segmentStates[WAL_SEGMENTS];
+static pthread_barrier_t recoveryBarrier;
+
+/* Function prototypes for top-down design */
+static void *recoverSegments(void *arg);
+static void replaySegment(SegmentState *s);
+static bool replayRecord(SegmentState *s, WalRecord *rec, const char *payload);
+static void keepRoom(SegmentState *s, Room *r);
+static void segmentPath(char *buf, size_t size, const char *dir, int segment);
+static bool openSegment(WalSegment *w, const char *path, int segment);
+static void startSegment(WalSegment *w, int segment);
+static void startCommit();
+static void finishCommit(IoRingResult *c);
+static void walFailed(const char *what, int err);
+static void appendRecord(int room_id, uint16_t type, int value,
+                         const void *payload, int len);
+
+
+bool wal_recover(const char *dir, int threads, WalRecoveryStats *stats)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > WAL_SEGMENTS) {
+        threads = WAL_SEGMENTS;
+    }
+
+    for (int i = 0; i < WAL_SEGMENTS; i++) {
+        memset(&segmentStates[i], 0, sizeof(SegmentState));
+        segmentStates[i].segment = i;
+        segmentStates[i].ok = true;
+        segmentPath(segmentStates[i].path, sizeof(segmentStates[i].path),
+                    dir, i);
+    }
+
+    /* Phase 1: workers replay their segments into private rooms */
+    pthread_barrier_init(&recoveryBarrier, NULL, threads + 1);
+    RecoveryWorker *workers = new RecoveryWorker[threads];
+    for (int w = 0; w < threads; w++) {
+        workers[w].first = w;
+        workers[w].step = threads;
+        pthread_create(&workers[w].thread, NULL, recoverSegments, &workers[w]);
+    }
+    pthread_barrier_wait(&recoveryBarrier);
+
+    /* Phase 2: size the id index once, then workers fill their buckets */
+    int total = roomCount();
+    for (int i = 0; i < WAL_SEGMENTS; i++) {
+        total += segmentStates[i].roomCount;
+    }
+    reserveRoomIndex(total);
+    pthread_barrier_wait(&recoveryBarrier);
+
+    for (int w = 0; w < threads; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    delete[] workers;
+    pthread_barrier_destroy(&recoveryBarrier);
+
+    /* Phase 3: link new rooms in id order, so the newest ends up first.
+     * Every room the log touched now differs from the last checkpoint.
+     */
+    int maxSlots = 0;
+    for (int i = 0; i < WAL_SEGMENTS; i++) {
+        if (segmentStates[i].slots > maxSlots) {
+            maxSlots = segmentStates[i].slots;
+        }
+    }
+    for (int slot = 0; slot < maxSlots; slot++) {
+        for (int i = 0; i < WAL_SEGMENTS; i++) {
+            SegmentState *s = &segmentStates[i];
+            if (slot < s->slots && s->rooms[slot] != NULL) {
+                Room *r = s->rooms[slot];
+                if (r->saved_notes < 0) {
+                    linkRestoredRoom(r);
+                }
+                markRoomDirty(r);
+            }
+        }
+    }
+
+    bool ok = true;
+    memset(stats, 0, sizeof(WalRecoveryStats));
+    stats->threads = threads;
+    for (int i = 0; i < WAL_SEGMENTS; i++) {
+        SegmentState *s = &segmentStates[i];
+        ok = ok && s->ok;
+        stats->rooms += s->roomCount;
+        stats->notes += s->notes;
+        stats->bytes += s->bytes;
+        stats->torn += s->torn;
+        stats->damaged += s->damaged;
+        stats->mismatched += s->mismatched;
+        free(s->rooms);
+        s->rooms = NULL;
+    }
+
+    if (stats->mismatched > 0) {
+        printf("Error: %ld notes in the log do not follow on from the "
+               "store\n", stats->mismatched);
+        ok = false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->millis = (end.tv_sec - start.tv_sec) * 1e3 +
+                    (end.tv_nsec - start.tv_nsec) / 1e6;
+    return ok;
+}
+
+
+/* Worker thread: replay, wait for the index, then index */
+static void *recoverSegments(void *arg)
+{
+    RecoveryWorker *w = (RecoveryWorker *)arg;
+
+    /* Wherever this thread runs, the rooms belong with the event loop */
+    place_prefer_memory(place_home());
+
+    for (int i = w->first; i < WAL_SEGMENTS; i += w->step) {
+        replaySegment(&segmentStates[i]);
+    }
+    pthread_barrier_wait(&recoveryBarrier);
+
+    /* Every room of segment i has id % WAL_SEGMENTS == i, and each
+     * segment belongs to exactly one worker, so no bucket is shared.
+     */
+    pthread_barrier_wait(&recoveryBarrier);
+    for (int i = w->first; i < WAL_SEGMENTS; i += w->step) {
+        SegmentState *s = &segmentStates[i];
+        for (int slot = 0; slot < s->slots; slot++) {
+            if (s->rooms[slot] != NULL && s->rooms[slot]->saved_notes < 0) {
+                indexRoomById(s->rooms[slot]);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/* Replay one segment file, truncating any torn tail */
+static void replaySegment(SegmentState *s)
+{
+    int fd = open(s->path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    long size = st.st_size;
+    if (size < (long)sizeof(WalHeader)) {
+        /* Crashed before the header was written; start the segment over */
+        close(fd);
+        if (size > 0) {
+            truncate(s->path, 0);
+        }
+        return;
+    }
+
+    char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        s->ok = false;
+        return;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    WalHeader *hdr = (WalHeader *)data;
+    if (memcmp(hdr->magic, WAL_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != WAL_VERSION || (int)hdr->segment != s->segment) {
+        printf("Error: %s is not segment %d of a log\n", s->path, s->segment);
+        munmap(data, size);
+        s->ok = false;
+        return;
+    }
+
+    long off = sizeof(WalHeader);
+    bool padded = false;
+    while (off + (long)sizeof(WalRecord) <= size) {
+        WalRecord rec;
+        memcpy(&rec, data + off, sizeof(rec));
+        if (rec.type == 0) {
+            padded = true;
+            break;
+        }
+        long next = off + sizeof(WalRecord) + rec.len;
+        if (next > size) {
+            break;
+        }
+
+        const char *payload = data + off + sizeof(rec);
+        uint32_t crc = rec.crc;
+        rec.crc = 0;
+        if (crc32c(crc32c(0, &rec, sizeof(rec)), payload, rec.len) != crc) {
+            printf("Error: checksum mismatch in %s at offset %ld\n",
+                   s->path, off);
+            s->damaged = true;
+            break;
+        }
+        if (!replayRecord(s, &rec, payload)) {
+            break;
+        }
+        off = next;
+    }
+    munmap(data, size);
+
+    s->bytes = off;
+    if (off < size) {
+        if (!padded) {
+            s->torn = size - off;
+        }
+        truncate(s->path, off);
+    }
+}
+
+
+/* Apply one record. Returns false if it is not a valid record, which is
+ * treated the same as a torn tail.
+ *
+ * Rooms and notes already loaded from a checkpoint are skipped, in case
+ * the server stopped between writing a checkpoint and resetting the log.
+ * Any other note must be the next one of a known room; those that are not
+ * are counted as mismatched rather than renumbered or dropped.
+ * The store's id index is only read here, and nothing writes it until
+ * every worker has finished this phase.
+ */
+static bool replayRecord(SegmentState *s, WalRecord *rec, const char *payload)
+{
+    if (rec->room_id <= 0 || rec->room_id % WAL_SEGMENTS != s->segment) {
+        return false;
+    }
+    int slot = rec->room_id / WAL_SEGMENTS;
+    Room *r = slot < s->slots ? s->rooms[slot] : NULL;
+    if (r == NULL) {
+        r = findRoomById(rec->room_id);
+    }
+
+    if (rec->type == WAL_ROOM) {
+        if (rec->len != sizeof(unsigned long long)) {
+            return false;
+        }
+        if (r == NULL) {
+            unsigned long long key;
+            memcpy(&key, payload, sizeof(key));
+            keepRoom(s, newRoom(rec->room_id, rec->value, key));
+        }
+        return true;
+    }
+
+    if (rec->type == WAL_NOTE) {
+        if (rec->len > MSG_SIZE) {
+            return false;
+        }
+        if (r == NULL || rec->value > r->note_count + 1) {
+            if (s->mismatched++ == 0) {
+                printf("Error: note %d of room %d in %s does not follow on "
+                       "from the store\n", rec->value, rec->room_id,
+                       s->path);
+            }
+        } else if (rec->value == r->note_count + 1) {
+            char text[MSG_SIZE];
+            memset(text, 0, sizeof(text));
+            memcpy(text, payload, rec->len);
+            addNote(r, text);
+            keepRoom(s, r);
+            s->notes++;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
+static void keepRoom(SegmentState *s, Room *r)
+{
+    int slot = r->id / WAL_SEGMENTS;
+    if (slot >= s->slots) {
+        int slots = s->slots > 0 ? s->slots : 1024;
+        while (slots <= slot) {
+            slots *= 2;
+        }
+        s->rooms = (Room **)realloc(s->rooms, slots * sizeof(Room *));
+        memset(s->rooms + s->slots, 0, (slots - s->slots) * sizeof(Room *));
+        s->slots = slots;
+    }
+
+    if (s->rooms[slot] == NULL && r->saved_notes < 0) {
+        s->roomCount++;
+    }
+    s->rooms[slot] = r;
+}
+
+
+bool wal_open(const char *dir)
+{
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return false;
+    }
+
+    useRing = ring_init(&ring, WAL_RING_ENTRIES);
+    directIo = true;
+    for (int i = 0; i < WAL_SEGMENTS; i++) {
+        char path[512];
+        segmentPath(path, sizeof(path), dir, i);
+        if (!openSegment(&segmentWriters[i], path, i)) {
+            wal_close();
+            return false;
+        }
+    }
+
+    if (useRing) {
+        struct iovec iov[2 * WAL_SEGMENTS];
+        for (int i = 0; i < WAL_SEGMENTS; i++) {
+            for (int k = 0; k < 2; k++) {
+                iov[2 * i + k].iov_base = segmentWriters[i].buf[k];
+                iov[2 * i + k].iov_len = WAL_BUFFER_SIZE;
+            }
+        }
+        fixedBuffers = ring_register_buffers(&ring, iov, 2 * WAL_SEGMENTS);
+
+        /* Without an eventfd nothing would tell the server a commit is
+         * done, so fall back to synchronous commits
+         */
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFd < 0 || !ring_register_eventfd(&ring, eventFd)) {
+            if (eventFd >= 0) {
+                close(eventFd);
+                eventFd = -1;
+            }
+            ring_close(&ring);
+            useRing = false;
+            fixedBuffers = false;
+        }
+    }
+
+    walSequence = walDurable = commitSequence = 0;
+    commitPending = 0;
+    walOpen = true;
+    return true;
+}
+
+
+/* Open one segment for direct appends and load its partial last block */
+static bool openSegment(WalSegment *w, const char *path, int segment)
+{
+    memset(w, 0, sizeof(WalSegment));
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    w->fd = directIo ? open(path, flags | O_DIRECT, 0644) : -1;
+    if (w->fd < 0) {
+        directIo = false;
+        w->fd = open(path, flags, 0644);
+    }
+    if (w->fd < 0) {
+        return false;
+    }
+
+    w->buf[0] = (char *)aligned_alloc(WAL_BLOCK, WAL_BUFFER_SIZE);
+    w->buf[1] = (char *)aligned_alloc(WAL_BLOCK, WAL_BUFFER_SIZE);
+
+    struct stat st;
+    fstat(w->fd, &st);
+    w->base = st.st_size & ~(long)(WAL_BLOCK - 1);
+    w->len = st.st_size - w->base;
+
+    if (w->len > 0) {
+        int rfd = open(path, O_RDONLY | O_CLOEXEC);
+        bool loaded = rfd >= 0 && pread(rfd, w->buf[0], w->len, w->base) ==
+                                  w->len;
+        if (rfd >= 0) {
+            close(rfd);
+        }
+        if (!loaded) {
+            return false;
+        }
+    }
+
+    if (st.st_size == 0) {
+        startSegment(w, segment);
+    }
+    return true;
+}
+
+
+/* Begin an empty segment: just its header, at offset 0 */
+static void startSegment(WalSegment *w, int segment)
+{
+    WalHeader hdr;
+    memcpy(hdr.magic, WAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = WAL_VERSION;
+    hdr.segment = segment;
+    memcpy(w->buf[w->active], &hdr, sizeof(hdr));
+    w->base = 0;
+    w->len = sizeof(hdr);
+    w->dirty = true;
+}
+
+
+bool wal_enabled()
+{
+    return walOpen;
+}
+
+
+const char *wal_engine()
+{
+    if (useRing) {
+        if (fixedBuffers) {
+            return directIo ? "io_uring, registered buffers, O_DIRECT"
+                            : "io_uring, registered buffers";
+        }
+        return directIo ? "io_uring, O_DIRECT" : "io_uring";
+    }
+    return directIo ? "synchronous, O_DIRECT" : "synchronous";
+}
+
+
+void wal_log_room(Room *r)
+{
+    if (!walOpen) {
+        return;
+    }
+    appendRecord(r->id, WAL_ROOM, r->invite_code, &r->room_key,
+                 sizeof(r->room_key));
+}
+
+
+void wal_log_note(Room *r, Note *n)
+{
+    if (!walOpen) {
+        return;
+    }
+
+    int len = MSG_SIZE;
+    while (len > 0 && n->ciphertext[len - 1] == '\0') {
+        len--;
+    }
+    appendRecord(r->id, WAL_NOTE, n->id, n->ciphertext, len);
+}
+
+
+uint64_t wal_sequence()
+{
+    return walSequence;
+}
+
+
+uint64_t wal_durable()
+{
+    return walDurable;
+}
+
+
+void wal_flush()
+{
+    if (!walOpen || commitPending > 0) {
+        return;
+    }
+    startCommit();
+}
+
+
+/* Write and sync every dirty segment, then switch each one to its other
+ * buffer, carrying over the partial last block (which the next commit
+ * writes again, with whatever has been appended to it).
+ */
+static void startCommit()
+{
+    commitSequence = walSequence;
+
+    for (int i = 0; i < WAL_SEGMENTS; i++) {
+        WalSegment *w = &segmentWriters[i];
+        if (!w->dirty) {
+            continue;
+        }
+
+        int length = (w->len + WAL_BLOCK - 1) & ~(WAL_BLOCK - 1);
+        char *data = w->buf[w->active];
+        memset(data + w->len, 0, length - w->len);
+        w->writing = length;
+
+        if (useRing) {
+            IoRingEntry *e = ring_next(&ring);
+            e->opcode = fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            e->flags = IOSQE_IO_LINK;
+            e->fd = w->fd;
+            e->addr = (uint64_t)data;
+            e->len = length;
+            e->off = w->base;
+            e->buf_index = 2 * i + w->active;
+            e->user_data = i;
+
+            e = ring_next(&ring);
+            e->opcode = IORING_OP_FSYNC;
+            e->fd = w->fd;
+            e->fsync_flags = IORING_FSYNC_DATASYNC;
+            e->user_data = i | WAL_SYNC_TAG;
+            commitPending += 2;
+        } else {
+            if (pwrite(w->fd, data, length, w->base) != length) {
+                walFailed("write", errno);
+            }
+            if (fdatasync(w->fd) != 0) {
+                walFailed("sync", errno);
+            }
+        }
+
+        int keep = w->len & ~(WAL_BLOCK - 1);
+        int tail = w->len - keep;
+        w->active ^= 1;
+        memcpy(w->buf[w->active], data + keep, tail);
+        w->base += keep;
+        w->len = tail;
+        w->dirty = false;
+    }
+
+    if (commitPending == 0) {
+        walDurable = commitSequence;
+    } else if (!ring_submit(&ring, 0)) {
+        walFailed("submit", errno);
+    }
+}
+
+
+int wal_event_fd()
+{
+    return useRing ? eventFd : -1;
+}
+
+
+void wal_reap()
+{
+    if (!useRing) {
+        return;
+    }
+
+    uint64_t count;
+    while (read(eventFd, &count, sizeof(count)) > 0) {
+    }
+
+    IoRingResult *c;
+    while ((c = ring_peek(&ring)) != NULL) {
+        finishCommit(c);
+        ring_seen(&ring);
+    }
+}
+
+
+static void finishCommit(IoRingResult *c)
+{
+    int segment = c->user_data & (WAL_SYNC_TAG - 1);
+    bool sync = (c->user_data & WAL_SYNC_TAG) != 0;
+
+    if (c->res < 0) {
+        walFailed(sync ? "sync" : "write", -c->res);
+    }
+    if (!sync && c->res != segmentWriters[segment].writing) {
+        walFailed("write", EIO);
+    }
+
+    if (--commitPending == 0) {
+        walDurable = commitSequence;
+    }
+}
+
+
+void wal_sync()
+{
+    if (!walOpen) {
+        return;
+    }
+
+    while (true) {
+        if (commitPending > 0) {
+            if (!ring_submit(&ring, 1)) {
+                walFailed("wait", errno);
+            }
+            wal_reap();
+            continue;
+        }
+
+        bool dirty = false;
+        for (int i = 0; i < WAL_SEGMENTS; i++) {
+            dirty = dirty || segmentWriters[i].dirty;
+        }
+        if (!dirty) {
+            return;
+        }
+        startCommit();
+    }
+}
+
+
+void wal_reset()
+{
+    wal_sync();
+
+    for (int i = 0; i < WAL_SEGMENTS; i++) {
+        WalSegment *w = &segmentWriters[i];
+        if (ftruncate(w->fd, 0) != 0) {
+            walFailed("reset", errno);
+        }
+        startSegment(w, i);
+    }
+    wal_sync();
+}
+
+
+void wal_close()
+{
+    wal_sync();
+
+    for (int i = 0; i < WAL_SEGMENTS; i++) {
+        WalSegment *w = &segmentWriters[i];
+        if (w->fd > 0) {
+            close(w->fd);
+        }
+        free(w->buf[0]);
+        free(w->buf[1]);
+        memset(w, 0, sizeof(WalSegment));
+    }
+
+    if (useRing) {
+        ring_close(&ring);
+        close(eventFd);
+        eventFd = -1;
+        useRing = false;
+        fixedBuffers = false;
+    }
+
+    walOpen = false;
+    walSequence = walDurable = 0;
+}
+
+
+/* --- Helper Functions --- */
+
+static void segmentPath(char *buf, size_t size, const char *dir, int segment)
+{
+    snprintf(buf, size, "%s/wal-%02d.log", dir, segment);
+}
+
+
+/* A log that cannot be written can no longer keep its promises to
+ * clients, so stop rather than carry on with data that may be lost
+ */
+static void walFailed(const char *what, int err)
+{
+    printf("Error: log %s failed: %s\n", what, strerror(err));
+    exit(1);
+}
+
+
+/* Append to the record's segment buffer, committing first if it is full */
+static void appendRecord(int room_id, uint16_t type, int value,
+                         const void *payload, int len)
+{
+    WalSegment *w = &segmentWriters[room_id % WAL_SEGMENTS];
+    if (w->len + (int)sizeof(WalRecord) + len > WAL_BUFFER_SIZE) {
+        wal_sync();
+    }
+
+    WalRecord rec;
+    rec.type = type;
+    rec.len = (uint16_t)len;
+    rec.room_id = room_id;
+    rec.value = value;
+    rec.crc = 0;
+    rec.crc = crc32c(crc32c(0, &rec, sizeof(rec)), payload, len);
+
+    char *end = w->buf[w->active] + w->len;
+    memcpy(end, &rec, sizeof(rec));
+    memcpy(end + sizeof(rec), payload, len);
+    w->len += sizeof(rec) + len;
+    w->dirty = true;
+    walSequence++;
+}
@@ -0,0 +1,161 @@
+/* walLog.h
+ *
+ * Write-Ahead Log - Header File
+ *
+ * Makes rooms and notes survive a server restart. Every room created and
+ * every note posted is appended to a log on disk, and on startup the log
+ * is replayed to rebuild the store before any client is accepted.
+ *
+ * SEGMENTS:
+ * --------
+ * The log is split by room id into WAL_SEGMENTS files, <dir>/wal-NN.log,
+ * with room r (and all of its notes) in segment r % WAL_SEGMENTS. A
+ * segment therefore only depends on itself, and recovery replays the
+ * segments on a pool of worker threads: each worker rebuilds its rooms
+ * and their id index buckets without locking (see the recovery steps in
+ * noteStore.h), and only the final linking of rooms into the room list
+ * and invite index is done on one thread.
+ *
+ * FILE LAYOUT (per segment):
+ * -------------------------
+ *   WalHeader                               (once)
+ *   WalRecord + payload, WalRecord + ...    (in the order they happened)
+ *   zero bytes                              (padding to a WAL_BLOCK boundary)
+ *
+ * The padding is left by block-sized direct writes; a record type of 0
+ * marks the end of the log. A record cut short by a crash, or whose
+ * checksum does not match, ends the segment: it and everything after it
+ * are dropped when the segment is recovered.
+ *
+ * DURABILITY:
+ * ----------
+ * Records are appended to a per-segment buffer and written by group
+ * commit: wal_flush(), called once per pass of the server's event loop,
+ * writes every changed segment and fdatasyncs it. When io_uring is
+ * available the writes and syncs are queued to the kernel and the call
+ * returns at once; the server keeps handling requests, and learns the
+ * commit finished when wal_event_fd() becomes readable. Replies are held
+ * back until wal_durable() has caught up with the records they depend on.
+ *
+ * Segment files are opened with O_DIRECT where the filesystem supports
+ * it, so log data does not pass through (or crowd) the page cache, and
+ * the buffers are registered with the ring so the kernel does not have
+ * to map them on every write. Without io_uring the same commit is done
+ * synchronously inside wal_flush().
+ */
+
+#ifndef _WALLOG_H
+#define _WALLOG_H
+
+#include <stdint.h>
+
+#include "noteStore.h"
+
+/* Number of segment files; a power of two no larger than ROOM_INDEX_MIN */
+const int WAL_SEGMENTS = 16;
+
+/* Alignment of direct writes (offsets, lengths and buffer addresses) */
+const int WAL_BLOCK = 4096;
+
+/* Size of each segment's append buffers. Each segment has two, so one
+ * can be written to disk while the other fills.
+ */
+const int WAL_BUFFER_SIZE = 128 * 1024;
+
+const char WAL_MAGIC[8] = { 'S', 'N', 'W', 'A', 'L', 'O', 'G', '1' };
+const uint32_t WAL_VERSION = 2;
+
+/* Record types */
+const uint16_t WAL_ROOM = 1;    /* value = invite code, payload = room key */
+const uint16_t WAL_NOTE = 2;    /* value = note id, payload = note text */
+
+struct WalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t segment;       /* this file's segment number */
+};
+
+/* One logged event (16 bytes), followed by len bytes of payload.
+ * Note text is stored without its trailing zero bytes. crc is the CRC32C
+ * of the record (with crc set to 0) followed by its payload.
+ */
+struct WalRecord {
+    uint16_t type;
+    uint16_t len;
+    int32_t room_id;
+    int32_t value;
+    uint32_t crc;
+};
+
+/* Totals reported by wal_recover() */
+struct WalRecoveryStats {
+    int threads;
+    int rooms;
+    long notes;
+    long bytes;             /* log bytes replayed */
+    long torn;              /* bytes dropped from torn segment tails */
+    int damaged;            /* segments cut short by a checksum mismatch */
+    long mismatched;        /* notes that do not follow on from the store */
+    double millis;          /* wall-clock recovery time */
+};
+
+/* Rebuild the store from the log in dir using the given number of worker
+ * threads, on top of any rooms already loaded from a checkpoint. Must run
+ * before wal_open(). Every room the log touches is marked dirty.
+ * A missing directory or segment is treated as empty. Returns false if a
+ * segment exists but is not a log file, or if the log and the store
+ * disagree: a note for a room neither of them has, or one that does not
+ * directly follow its room's last note (a record or checkpoint delta has
+ * been lost). Notes the store already holds are skipped.
+ */
+bool wal_recover(const char *dir, int threads, WalRecoveryStats *stats);
+
+/* Start appending to the log in dir, creating the directory and segment
+ * files as needed. Existing segments must have been through
+ * wal_recover() first. Returns false if they could not be opened.
+ */
+bool wal_open(const char *dir);
+
+/* Returns true while the log is open */
+bool wal_enabled();
+
+/* Describes how the log writes, e.g. "io_uring, O_DIRECT" */
+const char *wal_engine();
+
+/* Log a newly created room, or a note just added to a room. Both do
+ * nothing if the log is not open.
+ */
+void wal_log_room(Room *r);
+void wal_log_note(Room *r, Note *n);
+
+/* Number of records logged so far, and how many of those are known to be
+ * on disk. Both are 0 while the log is closed.
+ */
+uint64_t wal_sequence();
+uint64_t wal_durable();
+
+/* Start a group commit of everything logged since the last one, unless a
+ * commit is already in progress (the next call picks up the rest).
+ */
+void wal_flush();
+
+/* Readable when a commit may have finished; call wal_reap() then.
+ * Returns -1 if commits complete synchronously.
+ */
+int wal_event_fd();
+
+/* Collect finished writes and syncs, advancing wal_durable() */
+void wal_reap();
+
+/* Wait until everything logged so far is on disk */
+void wal_sync();
+
+/* Empty every segment once a checkpoint holds all they record. Waits for
+ * the log to be durable first.
+ */
+void wal_reset();
+
+/* Sync and close every segment */
+void wal_close();
+
+#endif
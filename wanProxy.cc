@@ -0,0 +1,479 @@
+/* wanProxy.cc
+ *
+ * SecureCollabNotes WAN Emulation Proxy
+ *
+ * Loopback benchmarks hide network round trips. This program sits
+ * between a load generator (or finalClient) and finalServer and delays
+ * the traffic in each direction the way a wide-area link would:
+ *
+ *   - a fixed one-way delay (so the round trip is twice the delay),
+ *   - random jitter on top of that delay,
+ *   - a bandwidth cap, modelled as the time to serialize each chunk.
+ *
+ * Delivery never reorders data: a chunk is never released before the
+ * chunk read ahead of it on the same connection, even if its own jitter
+ * sample was smaller. TCP on both sides therefore sees a slow, bumpy, but
+ * in-order link, which is what pipelining and batching need to be
+ * evaluated against.
+ *
+ * Like a real link, the proxy holds only so much data in flight. Once a
+ * direction has queueLimit bytes read but not yet delivered, its sender
+ * is no longer read from, so the sender's own socket fills up and it
+ * feels backpressure instead of the delay growing without bound. With a
+ * bandwidth cap the limit is what the link holds, bandwidth times the
+ * longest delay, plus one CHUNK_SIZE so that a chunk is always waiting
+ * for the link; without one it is UNCAPPED_QUEUE_BYTES.
+ *
+ * The proxy uses POSIX sockets and poll() directly, rather than the
+ * Socket/InputSelector classes, because it needs non-blocking writes and
+ * a timeout for the next scheduled delivery.
+ *
+ * Usage: wanProxy <listen-port> <server-addr> <server-port> [options]
+ *
+ *   -d ms      One-way delay in milliseconds (default 50)
+ *   -j ms      Jitter: extra delay uniformly drawn from 0..ms (default 0)
+ *   -b kbit    Bandwidth cap per direction in kbit/s (default: no cap);
+ *              also limits the data queued per direction (see above)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Maximum number of proxied connections */
+const int MAX_PAIRS = 512;
+
+/* Largest chunk read from a socket at once */
+const int CHUNK_SIZE = 16384;
+
+/* Most bytes queued per direction when there is no bandwidth cap */
+const long UNCAPPED_QUEUE_BYTES = 16 * 1024 * 1024;
+
+/* Data waiting to be delivered in one direction */
+struct Chunk {
+    long long deliver_at;   /* microseconds, monotonic clock */
+    int len;                /* 0 marks end-of-stream */
+    int offset;             /* bytes already written */
+    Chunk *next;
+    char data[];
+};
+
+/* One direction of a proxied connection */
+struct Direction {
+    int from;
+    int to;
+    Chunk *head;
+    Chunk *tail;
+    long queued;              /* bytes read but not yet delivered */
+    long long link_free_at;   /* when the emulated link finishes sending */
+    bool read_closed;
+    bool write_closed;
+};
+
+/* A client connection and its connection to the server */
+struct Pair {
+    bool active;
+    Direction up;     /* client -> server */
+    Direction down;   /* server -> client */
+};
+
+/* Function prototypes for top-down design */
+void getProxyOptions(int argc, char *argv[]);
+int listenOn(int port);
+void proxyLoop();
+void acceptClient();
+void readDirection(Direction *d);
+void writeDirection(Direction *d);
+void closePairIfDone(Pair *p);
+
+/* Helper functions */
+long long nowMicros();
+long long scheduleChunk(Direction *d, int len);
+int connectToServer();
+void setNonBlocking(int fd);
+
+/* Global variables */
+int listenPort;
+char *serverAddr;
+int serverPort;
+long long delayMicros = 50000;
+long long jitterMicros = 0;
+double bytesPerMicro = 0;   /* 0 means no bandwidth cap */
+long queueLimit = UNCAPPED_QUEUE_BYTES;
+
+int listenFd;
+Pair pairs[MAX_PAIRS];
+
+
+int main(int argc, char *argv[])
+{
+    /* Writes to a peer that went away must not kill the proxy */
+    signal(SIGPIPE, SIG_IGN);
+
+    getProxyOptions(argc, argv);
+    listenFd = listenOn(listenPort);
+
+    printf("Proxying :%d -> %s:%d (delay %lld ms, jitter %lld ms, ",
+           listenPort, serverAddr, serverPort, delayMicros / 1000,
+           jitterMicros / 1000);
+    if (bytesPerMicro > 0) {
+        printf("%.0f kbit/s)\n", bytesPerMicro * 8000);
+    } else {
+        printf("no bandwidth cap)\n");
+    }
+
+    proxyLoop();
+    return 0;
+}
+
+
+void proxyLoop()
+{
+    struct pollfd fds[1 + 2 * MAX_PAIRS];
+    Direction *owners[1 + 2 * MAX_PAIRS];
+
+    while (true) {
+        long long now = nowMicros();
+        long long nextDue = -1;
+        int n = 0;
+
+        fds[n].fd = listenFd;
+        fds[n].events = POLLIN;
+        owners[n++] = NULL;
+
+        for (int i = 0; i < MAX_PAIRS; i++) {
+            if (!pairs[i].active) {
+                continue;
+            }
+
+            /* Deliver whatever is already due, and retire finished pairs
+             * before their descriptors are handed to poll()
+             */
+            writeDirection(&pairs[i].up);
+            writeDirection(&pairs[i].down);
+            closePairIfDone(&pairs[i]);
+            if (!pairs[i].active) {
+                continue;
+            }
+
+            Direction *dirs[2] = { &pairs[i].up, &pairs[i].down };
+            for (int k = 0; k < 2; k++) {
+                Direction *d = dirs[k];
+
+                /* Past the limit, leave the data in the sender's socket */
+                if (!d->read_closed && d->queued < queueLimit) {
+                    fds[n].fd = d->from;
+                    fds[n].events = POLLIN;
+                    owners[n++] = d;
+                }
+                if (d->head != NULL && !d->write_closed) {
+                    if (d->head->deliver_at <= now) {
+                        /* Due but the socket was full: wait for room */
+                        fds[n].fd = d->to;
+                        fds[n].events = POLLOUT;
+                        owners[n++] = d;
+                    } else if (nextDue < 0 || d->head->deliver_at < nextDue) {
+                        nextDue = d->head->deliver_at;
+                    }
+                }
+            }
+        }
+
+        int timeout = -1;
+        if (nextDue >= 0) {
+            timeout = (int)((nextDue - nowMicros() + 999) / 1000);
+            if (timeout < 0) {
+                timeout = 0;
+            }
+        }
+
+        if (poll(fds, n, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if (owners[i] == NULL) {
+                acceptClient();
+            } else if (fds[i].events & POLLIN) {
+                readDirection(owners[i]);
+            } else {
+                writeDirection(owners[i]);
+            }
+        }
+    }
+}
+
+
+void acceptClient()
+{
+    int clientFd = accept(listenFd, NULL, NULL);
+    if (clientFd < 0) {
+        return;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < MAX_PAIRS; i++) {
+        if (!pairs[i].active) {
+            slot = i;
+            break;
+        }
+    }
+
+    int serverFd = slot >= 0 ? connectToServer() : -1;
+    if (serverFd < 0) {
+        printf("Connection rejected (no slot or server unreachable)\n");
+        close(clientFd);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setNonBlocking(clientFd);
+    setNonBlocking(serverFd);
+
+    Pair *p = &pairs[slot];
+    memset(p, 0, sizeof(Pair));
+    p->active = true;
+    p->up.from = clientFd;
+    p->up.to = serverFd;
+    p->down.from = serverFd;
+    p->down.to = clientFd;
+}
+
+
+void readDirection(Direction *d)
+{
+    char buf[CHUNK_SIZE];
+    int n = read(d->from, buf, sizeof(buf));
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n < 0) {
+        n = 0;   /* Treat errors like end-of-stream */
+    }
+
+    Chunk *c = (Chunk *)malloc(sizeof(Chunk) + n);
+    c->len = n;
+    c->offset = 0;
+    c->next = NULL;
+    memcpy(c->data, buf, n);
+    c->deliver_at = scheduleChunk(d, n);
+    d->queued += n;
+
+    if (d->tail != NULL) {
+        d->tail->next = c;
+    } else {
+        d->head = c;
+    }
+    d->tail = c;
+
+    if (n == 0) {
+        d->read_closed = true;
+    }
+}
+
+
+void writeDirection(Direction *d)
+{
+    long long now = nowMicros();
+
+    while (d->head != NULL && d->head->deliver_at <= now && !d->write_closed) {
+        Chunk *c = d->head;
+
+        if (c->len == 0) {
+            /* End-of-stream reached the far side */
+            shutdown(d->to, SHUT_WR);
+            d->write_closed = true;
+        } else {
+            int n = write(d->to, c->data + c->offset, c->len - c->offset);
+            if (n < 0 && errno == EAGAIN) {
+                return;
+            }
+            if (n < 0) {
+                d->write_closed = true;
+                d->read_closed = true;
+                break;
+            }
+            c->offset += n;
+            d->queued -= n;
+            if (c->offset < c->len) {
+                return;
+            }
+        }
+
+        d->head = c->next;
+        if (d->head == NULL) {
+            d->tail = NULL;
+        }
+        free(c);
+    }
+}
+
+
+void closePairIfDone(Pair *p)
+{
+    bool upDone = p->up.read_closed && (p->up.head == NULL || p->up.write_closed);
+    bool downDone = p->down.read_closed &&
+                    (p->down.head == NULL || p->down.write_closed);
+
+    if (!upDone || !downDone) {
+        return;
+    }
+
+    Direction *dirs[2] = { &p->up, &p->down };
+    for (int k = 0; k < 2; k++) {
+        while (dirs[k]->head != NULL) {
+            Chunk *c = dirs[k]->head;
+            dirs[k]->head = c->next;
+            free(c);
+        }
+    }
+    close(p->up.from);
+    close(p->up.to);
+    p->active = false;
+}
+
+
+void getProxyOptions(int argc, char *argv[])
+{
+    if (argc < 4) {
+        fprintf(stderr, "Error: Invalid number of arguments.\n");
+        fprintf(stderr, "usage: wanProxy <listen-port> <server-addr> "
+                        "<server-port> [-d ms] [-j ms] [-b kbit]\n");
+        exit(1);
+    }
+
+    listenPort = atoi(argv[1]);
+    serverAddr = argv[2];
+    serverPort = atoi(argv[3]);
+
+    for (int i = 4; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-d") == 0) {
+            delayMicros = atof(argv[i + 1]) * 1000;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            jitterMicros = atof(argv[i + 1]) * 1000;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            /* kbit/s -> bytes per microsecond */
+            bytesPerMicro = atof(argv[i + 1]) * 1000 / 8 / 1e6;
+        }
+    }
+
+    if (bytesPerMicro > 0) {
+        queueLimit = (long)(bytesPerMicro * (delayMicros + jitterMicros)) +
+                     CHUNK_SIZE;
+    }
+
+    srand(time(NULL));
+}
+
+
+int listenOn(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 128) != 0) {
+        printf("Error: could not listen on port #%d\n", port);
+        exit(1);
+    }
+    return fd;
+}
+
+
+/* --- Helper Functions --- */
+
+long long nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Work out when a chunk read now may be delivered */
+long long scheduleChunk(Direction *d, int len)
+{
+    long long now = nowMicros();
+
+    /* Bandwidth: the chunk occupies the link after whatever is ahead */
+    long long sent = now;
+    if (bytesPerMicro > 0) {
+        if (d->link_free_at > sent) {
+            sent = d->link_free_at;
+        }
+        sent += (long long)(len / bytesPerMicro);
+        d->link_free_at = sent;
+    }
+
+    long long due = sent + delayMicros;
+    if (jitterMicros > 0) {
+        due += rand() % (jitterMicros + 1);
+    }
+
+    /* Never overtake data that is already queued */
+    if (d->tail != NULL && d->tail->deliver_at > due) {
+        due = d->tail->deliver_at;
+    }
+    return due;
+}
+
+
+int connectToServer()
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    char port[16];
+    snprintf(port, sizeof(port), "%d", serverPort);
+    if (getaddrinfo(serverAddr, port, &hints, &res) != 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    /* The emulated link decides the timing, not Nagle */
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+
+void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}